@@ -2,81 +2,761 @@
 #include<iomanip>
 #include <algorithm>
 #include<cstring>
+#include <chrono>
+#include <cmath>
+#include <climits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is ignored instead
+#endif
+#endif
+static unsigned int xorshift32(unsigned int& state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// ThreadPool class implementation
+static thread_local bool insideParallelFor = false;
+static thread_local bool inlineThread = false;
+
+ThreadPool::ThreadPool(int threadCount) : job(nullptr), generation(0), busyWorkers(0), stopping(false) {
+	for (int i = 0; i < threadCount; i++) {
+		workers.push_back(thread(&ThreadPool::workerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+int ThreadPool::getThreadCount() const { return (int)workers.size() + 1; }
+
+void ThreadPool::runChunks(Job& current) {
+	insideParallelFor = true;
+	while (true) {
+		int begin = current.nextChunk.fetch_add(1) * current.grain;
+		if (begin >= current.count) break;
+		(*current.body)(begin, min(current.count, begin + current.grain));
+	}
+	insideParallelFor = false;
+}
+
+void ThreadPool::workerLoop() {
+	unsigned long long seen = 0;
+	while (true) {
+		unique_lock<mutex> guard(lock);
+		wake.wait(guard, [&] { return stopping || (job != nullptr && generation != seen); });
+		if (stopping) return;
+		seen = generation;
+		Job* current = job;
+		busyWorkers++;
+		guard.unlock();
+		runChunks(*current);
+		guard.lock();
+		if (--busyWorkers == 0) finished.notify_all();
+	}
+}
+
+void ThreadPool::parallelFor(int count, int grain, const function<void(int, int)>& body) {
+	if (count <= 0) return;
+	if (grain < 1) grain = 1;
+	// Nested calls, inline threads and single-chunk jobs run on the caller
+	if (workers.empty() || insideParallelFor || inlineThread || count <= grain) {
+		for (int begin = 0; begin < count; begin += grain) body(begin, min(count, begin + grain));
+		return;
+	}
+	lock_guard<mutex> submit(submitLock);
+	Job current;
+	current.body = &body;
+	current.count = count;
+	current.grain = grain;
+	current.nextChunk = 0;
+	{
+		lock_guard<mutex> guard(lock);
+		job = &current;
+		generation++;
+	}
+	wake.notify_all();
+	runChunks(current);
+	// Once the job is withdrawn no new worker can join, so wait for the ones still running
+	unique_lock<mutex> guard(lock);
+	job = nullptr;
+	finished.wait(guard, [&] { return busyWorkers == 0; });
+}
+
+void ThreadPool::runInline(bool enabled) { inlineThread = enabled; }
+
+ThreadPool& ThreadPool::shared() {
+	static ThreadPool pool(max(0, (int)thread::hardware_concurrency() - 1));
+	return pool;
+}
+
+// Arena class implementation
+Arena::Arena(size_t defaultBlockSize) : currentBlock(0), offset(0), blockSize(defaultBlockSize), finalizers(nullptr),
+	bytesUsed(0), peakBytes(0), allocations(0), blockMallocs(0), resets(0) {
+}
+
+Arena::~Arena() {
+	reset();
+	for (size_t i = 0; i < blocks.size(); i++) free(blocks[i].data);
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+	for (;;) {
+		while (currentBlock < blocks.size()) {
+			Block& block = blocks[currentBlock];
+			size_t start = (offset + alignment - 1) & ~(alignment - 1);
+			if (start + size <= block.size) {
+				offset = start + size;
+				bytesUsed += size;
+				peakBytes = max(peakBytes, bytesUsed);
+				allocations++;
+				return block.data + start;
+			}
+			currentBlock++;
+			offset = 0;
+		}
+		// Out of blocks: add one, big enough for this request if it is oversized
+		Block block;
+		block.size = max(blockSize, size + alignment);
+		block.data = static_cast<char*>(malloc(block.size));
+		if (!block.data) throw bad_alloc();
+		blocks.push_back(block);
+		blockMallocs++;
+		currentBlock = blocks.size() - 1;
+		offset = 0;
+	}
+}
+
+void Arena::reset() {
+	while (finalizers) {
+		Finalizer* finalizer = finalizers;
+		finalizers = finalizer->next;
+		finalizer->destroy(finalizer->object);
+	}
+	currentBlock = 0;
+	offset = 0;
+	bytesUsed = 0;
+	resets++;
+}
+
+size_t Arena::getBytesUsed() const { return bytesUsed; }
+size_t Arena::getPeakBytes() const { return peakBytes; }
+long long Arena::getAllocationCount() const { return allocations; }
+int Arena::getBlockMallocs() const { return blockMallocs; }
+int Arena::getResetCount() const { return resets; }
+
+size_t Arena::getBytesReserved() const {
+	size_t total = 0;
+	for (size_t i = 0; i < blocks.size(); i++) total += blocks[i].size;
+	return total;
+}
+
+void Arena::displayStats(const char* label) const {
+	cout << label << ": " << bytesUsed << " bytes in use, " << peakBytes << " peak, " << getBytesReserved()
+		<< " reserved in " << blocks.size() << " blocks (" << blockMallocs << " mallocs), "
+		<< allocations << " allocations, " << resets << " resets\n";
+}
+
+// EventLog class implementation
+thread_local EventLog::Context EventLog::context = { nullptr, 0, 0, 0, false };
+
+EventLog::EventLog() : ringCount(0), unattachedDrops(0), written(0), stopping(false) {}
+
+EventLog::~EventLog() {
+	close();
+	for (int i = 0; i < ringCount.load(); i++) delete rings[i];
+}
+
+EventLog& EventLog::shared() {
+	static EventLog log;
+	return log;
+}
+
+// Once per thread, on its first event
+EventLog::Ring* EventLog::attachThread() {
+	lock_guard<mutex> guard(ringLock);
+	int index = ringCount.load(memory_order_relaxed);
+	if (index >= LOG_MAX_THREADS) return nullptr;
+	rings[index] = new Ring();
+	context.ring = rings[index];
+	context.thread = (unsigned short)index;
+	ringCount.store(index + 1, memory_order_release);
+	return rings[index];
+}
+
+// The hot path: a slot write and a release store on memory only this thread writes. The drain's
+// tail is only read when the last one seen leaves the ring looking full.
+void EventLog::record(LogEventType type, int subject, int target, int amount) {
+	Context& local = context;
+	Ring* ring = local.ring;
+	if (!ring) {
+		if (local.unattached || !(ring = shared().attachThread())) {
+			local.unattached = true;
+			shared().unattachedDrops.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+	}
+	unsigned int head = ring->head.load(memory_order_relaxed);
+	if (head - ring->cachedTail >= (unsigned int)LOG_RING_SIZE) {
+		ring->cachedTail = ring->tail.load(memory_order_acquire);
+		if (head - ring->cachedTail >= (unsigned int)LOG_RING_SIZE) {
+			ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			return;
+		}
+	}
+	LogRecord& slot = ring->records[head & (LOG_RING_SIZE - 1)];
+	slot.type = (unsigned short)type;
+	slot.thread = local.thread;
+	slot.game = local.game;
+	slot.turn = local.turn;
+	slot.subject = subject;
+	slot.target = target;
+	slot.amount = amount;
+	ring->head.store(head + 1, memory_order_release);
+}
+
+void EventLog::setContext(int game, int turn) {
+	context.game = game;
+	context.turn = turn;
+}
+
+void EventLog::setTurn(int turn) { context.turn = turn; }
+
+int EventLog::drain(vector<LogRecord>& out) {
+	lock_guard<mutex> guard(drainLock);
+	size_t first = out.size();
+	int count = ringCount.load(memory_order_acquire);
+	for (int r = 0; r < count; r++) {
+		Ring& ring = *rings[r];
+		unsigned int tail = ring.tail.load(memory_order_relaxed);
+		unsigned int head = ring.head.load(memory_order_acquire);
+		for (; tail != head; tail++) out.push_back(ring.records[tail & (LOG_RING_SIZE - 1)]);
+		ring.tail.store(tail, memory_order_release);
+	}
+	size_t drained = out.size() - first;
+	if (drained > 0 && file.is_open()) {
+		file.write((const char*)&out[first], drained * sizeof(LogRecord));
+		file.flush();
+		written += (long long)drained;
+	}
+	return (int)drained;
+}
+
+// Header: magic, format version and record size, then raw records to the end of the file
+static const char LOG_FILE_MAGIC[4] = { 'S', 'H', 'L', 'G' };
+static const int LOG_FILE_VERSION = 1;
+
+bool EventLog::openFile(const char* path) {
+	lock_guard<mutex> guard(drainLock);
+	if (file.is_open()) file.close();
+	file.open(path, ios::binary | ios::trunc);
+	if (!file) return false;
+	int version = LOG_FILE_VERSION;
+	int recordSize = (int)sizeof(LogRecord);
+	file.write(LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC));
+	file.write((char*)&version, sizeof(version));
+	file.write((char*)&recordSize, sizeof(recordSize));
+	written = 0;
+	return true;
+}
+
+// For frontends that show nothing themselves: drains every few milliseconds so rings stay empty
+void EventLog::startWriter() {
+	if (writer.joinable()) return;
+	stopping = false;
+	writer = thread(&EventLog::writerLoop, this);
+}
+
+void EventLog::writerLoop() {
+	vector<LogRecord> batch;
+	unique_lock<mutex> guard(writerLock);
+	while (!stopping) {
+		writerWake.wait_for(guard, chrono::milliseconds(LOG_WRITER_INTERVAL_MILLIS));
+		guard.unlock();
+		batch.clear();
+		drain(batch);
+		guard.lock();
+	}
+}
+
+void EventLog::close() {
+	{
+		lock_guard<mutex> guard(writerLock);
+		stopping = true;
+	}
+	writerWake.notify_all();
+	if (writer.joinable()) writer.join();
+	vector<LogRecord> rest;
+	drain(rest);
+	lock_guard<mutex> guard(drainLock);
+	if (file.is_open()) file.close();
+}
+
+long long EventLog::getWritten() const { return written; }
+
+long long EventLog::getDropped() const {
+	long long dropped = unattachedDrops.load(memory_order_relaxed);
+	int count = ringCount.load(memory_order_acquire);
+	for (int r = 0; r < count; r++) dropped += rings[r]->dropped.load(memory_order_relaxed);
+	return dropped;
+}
+
+static void logKingdomName(Kingdom* const kingdoms[], int kingdomCount, int k, char* name, size_t size) {
+	if (kingdoms && k >= 0 && k < kingdomCount) snprintf(name, size, "%s", kingdoms[k]->getName());
+	else snprintf(name, size, "Kingdom %d", k);
+}
+
+// Kingdoms are named from the given list when it has them, by index otherwise
+string EventLog::describe(const LogRecord& record, Kingdom* const kingdoms[], int kingdomCount) {
+	char subject[MAX_NAME_LENGTH + 16];
+	char target[MAX_NAME_LENGTH + 16];
+	logKingdomName(kingdoms, kingdomCount, record.subject, subject, sizeof(subject));
+	logKingdomName(kingdoms, kingdomCount, record.target, target, sizeof(target));
+	char text[256];
+	switch (record.type) {
+	case LOG_TAXES_COLLECTED: snprintf(text, sizeof(text), "%s collected %d gold in taxes.", subject, record.amount); break;
+	case LOG_FORTIFIED: snprintf(text, sizeof(text), "%s strengthened its fortifications.", subject); break;
+	case LOG_FORTIFY_FAILED: snprintf(text, sizeof(text), "%s has not enough resources to fortify!", subject); break;
+	case LOG_ATTACK_LAUNCHED:
+		snprintf(text, sizeof(text), "%s marches on %s. The battle is fought at the end of the turn.", subject, target);
+		break;
+	case LOG_ATTACK_OUT_OF_RANGE: snprintf(text, sizeof(text), "%s is too far for %s to attack!", target, subject); break;
+	case LOG_ATTACK_REFUSED: snprintf(text, sizeof(text), "%s cannot launch an attack on %s!", subject, target); break;
+	case LOG_TREATY_BROKEN_FOR_WAR: snprintf(text, sizeof(text), "%s breaks its treaty with %s to declare war!", subject, target); break;
+	case LOG_WAR_DECLARED: snprintf(text, sizeof(text), "%s declares war on %s!", subject, target); break;
+	case LOG_ALLY_JOINED:
+		snprintf(text, sizeof(text), "%s honours its alliance and joins the war against %s!", subject, target);
+		break;
+	case LOG_TRADE_ACCEPTED: snprintf(text, sizeof(text), "%s accepted trade offer %d.", subject, record.amount); break;
+	case LOG_TILE_OCCUPIED:
+		snprintf(text, sizeof(text), "%s cannot be placed on occupied tile (%d, %d)!", subject,
+			record.amount / MAP_SIZE, record.amount % MAP_SIZE);
+		break;
+	case LOG_KINGDOMS_FULL: snprintf(text, sizeof(text), "%s cannot be placed: maximum kingdoms reached!", subject); break;
+	case LOG_CARAVAN_ARRIVED: snprintf(text, sizeof(text), "A caravan from %s reached %s.", subject, target); break;
+	case LOG_CARAVAN_RAIDED: snprintf(text, sizeof(text), "%s raided a caravan from %s!", subject, target); break;
+	case LOG_SMUGGLING_PAID: snprintf(text, sizeof(text), "%s was paid %d gold for smuggled goods.", subject, record.amount); break;
+	default: snprintf(text, sizeof(text), "Unknown event %d.", record.type); break;
+	}
+	return text;
+}
+
+bool EventLog::readFile(const char* path, vector<LogRecord>& records) {
+	ifstream inFile(path, ios::binary);
+	char magic[sizeof(LOG_FILE_MAGIC)];
+	int version = 0;
+	int recordSize = 0;
+	inFile.read(magic, sizeof(magic));
+	inFile.read((char*)&version, sizeof(version));
+	inFile.read((char*)&recordSize, sizeof(recordSize));
+	if (!inFile || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0 || version != LOG_FILE_VERSION ||
+		recordSize != (int)sizeof(LogRecord)) return false;
+	LogRecord record;
+	while (inFile.read((char*)&record, sizeof(record))) records.push_back(record);
+	return true;
+}
+
+// EventScheduler class implementation
+EventScheduler::EventScheduler() : currentTurn(1), pendingCount(0) {}
+
+int EventScheduler::getCurrentTurn() const { return currentTurn; }
+int EventScheduler::getPendingCount() const { return pendingCount; }
+
+void EventScheduler::place(const GameEvent& event) {
+	int delta = event.dueTurn - currentTurn;
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		if (delta < (1 << (WHEEL_BITS * (level + 1)))) {
+			wheel[level][(event.dueTurn >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)].push_back(event);
+			return;
+		}
+	}
+	overflow.push_back(event);
+}
+
+// Re-places the events in the level's current slot; they are all due within one slot of the level below
+void EventScheduler::cascade(int level) {
+	int slot = (currentTurn >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	spill.clear();
+	spill.swap(wheel[level][slot]);
+	for (size_t i = 0; i < spill.size(); i++) place(spill[i]);
+}
+
+void EventScheduler::schedule(int delay, GameEventType type, int subject, int detail) {
+	GameEvent event;
+	event.dueTurn = currentTurn + min(max(1, delay), INT_MAX - currentTurn); // Clamped so the due turn cannot wrap
+	event.type = type;
+	event.subject = subject;
+	event.detail = detail;
+	place(event);
+	pendingCount++;
+}
+
+void EventScheduler::advance(vector<GameEvent>& due) {
+	currentTurn++;
+	for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+		if ((currentTurn & ((1 << (WHEEL_BITS * level)) - 1)) != 0) continue;
+		cascade(level);
+		// The top level has just moved on a slot, so the overflow may now be within reach
+		if (level == WHEEL_LEVELS - 1 && !overflow.empty()) {
+			spill.clear();
+			spill.swap(overflow);
+			for (size_t i = 0; i < spill.size(); i++) place(spill[i]);
+		}
+	}
+	due.clear();
+	due.swap(wheel[0][currentTurn & (WHEEL_SLOTS - 1)]);
+	pendingCount -= (int)due.size();
+}
+
+void EventScheduler::clear() {
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++) wheel[level][slot].clear();
+	}
+	overflow.clear();
+	pendingCount = 0;
+}
+
+void EventScheduler::saveToFile(ofstream& outFile) {
+	outFile.write((char*)&currentTurn, sizeof(currentTurn));
+	outFile.write((char*)&pendingCount, sizeof(pendingCount));
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+			for (size_t i = 0; i < wheel[level][slot].size(); i++) {
+				outFile.write((char*)&wheel[level][slot][i], sizeof(GameEvent));
+			}
+		}
+	}
+	for (size_t i = 0; i < overflow.size(); i++) {
+		outFile.write((char*)&overflow[i], sizeof(GameEvent));
+	}
+}
+
+void EventScheduler::loadFromFile(ifstream& inFile) {
+	clear();
+	int count = 0;
+	inFile.read((char*)&currentTurn, sizeof(currentTurn));
+	inFile.read((char*)&count, sizeof(count));
+	for (int i = 0; i < count; i++) {
+		GameEvent event;
+		inFile.read((char*)&event, sizeof(GameEvent));
+		place(event);
+		pendingCount++;
+	}
+}
+
+// Case-insensitive, with spaces and underscores treated alike
+static bool sameName(const char* a, const char* b) {
+	while (*a && *b) {
+		char ca = *a == '_' ? ' ' : (char)tolower((unsigned char)*a);
+		char cb = *b == '_' ? ' ' : (char)tolower((unsigned char)*b);
+		if (ca != cb) return false;
+		a++;
+		b++;
+	}
+	return *a == '\0' && *b == '\0';
+}
+
+// UnitCatalog class implementation
+UnitCatalog::UnitCatalog() { resetToDefaults(); }
+
+// Unused slots keep zero weights, and full exposure so they never soak up losses unevenly
+void UnitCatalog::clearTypes() {
+	typeCount = 0;
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) {
+		attackWeights[u] = defenseWeights[u] = upkeepWeights[u] = 0;
+		exposureWeights[u] = 100;
+	}
+}
+
+bool UnitCatalog::addType(const char* name, int goldCost, int attack, int defense, int upkeep, int armour) {
+	if (typeCount >= MAX_UNIT_TYPES) return false;
+	UnitType& type = types[typeCount];
+	strncpy_s(type.name, name, MAX_NAME_LENGTH - 1);
+	type.name[MAX_NAME_LENGTH - 1] = '\0';
+	type.goldCost = goldCost;
+	type.attack = attack;
+	type.defense = defense;
+	type.upkeep = upkeep;
+	type.armour = armour;
+	attackWeights[typeCount] = attack;
+	defenseWeights[typeCount] = defense;
+	upkeepWeights[typeCount] = upkeep;
+	exposureWeights[typeCount] = 100 - armour;
+	typeCount++;
+	return true;
+}
+
+// The original four unit types, used when there is no data file
+void UnitCatalog::resetToDefaults() {
+	clearTypes();
+	addType("Soldiers", 10, 10, 12, 0, 0);
+	addType("Archers", 15, 15, 10, 0, 0);
+	addType("Cavalry", 20, 20, 15, 0, 0);
+	addType("Siege Units", 25, 25, 20, 0, 0);
+}
+
+// One unit type per line: name gold_cost attack defense upkeep [armour]. Underscores in the name
+// are shown as spaces; lines starting with # are comments. Keeps the current catalog on failure.
+bool UnitCatalog::loadFromFile(const char* path) {
+	ifstream inFile(path);
+	if (!inFile) return false;
+	UnitCatalog loaded;
+	loaded.clearTypes();
+	char line[256];
+	int lineNumber = 0;
+	while (inFile.getline(line, sizeof(line))) {
+		lineNumber++;
+		if (line[0] == '#' || line[0] == '\0' || line[0] == '\r') continue;
+		char name[MAX_NAME_LENGTH];
+		int goldCost, attack, defense, upkeep, armour = 0;
+		if (sscanf(line, "%49s %d %d %d %d %d", name, &goldCost, &attack, &defense, &upkeep, &armour) < 5 ||
+			goldCost <= 0 || attack < 0 || defense < 0 || upkeep < 0 || armour < 0 || armour > MAX_ARMOUR) {
+			cout << path << ":" << lineNumber << ": invalid unit type, skipped.\n";
+			continue;
+		}
+		for (char* c = name; *c; c++) {
+			if (*c == '_') *c = ' ';
+		}
+		if (!loaded.addType(name, goldCost, attack, defense, upkeep, armour)) {
+			cout << path << ": more than " << MAX_UNIT_TYPES << " unit types, the rest are ignored.\n";
+			break;
+		}
+	}
+	if (loaded.typeCount == 0) return false;
+	*this = loaded;
+	return true;
+}
+
+int UnitCatalog::getTypeCount() const { return typeCount; }
+const UnitType& UnitCatalog::getType(int index) const { return types[index]; }
+const int* UnitCatalog::getAttackWeights() const { return attackWeights; }
+const int* UnitCatalog::getDefenseWeights() const { return defenseWeights; }
+const int* UnitCatalog::getUpkeepWeights() const { return upkeepWeights; }
+const int* UnitCatalog::getExposureWeights() const { return exposureWeights; }
+
+// -1 if there is no such unit
+int UnitCatalog::findType(const char* name) const {
+	for (int u = 0; u < typeCount; u++) {
+		if (sameName(types[u].name, name)) return u;
+	}
+	return -1;
+}
+
+int UnitCatalog::bestAttackPerGold() const {
+	int best = 0;
+	for (int u = 1; u < typeCount; u++) {
+		if (types[u].attack * types[best].goldCost > types[best].attack * types[u].goldCost) best = u;
+	}
+	return best;
+}
+
+void UnitCatalog::display() const {
+	for (int u = 0; u < typeCount; u++) {
+		cout << u + 1 << ". " << types[u].name << " (Cost: " << types[u].goldCost << " Gold, Attack " << types[u].attack
+			<< ", Defense " << types[u].defense;
+		if (types[u].upkeep > 0) cout << ", Upkeep " << types[u].upkeep;
+		if (types[u].armour > 0) cout << ", Armour " << types[u].armour << "%";
+		cout << ")\n";
+	}
+}
+
+UnitCatalog& UnitCatalog::shared() {
+	static UnitCatalog catalog;
+	return catalog;
+}
+
 // Military class implementation
-Military::Military() : soldiers(0), archers(0), cavalry(0), siegeUnits(0) {}
+// Fixed length, so the compiler unrolls and vectorizes it
+static int dotUnits(const int* counts, const int* weights) {
+	int sum = 0;
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) sum += counts[u] * weights[u];
+	return sum;
+}
 
-void Military::addSoldiers(int count) { soldiers += count; }
-void Military::addArchers(int count) { archers += count; }
-void Military::addCavalry(int count) { cavalry += count; }
-void Military::addSiegeUnits(int count) { siegeUnits += count; }
+Military::Military() : changed(false) {
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) counts[u] = 0;
+}
 
-int Military::getSoldiers() const { return soldiers; }
-int Military::getArchers() const { return archers; }
-int Military::getCavalry() const { return cavalry; }
-int Military::getSiegeUnits() const { return siegeUnits; }
+bool Military::takeChanged() {
+	bool wasChanged = changed;
+	changed = false;
+	return wasChanged;
+}
 
-int Military::calculateAttackPower() const {
-	return soldiers * 10 + archers * 15 + cavalry * 20 + siegeUnits * 25;
+void Military::addUnits(int unitType, int count) {
+	if (unitType < 0 || unitType >= MAX_UNIT_TYPES) return;
+	counts[unitType] += count;
+	changed = true;
 }
 
-int Military::calculateDefensePower() const {
-	return soldiers * 12 + archers * 10 + cavalry * 15 + siegeUnits * 20;
+int Military::getCount(int unitType) const { return counts[unitType]; }
+
+int Military::getTotalUnits() const {
+	int total = 0;
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) total += counts[u];
+	return total;
 }
 
-void Military::trainUnits(ResourceType resourceType, int amount) {
-	// Simple implementation: increase unit counts based on resource type
-	if (amount <= 0) return;
-	switch (resourceType) {
-	case GOLD: soldiers += amount; break;
-	case FOOD: archers += amount; break;
-	case WOOD: cavalry += amount; break;
-	case STONE: siegeUnits += amount; break;
+int Military::calculateAttackPower() const { return dotUnits(counts, UnitCatalog::shared().getAttackWeights()); }
+int Military::calculateDefensePower() const { return dotUnits(counts, UnitCatalog::shared().getDefenseWeights()); }
+int Military::calculateUpkeep() const { return dotUnits(counts, UnitCatalog::shared().getUpkeepWeights()); }
+
+void Military::computePowers(const Military* armies, int count, int* attackPower, int* defensePower) {
+	const UnitCatalog& catalog = UnitCatalog::shared();
+	const int* attack = catalog.getAttackWeights();
+	const int* defense = catalog.getDefenseWeights();
+	for (int i = 0; i < count; i++) {
+		if (attackPower) attackPower[i] = dotUnits(armies[i].counts, attack);
+		if (defensePower) defensePower[i] = dotUnits(armies[i].counts, defense);
 	}
 }
 
+void Military::trainUnits(int unitType, int amount) {
+	if (amount <= 0 || unitType < 0 || unitType >= UnitCatalog::shared().getTypeCount()) return;
+	counts[unitType] += amount;
+	changed = true;
+}
+
 void Military::takeCasualties(int amount) {
-	int totalUnits = soldiers + archers + cavalry + siegeUnits;
-	if (totalUnits == 0) return;
+	if (amount <= 0) return;
+	distributeLosses(counts, amount);
+	changed = true;
+}
+
+// Each unit type loses amount * weight / total weight, where weight is count times exposure.
+// The floors are taken first and the units left over go one each to the largest remainders,
+// so exactly `amount` units die. A type whose share reaches its count is wiped out and the rest
+// of the losses are shared out again among the survivors.
+void Military::distributeLosses(int* counts, int amount) {
+	const int* exposure = UnitCatalog::shared().getExposureWeights();
+	long long weight[MAX_UNIT_TYPES], share[MAX_UNIT_TYPES], remainder[MAX_UNIT_TYPES];
+	int total = 0;
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) total += counts[u];
+	if (amount <= 0 || total == 0) return;
+	if (amount >= total) {
+		for (int u = 0; u < MAX_UNIT_TYPES; u++) counts[u] = 0;
+		return;
+	}
 
-	int soldierLoss = (amount * soldiers) / totalUnits;
-	int archerLoss = (amount * archers) / totalUnits;
-	int cavalryLoss = (amount * cavalry) / totalUnits;
-	int siegeLoss = amount - soldierLoss - archerLoss - cavalryLoss;
+	// amount < total holds on every pass, so the weight sum is never zero
+	for (;;) {
+		long long weightSum = 0;
+		for (int u = 0; u < MAX_UNIT_TYPES; u++) {
+			weight[u] = (long long)counts[u] * exposure[u];
+			weightSum += weight[u];
+		}
+		for (int u = 0; u < MAX_UNIT_TYPES; u++) {
+			share[u] = amount * weight[u] / weightSum;
+			remainder[u] = amount * weight[u] % weightSum;
+		}
+		bool wiped = false;
+		for (int u = 0; u < MAX_UNIT_TYPES; u++) {
+			if (counts[u] > 0 && share[u] >= counts[u]) {
+				amount -= counts[u];
+				counts[u] = 0;
+				wiped = true;
+			}
+		}
+		if (!wiped) break;
+	}
+
+	int assigned = 0;
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) assigned += (int)share[u];
+	for (int left = amount - assigned; left > 0; left--) {
+		int best = -1;
+		for (int u = 0; u < MAX_UNIT_TYPES; u++) {
+			if (share[u] < counts[u] && (best < 0 || remainder[u] > remainder[best])) best = u;
+		}
+		share[best]++;
+		remainder[best] = -1;
+	}
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) counts[u] -= (int)share[u];
+}
+
+void Military::applyCasualties(Military* armies, const int* losses, int count) {
+	for (int i = 0; i < count; i++) {
+		if (losses[i] <= 0) continue;
+		distributeLosses(armies[i].counts, losses[i]);
+		armies[i].changed = true;
+	}
+}
 
-	soldiers = max(0, soldiers - soldierLoss);
-	archers = max(0, archers - archerLoss);
-	cavalry = max(0, cavalry - cavalryLoss);
-	siegeUnits = max(0, siegeUnits - siegeLoss);
+// Splits off the given percentage of every unit type
+Military Military::detach(int percent) {
+	percent = max(0, min(100, percent));
+	Military part;
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) {
+		part.counts[u] = counts[u] * percent / 100;
+		counts[u] -= part.counts[u];
+	}
+	changed = true;
+	return part;
+}
+
+void Military::merge(const Military& other) {
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) counts[u] += other.counts[u];
+	changed = true;
 }
 
 void Military::saveToFile(ofstream& outFile) {
-	outFile.write((char*)&soldiers, sizeof(soldiers));
-	outFile.write((char*)&archers, sizeof(archers));
-	outFile.write((char*)&cavalry, sizeof(cavalry));
-	outFile.write((char*)&siegeUnits, sizeof(siegeUnits));
+	int typeCount = UnitCatalog::shared().getTypeCount();
+	outFile.write((char*)&typeCount, sizeof(typeCount));
+	outFile.write((char*)counts, sizeof(int) * typeCount);
 }
 
+// Counts for unit types the current catalog does not have are dropped
 void Military::loadFromFile(ifstream& inFile) {
-	inFile.read((char*)&soldiers, sizeof(soldiers));
-	inFile.read((char*)&archers, sizeof(archers));
-	inFile.read((char*)&cavalry, sizeof(cavalry));
-	inFile.read((char*)&siegeUnits, sizeof(siegeUnits));
+	int typeCount = 0;
+	inFile.read((char*)&typeCount, sizeof(typeCount));
+	for (int u = 0; u < MAX_UNIT_TYPES; u++) counts[u] = 0;
+	for (int u = 0; u < typeCount; u++) {
+		int count = 0;
+		inFile.read((char*)&count, sizeof(count));
+		if (u < UnitCatalog::shared().getTypeCount()) counts[u] = count;
+	}
+	changed = false;
 }
 
 void Military::display() const {
+	const UnitCatalog& catalog = UnitCatalog::shared();
 	cout << "Military Status:\n";
-	cout << "Soldiers: " << soldiers << endl;
-	cout << "Archers: " << archers << endl;
-	cout << "Cavalry: " << cavalry << endl;
-	cout << "Siege Units: " << siegeUnits << endl;
+	for (int u = 0; u < catalog.getTypeCount(); u++) {
+		cout << catalog.getType(u).name << ": " << counts[u] << endl;
+	}
 }
 
 // Technology class implementation
 Technology::Technology() : agricultureAdvanced(false), militaryAdvanced(false),
-constructionAdvanced(false), economyAdvanced(false), researchPoints(0) {
+constructionAdvanced(false), economyAdvanced(false), researchPoints(0), researching(0) {
 }
 
 void Technology::addResearchPoints(int points) { researchPoints += points; }
+int Technology::getResearchPoints() const { return researchPoints; }
 
 bool Technology::researchTechnology(ResourceType type) {
 	if (researchPoints < 100) return false;
@@ -113,6 +793,40 @@ bool Technology::researchTechnology(ResourceType type) {
 	return false;
 }
 
+void Technology::setAdvanced(ResourceType type) {
+	switch (type) {
+	case FOOD: agricultureAdvanced = true; break;
+	case GOLD: economyAdvanced = true; break;
+	case WOOD: constructionAdvanced = true; break;
+	case STONE: militaryAdvanced = true; break;
+	}
+}
+
+// Pays for the research now; completeResearch() is called when it finishes
+bool Technology::beginResearch(ResourceType type) {
+	if (researchPoints < 100 || isAdvanced(type) || isResearching(type)) return false;
+	researchPoints -= 100;
+	researching |= (unsigned char)(1 << type);
+	return true;
+}
+
+void Technology::completeResearch(ResourceType type) {
+	researching &= (unsigned char)~(1 << type);
+	setAdvanced(type);
+}
+
+bool Technology::isAdvanced(ResourceType type) const {
+	switch (type) {
+	case FOOD: return agricultureAdvanced;
+	case GOLD: return economyAdvanced;
+	case WOOD: return constructionAdvanced;
+	case STONE: return militaryAdvanced;
+	}
+	return false;
+}
+
+bool Technology::isResearching(ResourceType type) const { return (researching >> type) & 1; }
+
 bool Technology::isAgricultureAdvanced() const { return agricultureAdvanced; }
 bool Technology::isMilitaryAdvanced() const { return militaryAdvanced; }
 bool Technology::isConstructionAdvanced() const { return constructionAdvanced; }
@@ -124,6 +838,7 @@ void Technology::saveToFile(ofstream& outFile) {
 	outFile.write((char*)&constructionAdvanced, sizeof(constructionAdvanced));
 	outFile.write((char*)&economyAdvanced, sizeof(economyAdvanced));
 	outFile.write((char*)&researchPoints, sizeof(researchPoints));
+	outFile.write((char*)&researching, sizeof(researching));
 }
 
 void Technology::loadFromFile(ifstream& inFile) {
@@ -132,6 +847,7 @@ void Technology::loadFromFile(ifstream& inFile) {
 	inFile.read((char*)&constructionAdvanced, sizeof(constructionAdvanced));
 	inFile.read((char*)&economyAdvanced, sizeof(economyAdvanced));
 	inFile.read((char*)&researchPoints, sizeof(researchPoints));
+	inFile.read((char*)&researching, sizeof(researching));
 }
 
 void Technology::display() const {
@@ -141,6 +857,10 @@ void Technology::display() const {
 	cout << "Construction Advanced: " << (constructionAdvanced ? "Yes" : "No") << endl;
 	cout << "Economy Advanced: " << (economyAdvanced ? "Yes" : "No") << endl;
 	cout << "Research Points: " << researchPoints << endl;
+	if (researching) {
+		cout << "In Progress:" << (isResearching(FOOD) ? " Agriculture" : "") << (isResearching(GOLD) ? " Economy" : "")
+			<< (isResearching(WOOD) ? " Construction" : "") << (isResearching(STONE) ? " Military" : "") << endl;
+	}
 }
 
 // Building class implementation
@@ -176,12 +896,14 @@ void Building::loadFromFile(ifstream& inFile) {
 }
 
 // Kingdom class implementation
-Kingdom::Kingdom() : population(100), happiness(50), buildingCount(0), x(-1), y(-1) {
+Kingdom::Kingdom() : population(100), happiness(50), pendingBuildings(0), x(-1), y(-1), changedFields(ALL_FIELDS),
+	productionDirty(true), events(nullptr), index(0) {
 	strcpy_s(name, "Unknown");
 	resources = Resource(1000, 500, 200, 200);
 }
 
-Kingdom::Kingdom(const char* kingdomName) : population(100), happiness(50), buildingCount(0), x(-1), y(-1) {
+Kingdom::Kingdom(const char* kingdomName) : population(100), happiness(50), pendingBuildings(0), x(-1), y(-1),
+	changedFields(ALL_FIELDS), productionDirty(true), events(nullptr), index(0) {
 	strncpy_s(name, kingdomName, MAX_NAME_LENGTH - 1);
 	name[MAX_NAME_LENGTH - 1] = '\0';
 	resources = Resource(1000, 500, 200, 200);
@@ -196,14 +918,30 @@ int Kingdom::getFood() const { return resources.food; }
 int Kingdom::getWood() const { return resources.wood; }
 int Kingdom::getStone() const { return resources.stone; }
 
-void Kingdom::addGold(int amount) { resources.gold += amount; }
-void Kingdom::addFood(int amount) { resources.food += amount; }
-void Kingdom::addWood(int amount) { resources.wood += amount; }
-void Kingdom::addStone(int amount) { resources.stone += amount; }
+void Kingdom::addGold(int amount) {
+	resources.gold += amount;
+	changedFields |= FIELD_RESOURCES;
+}
+
+void Kingdom::addFood(int amount) {
+	resources.food += amount;
+	changedFields |= FIELD_RESOURCES;
+}
+
+void Kingdom::addWood(int amount) {
+	resources.wood += amount;
+	changedFields |= FIELD_RESOURCES;
+}
+
+void Kingdom::addStone(int amount) {
+	resources.stone += amount;
+	changedFields |= FIELD_RESOURCES;
+}
 
 bool Kingdom::spendGold(int amount) {
 	if (resources.gold >= amount) {
 		resources.gold -= amount;
+		changedFields |= FIELD_RESOURCES;
 		return true;
 	}
 	return false;
@@ -212,6 +950,7 @@ bool Kingdom::spendGold(int amount) {
 bool Kingdom::spendFood(int amount) {
 	if (resources.food >= amount) {
 		resources.food -= amount;
+		changedFields |= FIELD_RESOURCES;
 		return true;
 	}
 	return false;
@@ -220,6 +959,7 @@ bool Kingdom::spendFood(int amount) {
 bool Kingdom::spendWood(int amount) {
 	if (resources.wood >= amount) {
 		resources.wood -= amount;
+		changedFields |= FIELD_RESOURCES;
 		return true;
 	}
 	return false;
@@ -228,118 +968,267 @@ bool Kingdom::spendWood(int amount) {
 bool Kingdom::spendStone(int amount) {
 	if (resources.stone >= amount) {
 		resources.stone -= amount;
+		changedFields |= FIELD_RESOURCES;
 		return true;
 	}
 	return false;
 }
 
-void Kingdom::setPosition(int newX, int newY) { x = newX; y = newY; }
+bool Kingdom::spendResources(const Resource& cost) {
+	if (cost.gold < 0 || cost.food < 0 || cost.wood < 0 || cost.stone < 0) return false;
+	if (resources.gold < cost.gold || resources.food < cost.food || resources.wood < cost.wood || resources.stone < cost.stone) return false;
+	resources.gold -= cost.gold;
+	resources.food -= cost.food;
+	resources.wood -= cost.wood;
+	resources.stone -= cost.stone;
+	changedFields |= FIELD_RESOURCES;
+	return true;
+}
+
+void Kingdom::addResources(const Resource& amount) {
+	resources.gold += amount.gold;
+	resources.food += amount.food;
+	resources.wood += amount.wood;
+	resources.stone += amount.stone;
+	changedFields |= FIELD_RESOURCES;
+}
+
+void Kingdom::setPosition(int newX, int newY) {
+	x = newX;
+	y = newY;
+	changedFields |= FIELD_POSITION;
+}
+
 int Kingdom::getX() const { return x; }
 int Kingdom::getY() const { return y; }
 
 Military& Kingdom::getMilitary() { return military; }
+const Military& Kingdom::getMilitary() const { return military; }
+const Technology& Kingdom::getTechnology() const { return tech; }
+int Kingdom::getBuildingCount() const { return buildings.size(); }
+int Kingdom::getPendingBuildings() const { return pendingBuildings; }
+
+int Kingdom::getProduction(ResourceType type) {
+	refreshProduction();
+	return production[type];
+}
 
-void Kingdom::processTurn() {
-	// Simple resource production
-	resources.food += tech.isAgricultureAdvanced() ? 100 : 50;
-	resources.gold += tech.isEconomyAdvanced() ? 200 : 100;
-	resources.wood += tech.isConstructionAdvanced() ? 50 : 20;
-	resources.stone += tech.isMilitaryAdvanced() ? 50 : 20;
+// Full recompute from the technology flags and every building
+void Kingdom::computeProduction(int* out) const {
+	out[FOOD] = tech.isAgricultureAdvanced() ? 100 : 50;
+	out[GOLD] = tech.isEconomyAdvanced() ? 200 : 100;
+	out[WOOD] = tech.isConstructionAdvanced() ? 50 : 20;
+	out[STONE] = tech.isMilitaryAdvanced() ? 50 : 20;
+	for (int i = 0; i < buildings.size(); i++) {
+		out[buildings[i].getResourceBoost()] += buildings[i].getBoostAmount();
+	}
+}
 
-	// Building boosts
-	for (int i = 0; i < buildingCount; i++) {
-		switch (buildings[i].getResourceBoost()) {
-		case GOLD: resources.gold += buildings[i].getBoostAmount(); break;
-		case FOOD: resources.food += buildings[i].getBoostAmount(); break;
-		case WOOD: resources.wood += buildings[i].getBoostAmount(); break;
-		case STONE: resources.stone += buildings[i].getBoostAmount(); break;
-		}
+void Kingdom::refreshProduction() {
+	if (!productionDirty) return;
+	computeProduction(production);
+	productionDirty = false;
+}
+
+// Invariant check: a clean cache must match a full recompute
+bool Kingdom::checkProductionCache() const {
+	if (productionDirty) return true;
+	int expected[4];
+	computeProduction(expected);
+	for (int r = 0; r < 4; r++) {
+		if (production[r] != expected[r]) return false;
+	}
+	return true;
+}
+
+// What changed since the last call, as KingdomField bits
+unsigned int Kingdom::takeChangedFields() {
+	unsigned int fields = changedFields;
+	if (military.takeChanged()) fields |= FIELD_MILITARY;
+	changedFields = 0;
+	return fields;
+}
+
+const Building& Kingdom::getBuilding(int index) const { return buildings[index]; }
+
+void Kingdom::attachScheduler(EventScheduler* scheduler, int kingdomIndex) {
+	events = scheduler;
+	index = kingdomIndex;
+}
+
+int Kingdom::getIndex() const { return index; }
+
+void Kingdom::processTurn(const Map& map) {
+#ifdef STRONGHOLD_CHECK_INVARIANTS
+	if (!checkProductionCache()) {
+		cout << "Invariant failed: stale production cache for " << name << ", recomputing.\n";
+		productionDirty = true;
 	}
+#endif
+	// Resource production from technology and buildings, and from the land held
+	refreshProduction();
+	resources.gold += production[GOLD] + map.getLandYield(index, GOLD);
+	resources.food += production[FOOD] + map.getLandYield(index, FOOD);
+	resources.wood += production[WOOD] + map.getLandYield(index, WOOD);
+	resources.stone += production[STONE] + map.getLandYield(index, STONE);
+
+	// Army upkeep
+	resources.gold = max(0, resources.gold - military.calculateUpkeep());
 
 	// Population consumption
+	int oldPopulation = population, oldHappiness = happiness;
 	resources.food -= population;
 	happiness = resources.food >= 0 ? min(100, happiness + 5) : max(0, happiness - 10);
 	population = resources.food >= 0 ? population + 10 : population - 10;
 	if (population <= 0) population = 0;
 	if (resources.food < 0) resources.food = 0;
+	changedFields |= FIELD_RESOURCES;
+	if (population != oldPopulation || happiness != oldHappiness) changedFields |= FIELD_POPULATION;
 }
 
-void Kingdom::collectTaxes() {
-	int tax = population * 2;
+// Land pays too, by the tiles the kingdom owns
+void Kingdom::collectTaxes(const Map& map) {
+	int tax = population * 2 + map.getOwnedTiles(index) * LAND_TAX_PER_TILE;
 	resources.gold += tax;
 	happiness -= 5;
 	if (happiness < 0) happiness = 0;
-	cout << "Collected " << tax << " gold in taxes.\n";
+	changedFields |= FIELD_RESOURCES | FIELD_POPULATION;
+	EventLog::record(LOG_TAXES_COLLECTED, index, -1, tax);
 }
 
-void Kingdom::buildStructure() {
-	if (buildingCount >= 10) {
-		cout << "Maximum buildings reached!\n";
-		return;
+static const char* structureName(ResourceType type) {
+	switch (type) {
+	case FOOD: return "Farm";
+	case GOLD: return "Market";
+	case STONE: return "Quarry";
+	case WOOD: return "Sawmill";
 	}
+	return "Building";
+}
+
+void Kingdom::buildStructure() {
 	cout << "Choose structure to build:\n";
 	cout << "1. Farm (Boosts Food, Cost: 100 Gold, 50 Wood)\n";
 	cout << "2. Market (Boosts Gold, Cost: 150 Gold, 50 Stone)\n";
 	cout << "3. Quarry (Boosts Stone, Cost: 100 Gold, 50 Wood)\n";
 	cout << "4. Sawmill (Boosts Wood, Cost: 100 Gold, 50 Stone)\n";
+	cout << "5. Upgrade a building (+10 Boost, Cost: 100 Gold, 100 Stone)\n";
 	int choice;
 	cin >> choice;
+	if (choice == 5) {
+		if (buildings.size() == 0) {
+			cout << "No buildings to upgrade!\n";
+			return;
+		}
+		for (int i = 0; i < buildings.size(); i++) {
+			cout << i + 1 << ". " << buildings[i].getName() << " (Level " << buildings[i].getLevel() << ")\n";
+		}
+		cout << "Choose building: ";
+		int building;
+		cin >> building;
+		if (building < 1 || building > buildings.size()) cout << "Invalid choice.\n";
+		else if (upgradeBuilding(building - 1)) cout << buildings[building - 1].getName() << " upgraded!\n";
+		else cout << "Not enough resources!\n";
+		return;
+	}
 	ResourceType type;
-	const char* name;
-	int goldCost = 100, woodCost = 0, stoneCost = 0;
 	switch (choice) {
-	case 1: type = FOOD; name = "Farm"; woodCost = 50; break;
-	case 2: type = GOLD; name = "Market"; stoneCost = 50; goldCost = 150; break;
-	case 3: type = STONE; name = "Quarry"; woodCost = 50; break;
-	case 4: type = WOOD; name = "Sawmill"; stoneCost = 50; break;
+	case 1: type = FOOD; break;
+	case 2: type = GOLD; break;
+	case 3: type = STONE; break;
+	case 4: type = WOOD; break;
 	default: cout << "Invalid choice.\n"; return;
 	}
-	if (spendGold(goldCost) && spendWood(woodCost) && spendStone(stoneCost)) {
-		buildings[buildingCount++] = Building(name, type, 20);
-		cout << name << " built successfully!\n";
+	if (buildings.size() + pendingBuildings >= MAX_BUILDINGS) {
+		cout << "Maximum buildings reached!\n";
+		return;
 	}
-	else {
+	if (!buildStructure(type)) {
 		cout << "Not enough resources!\n";
 	}
+	else if (events) {
+		cout << structureName(type) << " under construction, ready in " << CONSTRUCTION_TURNS << " turns.\n";
+	}
+	else {
+		cout << structureName(type) << " built successfully!\n";
+	}
 }
 
-void Kingdom::recruitUnits() {
-	cout << "Enter number of soldiers to recruit (Cost: 10 Gold, 5 Food each): ";
-	int count;
-	cin >> count;
-	if (count <= 0) return;
-	if (spendGold(count * 10) && spendFood(count * 5)) {
-		military.addSoldiers(count);
-		cout << count << " soldiers recruited.\n";
+// With a scheduler attached the building is paid for now and completes CONSTRUCTION_TURNS later
+bool Kingdom::buildStructure(ResourceType type) {
+	if (buildings.size() + pendingBuildings >= MAX_BUILDINGS) return false;
+	int goldCost = 100, woodCost = 0, stoneCost = 0;
+	switch (type) {
+	case FOOD: woodCost = 50; break;
+	case GOLD: stoneCost = 50; goldCost = 150; break;
+	case STONE: woodCost = 50; break;
+	case WOOD: stoneCost = 50; break;
+	default: return false;
+	}
+	// Check everything first so a failed build does not take part of the cost
+	if (resources.gold < goldCost || resources.wood < woodCost || resources.stone < stoneCost) return false;
+	spendGold(goldCost);
+	spendWood(woodCost);
+	spendStone(stoneCost);
+	if (events) {
+		pendingBuildings++;
+		events->schedule(CONSTRUCTION_TURNS, EVENT_CONSTRUCTION, index, type);
 	}
 	else {
-		cout << "Not enough resources!\n";
+		buildings.append() = Building(structureName(type), type, 20);
+		productionDirty = true;
+	}
+	changedFields |= FIELD_BUILDINGS;
+	return true;
+}
+
+void Kingdom::completeStructure(ResourceType type) {
+	if (pendingBuildings <= 0 || buildings.full()) return;
+	pendingBuildings--;
+	buildings.append() = Building(structureName(type), type, 20);
+	productionDirty = true;
+	changedFields |= FIELD_BUILDINGS;
+}
+
+bool Kingdom::upgradeBuilding(int buildingIndex) {
+	if (buildingIndex < 0 || buildingIndex >= buildings.size()) return false;
+	if (resources.gold < 100 || resources.stone < 100) return false;
+	spendGold(100);
+	spendStone(100);
+	buildings[buildingIndex].upgrade();
+	productionDirty = true;
+	changedFields |= FIELD_BUILDINGS;
+	return true;
+}
+
+void Kingdom::recruitUnits() {
+	cout << "Enter number of " << UnitCatalog::shared().getType(0).name << " to recruit (Cost: 10 Gold, 5 Food each): ";
+	int count;
+	cin >> count;
+	if (count <= 0) return;
+	if (recruitSoldiers(count)) {
+		cout << count << " " << UnitCatalog::shared().getType(0).name << " recruited.\n";
+	}
+	else {
+		cout << "Not enough resources!\n";
 	}
 }
 
 void Kingdom::trainTroops() {
+	const UnitCatalog& catalog = UnitCatalog::shared();
 	cout << "Choose unit type to train:\n";
-	cout << "1. Soldiers (Cost: 10 Gold)\n";
-	cout << "2. Archers (Cost: 15 Gold)\n";
-	cout << "3. Cavalry (Cost: 20 Gold)\n";
-	cout << "4. Siege Units (Cost: 25 Gold)\n";
+	catalog.display();
 	int choice;
 	cin >> choice;
 	cout << "Enter amount: ";
 	int amount;
 	cin >> amount;
 	if (amount <= 0) return;
-	ResourceType type;
-	int cost;
-	switch (choice) {
-	case 1: type = GOLD; cost = 10; break;
-	case 2: type = FOOD; cost = 15; break;
-	case 3: type = WOOD; cost = 20; break;
-	case 4: type = STONE; cost = 25; break;
-	default: cout << "Invalid choice.\n"; return;
+	if (choice < 1 || choice > catalog.getTypeCount()) {
+		cout << "Invalid choice.\n";
+		return;
 	}
-	if (spendGold(amount * cost)) {
-		military.trainUnits(type, amount);
+	if (trainTroops(choice - 1, amount)) {
 		cout << amount << " units trained.\n";
 	}
 	else {
@@ -347,6 +1236,16 @@ void Kingdom::trainTroops() {
 	}
 }
 
+bool Kingdom::trainTroops(int unitType, int amount) {
+	const UnitCatalog& catalog = UnitCatalog::shared();
+	if (amount <= 0 || unitType < 0 || unitType >= catalog.getTypeCount()) return false;
+	// In 64 bits, so no amount wraps around to a price the kingdom can pay
+	long long cost = (long long)amount * catalog.getType(unitType).goldCost;
+	if (cost > resources.gold || !spendGold((int)cost)) return false;
+	military.trainUnits(unitType, amount);
+	return true;
+}
+
 void Kingdom::managePopulation() {
 	cout << "1. Increase Happiness (Cost: 100 Gold, 50 Food)\n";
 	cout << "2. Boost Population (Cost: 200 Gold, 100 Food)\n";
@@ -355,10 +1254,12 @@ void Kingdom::managePopulation() {
 	if (choice == 1 && spendGold(100) && spendFood(50)) {
 		happiness += 20;
 		if (happiness > 100) happiness = 100;
+		changedFields |= FIELD_POPULATION;
 		cout << "Happiness increased!\n";
 	}
 	else if (choice == 2 && spendGold(200) && spendFood(100)) {
 		population += 50;
+		changedFields |= FIELD_POPULATION;
 		cout << "Population increased!\n";
 	}
 	else {
@@ -382,30 +1283,54 @@ void Kingdom::researchTechnology() {
 	case 4: type = STONE; break;
 	default: cout << "Invalid choice.\n"; return;
 	}
-	if (tech.researchTechnology(type)) {
-		cout << "Technology researched!\n";
+	if (researchTechnology(type)) {
+		if (events) cout << "Research started, complete in " << RESEARCH_TURNS << " turns.\n";
+		else cout << "Technology researched!\n";
 	}
 	else {
 		cout << "Not enough research points or already researched!\n";
 	}
+}
+
+bool Kingdom::researchTechnology(ResourceType type) {
+	bool researched;
+	if (events) {
+		researched = tech.beginResearch(type);
+		if (researched) events->schedule(RESEARCH_TURNS, EVENT_RESEARCH, index, type);
+	}
+	else {
+		researched = tech.researchTechnology(type);
+		if (researched) productionDirty = true;
+	}
 	tech.addResearchPoints(20); // Gain some points each turn
+	changedFields |= FIELD_TECHNOLOGY;
+	return researched;
+}
+
+void Kingdom::completeResearch(ResourceType type) {
+	if (!tech.isResearching(type)) return;
+	tech.completeResearch(type);
+	productionDirty = true;
+	changedFields |= FIELD_TECHNOLOGY;
 }
 
 void Kingdom::fortify() {
 	if (spendStone(50) && spendGold(100)) {
-		cout << "Fortifications strengthened!\n";
 		// Increase defense power (simplified)
-		military.addSoldiers(10);
+		military.addUnits(0, 10);
+		EventLog::record(LOG_FORTIFIED, index, -1, 10);
 	}
 	else {
-		cout << "Not enough resources!\n";
+		EventLog::record(LOG_FORTIFY_FAILED, index, -1, 0);
 	}
 }
 
-void Kingdom::recruitSoldiers(int count) {
-	if (spendGold(count * 10) && spendFood(count * 5)) {
-		military.addSoldiers(count);
-	}
+bool Kingdom::recruitSoldiers(int count) {
+	if (count <= 0 || (long long)count * 10 > resources.gold || (long long)count * 5 > resources.food) return false;
+	spendGold(count * 10);
+	spendFood(count * 5);
+	military.addUnits(0, count);
+	return true;
 }
 
 void Kingdom::displayStatus() const {
@@ -420,23 +1345,32 @@ void Kingdom::displayStatus() const {
 	cout << "Stone: " << resources.stone << endl;
 	tech.display();
 	cout << "Buildings:\n";
-	for (int i = 0; i < buildingCount; i++) {
+	for (int i = 0; i < buildings.size(); i++) {
 		cout << buildings[i].getName() << " (Level " << buildings[i].getLevel() << ")\n";
 	}
+	if (pendingBuildings > 0) cout << pendingBuildings << " under construction\n";
 }
 
 void Kingdom::displayMilitary() const {
 	military.display();
 }
 
-void Kingdom::spyOn(Kingdom* target) {
-	if (spendGold(50)) {
-		cout << "Spying on " << target->getName() << ":\n";
-		target->displayStatus();
+// Spies only reach a seat within sight, and come back with estimates rather than the ledgers
+void Kingdom::spyOn(const Kingdom* target, bool inSight) {
+	if (!inSight) {
+		cout << target->getName() << " lies beyond our sight; no spy can find it.\n";
+		return;
 	}
-	else {
+	if (!spendGold(50)) {
 		cout << "Not enough gold to spy!\n";
+		return;
 	}
+	cout << "Spying on " << target->getName() << ":\n";
+	cout << "Population: about " << target->population / 10 * 10 << endl;
+	cout << "Mood: " << (target->happiness >= 60 ? "content" : target->happiness >= 30 ? "restless" : "unruly") << endl;
+	cout << "Treasury: about " << target->resources.gold / 100 * 100 << " gold, "
+		<< target->resources.food / 100 * 100 << " food\n";
+	cout << "Army: about " << target->military.getTotalUnits() / 10 * 10 << " units\n";
 }
 
 void Kingdom::saveToFile(ofstream& outFile) {
@@ -446,10 +1380,12 @@ void Kingdom::saveToFile(ofstream& outFile) {
 	outFile.write((char*)&resources, sizeof(resources));
 	military.saveToFile(outFile);
 	tech.saveToFile(outFile);
+	int buildingCount = buildings.size();
 	outFile.write((char*)&buildingCount, sizeof(buildingCount));
 	for (int i = 0; i < buildingCount; i++) {
 		buildings[i].saveToFile(outFile);
 	}
+	outFile.write((char*)&pendingBuildings, sizeof(pendingBuildings));
 	outFile.write((char*)&x, sizeof(x));
 	outFile.write((char*)&y, sizeof(y));
 }
@@ -461,35 +1397,362 @@ void Kingdom::loadFromFile(ifstream& inFile) {
 	inFile.read((char*)&resources, sizeof(resources));
 	military.loadFromFile(inFile);
 	tech.loadFromFile(inFile);
+	int buildingCount = 0;
 	inFile.read((char*)&buildingCount, sizeof(buildingCount));
-	for (int i = 0; i < buildingCount; i++) {
+	buildings.resize(buildingCount);
+	for (int i = 0; i < buildings.size(); i++) {
 		buildings[i].loadFromFile(inFile);
 	}
+	inFile.read((char*)&pendingBuildings, sizeof(pendingBuildings));
 	inFile.read((char*)&x, sizeof(x));
 	inFile.read((char*)&y, sizeof(y));
+	productionDirty = true;
+	changedFields = 0;
+}
+
+// Terrain
+struct TerrainInfo {
+	char symbol;
+	const char* name;
+	int moveCost;
+	int defenseBonus; // Percent
+	int yield[4]; // Per owned tile per turn, by ResourceType
+};
+
+static const TerrainInfo TERRAIN_INFO[TERRAIN_TYPES] = {
+	{ '.', "plains", 1, 0, { 0, 1, 0, 0 } },
+	{ '*', "forest", 2, 10, { 0, 0, 1, 0 } },
+	{ '^', "hills", 2, 25, { 0, 0, 0, 1 } },
+	{ '#', "mountains", 3, 50, { 1, 0, 0, 1 } },
+	{ '~', "water", 3, 0, { 0, 1, 0, 0 } },
+};
+
+static unsigned int latticeHash(unsigned int seed, int x, int y) {
+	unsigned int h = seed ^ ((unsigned int)x * 0x8DA6B343u) ^ ((unsigned int)y * 0xD8163841u);
+	h ^= h >> 16;
+	h *= 0x7FEB352Du;
+	h ^= h >> 15;
+	h *= 0x846CA68Bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// Value noise from 0 to 255 with a lattice point every 2^shift tiles, smoothstepped between them.
+// Integer only, so every platform builds the same world from a seed.
+static int valueNoise(unsigned int seed, int x, int y, int shift) {
+	int cx = x >> shift, cy = y >> shift;
+	int mask = (1 << shift) - 1;
+	int fx = ((x & mask) << 8) >> shift;
+	int fy = ((y & mask) << 8) >> shift;
+	int sx = fx * fx * (768 - 2 * fx) >> 16;
+	int sy = fy * fy * (768 - 2 * fy) >> 16;
+	int v00 = latticeHash(seed, cx, cy) & 255, v10 = latticeHash(seed, cx + 1, cy) & 255;
+	int v01 = latticeHash(seed, cx, cy + 1) & 255, v11 = latticeHash(seed, cx + 1, cy + 1) & 255;
+	int top = v00 + (v10 - v00) * sx / 256;
+	int bottom = v01 + (v11 - v01) * sx / 256;
+	return top + (bottom - top) * sy / 256;
+}
+
+// Three octaves, 16, 8 and 4 tiles across, the coarsest weighing most
+static int fractalNoise(unsigned int seed, int x, int y) {
+	return (4 * valueNoise(seed, x, y, 4) + 2 * valueNoise(seed * 31 + 1, x, y, 3) + valueNoise(seed * 31 * 31 + 2, x, y, 2)) / 7;
 }
 
 // Map class implementation
-Map::Map() : width(MAP_SIZE), height(MAP_SIZE) {
+Map::Map() : width(MAP_SIZE), height(MAP_SIZE), territoryControl(influence[0]), viewX(0), viewY(0), fog(nullptr), terrainSeed(0) {
 	for (int i = 0; i < width; i++) {
 		for (int j = 0; j < height; j++) {
 			grid[i][j] = 0;
+			tileChanged[i][j] = 0;
 			for (int k = 0; k < MAX_KINGDOMS; k++) {
-				territoryControl[k][i][j] = 0;
+				influence[0][k][i][j] = 0;
+				influence[1][k][i][j] = 0;
 			}
 		}
 	}
+	for (int k = 0; k < MAX_KINGDOMS; k++) territoryChanged[k] = 0;
+	for (int c = 0; c < OWNERSHIP_CHUNKS; c++) {
+		chunkDirty[c] = 0;
+		terrainReady[c] = 0;
+	}
+	rebuildPyramid();
 }
 
-Map::Map(int w, int h) : width(min(w, MAP_SIZE)), height(min(h, MAP_SIZE)) {
+Map::Map(int w, int h) : width(min(w, MAP_SIZE)), height(min(h, MAP_SIZE)), territoryControl(influence[0]), viewX(0), viewY(0), fog(nullptr), terrainSeed(0) {
 	for (int i = 0; i < width; i++) {
 		for (int j = 0; j < height; j++) {
 			grid[i][j] = 0;
+			tileChanged[i][j] = 0;
 			for (int k = 0; k < MAX_KINGDOMS; k++) {
-				territoryControl[k][i][j] = 0;
+				influence[0][k][i][j] = 0;
+				influence[1][k][i][j] = 0;
+			}
+		}
+	}
+	for (int k = 0; k < MAX_KINGDOMS; k++) territoryChanged[k] = 0;
+	for (int c = 0; c < OWNERSHIP_CHUNKS; c++) {
+		chunkDirty[c] = 0;
+		terrainReady[c] = 0;
+	}
+	rebuildPyramid();
+}
+
+int Map::levelWidth(int level) const { return (width + (1 << level) - 1) >> level; }
+int Map::levelHeight(int level) const { return (height + (1 << level) - 1) >> level; }
+
+// Where each pyramid level starts in the flat array, and its row length
+struct PyramidLayout {
+	int offset[PYRAMID_LEVELS];
+	int side[PYRAMID_LEVELS];
+};
+
+static constexpr PyramidLayout makePyramidLayout() {
+	PyramidLayout layout = {};
+	for (int l = 0; l < PYRAMID_LEVELS; l++) {
+		layout.offset[l] = pyramidCellsBelow(l);
+		layout.side[l] = pyramidSide(l);
+	}
+	return layout;
+}
+
+static constexpr PyramidLayout PYRAMID_LAYOUT = makePyramidLayout();
+
+MapSummary& Map::summaryAt(int level, int i, int j) {
+	return pyramid[PYRAMID_LAYOUT.offset[level] + i * PYRAMID_LAYOUT.side[level] + j];
+}
+
+const MapSummary& Map::summaryAt(int level, int i, int j) const {
+	return pyramid[PYRAMID_LAYOUT.offset[level] + i * PYRAMID_LAYOUT.side[level] + j];
+}
+
+void Map::rebuildPyramid() {
+	if (fog) fog->clear(width, height);
+	for (int l = 0; l < PYRAMID_LEVELS; l++) {
+		for (int i = 0; i < levelWidth(l); i++) {
+			for (int j = 0; j < levelHeight(l); j++) {
+				summaryAt(l, i, j) = MapSummary();
+			}
+		}
+	}
+	for (int k = 0; k < MAX_KINGDOMS; k++) {
+		ownedArea[k] = 0;
+		for (int r = 0; r < 4; r++) landYield[k][r] = 0;
+	}
+	for (int i = 0; i < width; i++) {
+		bool held = false;
+		for (int j = 0; j < height; j++) {
+			tileOwner[i][j] = -1;
+			tileControl[i][j] = 0;
+			for (int l = 0; l < PYRAMID_LEVELS; l++) {
+				summaryAt(l, i >> l, j >> l).tileCount++;
+			}
+			for (int k = 0; k < MAX_KINGDOMS; k++) held |= territoryControl[k][i][j] != 0;
+		}
+		// Rows nobody holds are already resolved, and their terrain is left until it is needed
+		if (held) markChunk(i);
+	}
+	resolveOwnership();
+}
+
+// Called wherever a tile's grid entry or any kingdom's control over it is written
+void Map::markTile(int x, int y) {
+	if (tileChanged[x][y]) return;
+	tileChanged[x][y] = 1;
+	changedTiles.push_back(x * MAP_SIZE + y);
+}
+
+// Called wherever any kingdom's control over a tile is written
+void Map::markChunk(int x) {
+	int chunk = x / OWNERSHIP_CHUNK_ROWS;
+	if (chunkDirty[chunk]) return;
+	chunkDirty[chunk] = 1;
+	dirtyChunks.push_back(chunk);
+}
+
+// Branch-free argmax over the kingdom layers for a run of contiguous tiles. The kingdoms are the
+// outer loop so the inner one runs over adjacent tiles and vectorizes. Ties go to the lower index.
+void Map::resolveOwners(const int* layers, int layerStride, int layerCount, int count, int* owner, int* control) {
+	for (int t = 0; t < count; t++) {
+		owner[t] = -1;
+		control[t] = 0;
+	}
+	for (int k = 0; k < layerCount; k++) {
+		const int* layer = layers + (size_t)k * layerStride;
+		for (int t = 0; t < count; t++) {
+			int take = layer[t] > control[t];
+			control[t] = take ? layer[t] : control[t];
+			owner[t] = take ? k : owner[t];
+		}
+	}
+}
+
+// A chunk's rows are contiguous in every layer, so each one is a single run for the kernel;
+// only tiles whose owner or control came out different go on to applyOwnership. The terrain
+// of every chunk involved is generated first, since owned land yields by its terrain.
+void Map::resolveOwnership() {
+	int owners[OWNERSHIP_CHUNK_ROWS * MAP_SIZE];
+	int controls[OWNERSHIP_CHUNK_ROWS * MAP_SIZE];
+	vector<int> missing;
+	for (size_t c = 0; c < dirtyChunks.size(); c++) {
+		if (!terrainReady[dirtyChunks[c]]) missing.push_back(dirtyChunks[c]);
+	}
+	if (!missing.empty()) generateTerrain(missing);
+	for (size_t c = 0; c < dirtyChunks.size(); c++) {
+		int chunk = dirtyChunks[c];
+		chunkDirty[chunk] = 0;
+		int first = chunk * OWNERSHIP_CHUNK_ROWS;
+		int last = min(width, first + OWNERSHIP_CHUNK_ROWS);
+		if (first >= last) continue;
+		resolveOwners(&territoryControl[0][first][0], MAP_SIZE * MAP_SIZE, MAX_KINGDOMS, (last - first) * MAP_SIZE, owners, controls);
+		for (int x = first; x < last; x++) {
+			const int* rowOwners = owners + (x - first) * MAP_SIZE;
+			const int* rowControls = controls + (x - first) * MAP_SIZE;
+			for (int y = 0; y < height; y++) {
+				if (rowOwners[y] != tileOwner[x][y] || rowControls[y] != tileControl[x][y]) {
+					applyOwnership(x, y, rowOwners[y], rowControls[y]);
+				}
+			}
+		}
+	}
+	dirtyChunks.clear();
+}
+
+// Records a tile's new owner and pushes the difference up every pyramid level
+void Map::applyOwnership(int x, int y, int owner, int control) {
+	int oldOwner = tileOwner[x][y];
+	int oldControl = tileControl[x][y];
+	if (grid[x][y] == 0 && (control >= 50) != (oldControl >= 50)) {
+		TileChange change = { x, y, movementCost(x, y) };
+		costChanges.push_back(change);
+	}
+	tileOwner[x][y] = owner;
+	tileControl[x][y] = control;
+	if (owner != oldOwner) {
+		const int* yield = TERRAIN_INFO[terrain[x][y]].yield;
+		for (int r = 0; r < 4; r++) {
+			if (oldOwner >= 0) landYield[oldOwner][r] -= yield[r];
+			if (owner >= 0) landYield[owner][r] += yield[r];
+		}
+		if (oldOwner >= 0) ownedArea[oldOwner]--;
+		if (owner >= 0) ownedArea[owner]++;
+		int kingdoms[2] = { oldOwner, owner };
+		for (int i = 0; i < 2; i++) {
+			if (kingdoms[i] < 0 || territoryChanged[kingdoms[i]]) continue;
+			territoryChanged[kingdoms[i]] = 1;
+			changedTerritories.push_back(kingdoms[i]);
+		}
+		if (fog) fog->setOwner(x, y, oldOwner, owner);
+	}
+	for (int l = 0; l < PYRAMID_LEVELS; l++) {
+		MapSummary& cell = summaryAt(l, x >> l, y >> l);
+		if (oldOwner >= 0) {
+			cell.ownedTiles[oldOwner]--;
+			cell.controlSum -= oldControl;
+		}
+		if (owner >= 0) {
+			cell.ownedTiles[owner]++;
+			cell.controlSum += control;
+		}
+	}
+}
+
+int Map::getWidth() const { return width; }
+int Map::getHeight() const { return height; }
+
+int Map::getKingdomIndexAt(int x, int y) const {
+	if (x < 0 || x >= width || y < 0 || y >= height) return -1;
+	return grid[x][y] - 1;
+}
+
+int Map::getOwnedTiles(int kingdom) const {
+	return kingdom >= 0 && kingdom < MAX_KINGDOMS ? ownedArea[kingdom] : 0;
+}
+
+// Elevation picks water, hills and mountains; moisture splits the lowland into forest and plains
+Terrain Map::generateTile(unsigned int seed, int x, int y) {
+	int elevation = fractalNoise(seed, x, y);
+	if (elevation < 100) return TERRAIN_WATER;
+	if (elevation >= 168) return TERRAIN_MOUNTAINS;
+	if (elevation >= 148) return TERRAIN_HILLS;
+	return fractalNoise(seed ^ 0x9E3779B9u, x, y) >= 136 ? TERRAIN_FOREST : TERRAIN_PLAINS;
+}
+
+// Chunks share nothing, so they are generated in parallel
+void Map::generateTerrain(const vector<int>& chunks) {
+	int grain = max(1, TERRAIN_TASK_TILES / (OWNERSHIP_CHUNK_ROWS * MAP_SIZE));
+	ThreadPool::shared().parallelFor((int)chunks.size(), grain, [&](int begin, int end) {
+		for (int c = begin; c < end; c++) {
+			int first = chunks[c] * OWNERSHIP_CHUNK_ROWS;
+			int last = min(width, first + OWNERSHIP_CHUNK_ROWS);
+			for (int x = first; x < last; x++) {
+				for (int y = 0; y < height; y++) terrain[x][y] = (unsigned char)generateTile(terrainSeed, x, y);
 			}
 		}
+	});
+	for (size_t c = 0; c < chunks.size(); c++) terrainReady[chunks[c]] = 1;
+}
+
+// Chunks not generated yet are worked out on the spot, so const readers never write the map
+Terrain Map::getTerrain(int x, int y) const {
+	if (terrainReady[x / OWNERSHIP_CHUNK_ROWS]) return (Terrain)terrain[x][y];
+	return generateTile(terrainSeed, x, y);
+}
+
+int Map::getDefenseBonus(int x, int y) const {
+	if (x < 0 || x >= width || y < 0 || y >= height) return 0;
+	return TERRAIN_INFO[getTerrain(x, y)].defenseBonus;
+}
+
+int Map::getSeatDefense(const Kingdom* kingdom) const {
+	int defense = kingdom->getMilitary().calculateDefensePower();
+	return defense + defense * getDefenseBonus(kingdom->getX(), kingdom->getY()) / 100;
+}
+
+int Map::getLandYield(int kingdom, ResourceType type) const {
+	return kingdom >= 0 && kingdom < MAX_KINGDOMS ? landYield[kingdom][type] : 0;
+}
+
+// Throws away the generated terrain and recounts what the owned land yields
+void Map::setTerrainSeed(unsigned int seed) {
+	terrainSeed = seed;
+	for (int c = 0; c < OWNERSHIP_CHUNKS; c++) terrainReady[c] = 0;
+	rebuildPyramid();
+}
+
+int Map::getTileOwner(int x, int y) const {
+	if (x < 0 || x >= width || y < 0 || y >= height) return -1;
+	return tileOwner[x][y];
+}
+
+// Cost for an army to enter the tile: strongly held land is slow going, capitals block the way
+int Map::movementCost(int x, int y) const {
+	if (x < 0 || x >= width || y < 0 || y >= height || grid[x][y] != 0) return -1;
+	// Never more than a turn's march, so every open tile can be crossed
+	return min(ARMY_MOVE_POINTS, TERRAIN_INFO[getTerrain(x, y)].moveCost + (tileControl[x][y] >= 50 ? 1 : 0));
+}
+
+void Map::takeCostChanges(vector<TileChange>& changes) {
+	changes.clear();
+	changes.swap(costChanges);
+}
+
+// Appends one entry per tile changed since the last call, with the tile's owner now
+void Map::takeTileChanges(vector<Change>& out) {
+	for (size_t i = 0; i < changedTiles.size(); i++) {
+		int x = changedTiles[i] / MAP_SIZE, y = changedTiles[i] % MAP_SIZE;
+		tileChanged[x][y] = 0;
+		Change change = { CHANGE_TILE, changedTiles[i], tileOwner[x][y] };
+		out.push_back(change);
+	}
+	changedTiles.clear();
+}
+
+void Map::takeTerritoryChanges(vector<int>& out) {
+	for (size_t i = 0; i < changedTerritories.size(); i++) {
+		territoryChanged[changedTerritories[i]] = 0;
+		out.push_back(changedTerritories[i]);
 	}
+	changedTerritories.clear();
 }
 
 bool Map::isOccupied(int x, int y) const {
@@ -499,24 +1762,36 @@ bool Map::isOccupied(int x, int y) const {
 
 void Map::placeKingdom(Kingdom* kingdom, int x, int y) {
 	if (isOccupied(x, y)) {
-		cout << "Cannot place kingdom on occupied tile!\n";
+		EventLog::record(LOG_TILE_OCCUPIED, kingdom->getIndex(), -1, x * MAP_SIZE + y);
 		return;
 	}
+	// First index not already marked on the grid
+	bool used[MAX_KINGDOMS] = {};
+	for (int i = 0; i < width; i++) {
+		for (int j = 0; j < height; j++) {
+			if (grid[i][j] > 0) used[grid[i][j] - 1] = true;
+		}
+	}
 	int kingdomIndex = -1;
 	for (int i = 0; i < MAX_KINGDOMS; i++) {
-		if (grid[x][y] == 0) {
+		if (!used[i]) {
 			kingdomIndex = i;
 			break;
 		}
 	}
 	if (kingdomIndex == -1) {
-		cout << "Maximum kingdoms reached!\n";
+		EventLog::record(LOG_KINGDOMS_FULL, kingdom->getIndex(), -1, 0);
 		return;
 	}
+	TileChange change = { x, y, movementCost(x, y) };
+	costChanges.push_back(change);
 	grid[x][y] = kingdomIndex + 1;
 	kingdom->setPosition(x, y);
 	territoryControl[kingdomIndex][x][y] = 100;
-	expandTerritory(kingdom);
+	markTile(x, y);
+	markChunk(x);
+	expandTerritory(kingdom); // Resolves the seat's chunk along with the rest
+
 }
 
 bool Map::moveKingdom(Kingdom* kingdom) {
@@ -537,8 +1812,14 @@ bool Map::moveKingdom(Kingdom* kingdom) {
 		cout << "Invalid or occupied position!\n";
 		return false;
 	}
+	TileChange vacated = { currentX, currentY, -1 };
+	TileChange settled = { newX, newY, movementCost(newX, newY) };
+	costChanges.push_back(vacated);
+	costChanges.push_back(settled);
 	grid[currentX][currentY] = 0;
 	grid[newX][newY] = kingdomIndex + 1;
+	markTile(currentX, currentY);
+	markTile(newX, newY);
 	kingdom->setPosition(newX, newY);
 	expandTerritory(kingdom);
 	return true;
@@ -551,48 +1832,208 @@ void Map::expandTerritory(Kingdom* kingdom) {
 	if (kingdomIndex < 0) return;
 	int strength = kingdom->getMilitary().calculateAttackPower() / 10;
 	if (strength < 1) strength = 1;
-	for (int i = 0; i < width; i++) {
-		for (int j = 0; j < height; j++) {
+	// Only tiles inside the influence diamond can change
+	for (int i = max(0, x - strength); i <= min(width - 1, x + strength); i++) {
+		for (int j = max(0, y - strength); j <= min(height - 1, y + strength); j++) {
 			int distance = abs(i - x) + abs(j - y);
 			if (distance <= strength) {
 				int influence = 100 - (distance * 10);
 				if (influence > territoryControl[kingdomIndex][i][j]) {
 					territoryControl[kingdomIndex][i][j] = influence;
+					markTile(i, j);
+					markChunk(i);
 				}
 			}
 		}
 	}
+	resolveOwnership();
 }
 
-void Map::displayMap() const {
-	cout << "\nWorld Map:\n  ";
-	for (int i = 0; i < width; i++) cout << i << " ";
-	cout << endl;
-	for (int j = 0; j < height; j++) {
-		cout << j << " ";
-		for (int i = 0; i < width; i++) {
-			if (grid[i][j] == 0) cout << ". ";
-			else cout << grid[i][j] << " ";
+// One row of a kingdom's layer. Decay rounds down so influence nothing holds up dies out, and
+// past the edge of the map counts as empty. Returns nonzero if any tile changed.
+int Map::diffuseRow(const int* up, const int* row, const int* down, int* out, int count, int falloff) {
+	int last = count - 1;
+	int moved = 0;
+	out[0] = max((row[0] * INFLUENCE_KEEP) >> INFLUENCE_SHIFT, max(max(up[0], down[0]), last > 0 ? row[1] : 0) - falloff);
+	for (int y = 1; y < last; y++) {
+		int neighbour = max(max(up[y], down[y]), max(row[y - 1], row[y + 1]));
+		out[y] = max((row[y] * INFLUENCE_KEEP) >> INFLUENCE_SHIFT, neighbour - falloff);
+		moved |= out[y] ^ row[y];
+	}
+	if (last > 0) out[last] = max((row[last] * INFLUENCE_KEEP) >> INFLUENCE_SHIFT, max(max(up[last], down[last]), row[last - 1]) - falloff);
+	return moved | (out[0] ^ row[0]) | (out[last] ^ row[last]);
+}
+
+// Once a turn every kingdom's influence decays and spreads to neighbouring tiles, further the
+// stronger its army, while its seat holds at 100; a layer with no seat only decays. Each task is
+// a chunk of rows in one layer, read from the current copy and written to the other, so tasks
+// share nothing. Rows that moved are then checked tile by tile for the journal and ownership.
+void Map::updateInfluence(Kingdom* kingdoms[], int kingdomCount) {
+	int falloff[MAX_KINGDOMS];
+	int seatX[MAX_KINGDOMS], seatY[MAX_KINGDOMS];
+	for (int k = 0; k < MAX_KINGDOMS; k++) {
+		falloff[k] = 100;
+		seatX[k] = -1;
+		seatY[k] = -1;
+	}
+	for (int i = 0; i < kingdomCount; i++) {
+		int x = kingdoms[i]->getX();
+		int y = kingdoms[i]->getY();
+		if (x < 0 || x >= width || y < 0 || y >= height || grid[x][y] == 0) continue;
+		int layer = grid[x][y] - 1;
+		int strength = kingdoms[i]->getMilitary().calculateAttackPower() / 10;
+		if (strength < 1) strength = 1;
+		falloff[layer] = max(INFLUENCE_MIN_FALLOFF, 100 / (strength + 1));
+		seatX[layer] = x;
+		seatY[layer] = y;
+	}
+
+	static const int emptyRow[MAP_SIZE] = {};
+	int (*source)[MAP_SIZE][MAP_SIZE] = territoryControl;
+	int (*target)[MAP_SIZE][MAP_SIZE] = territoryControl == influence[0] ? influence[1] : influence[0];
+	unsigned char rowMoved[MAX_KINGDOMS][MAP_SIZE];
+	int chunks = (width + OWNERSHIP_CHUNK_ROWS - 1) / OWNERSHIP_CHUNK_ROWS;
+	int grain = max(1, INFLUENCE_TASK_TILES / (OWNERSHIP_CHUNK_ROWS * MAP_SIZE));
+	ThreadPool::shared().parallelFor(MAX_KINGDOMS * chunks, grain, [&](int begin, int end) {
+		for (int task = begin; task < end; task++) {
+			int k = task / chunks;
+			int first = (task % chunks) * OWNERSHIP_CHUNK_ROWS;
+			int last = min(width, first + OWNERSHIP_CHUNK_ROWS);
+			for (int x = first; x < last; x++) {
+				const int* up = x > 0 ? source[k][x - 1] : emptyRow;
+				const int* down = x + 1 < width ? source[k][x + 1] : emptyRow;
+				int moved = diffuseRow(up, source[k][x], down, target[k][x], height, falloff[k]);
+				if (x == seatX[k]) {
+					target[k][x][seatY[k]] = 100;
+					moved = memcmp(target[k][x], source[k][x], height * sizeof(int));
+				}
+				rowMoved[k][x] = moved != 0;
+			}
+		}
+	});
+	territoryControl = target;
+
+	for (int x = 0; x < width; x++) {
+		bool any = false;
+		for (int k = 0; k < MAX_KINGDOMS; k++) any |= rowMoved[k][x] != 0;
+		if (!any) continue;
+		markChunk(x);
+		for (int y = 0; y < height; y++) {
+			for (int k = 0; k < MAX_KINGDOMS; k++) {
+				if (rowMoved[k][x] && target[k][x][y] != source[k][x][y]) {
+					markTile(x, y);
+					break;
+				}
+			}
 		}
-		cout << endl;
 	}
+	resolveOwnership();
 }
 
-void Map::displayTerritory(Kingdom* kingdom) const {
-	int kingdomIndex = -1;
+void Map::attachFog(FogOfWar* visibility) {
+	fog = visibility;
+	fog->clear(width, height);
 	for (int i = 0; i < width; i++) {
 		for (int j = 0; j < height; j++) {
-			if (grid[i][j] > 0 && strcmp(kingdom->getName(), "") != 0) {
-				kingdomIndex = grid[i][j] - 1;
-				break;
+			if (tileOwner[i][j] >= 0) fog->setOwner(i, j, -1, tileOwner[i][j]);
+		}
+	}
+}
+
+void Map::centerViewport(int x, int y) {
+	viewX = x - VIEWPORT_WIDTH / 2;
+	viewY = y - VIEWPORT_HEIGHT / 2;
+	scrollViewport(0, 0);
+}
+
+void Map::scrollViewport(int dx, int dy) {
+	viewX = max(0, min(viewX + dx, width - VIEWPORT_WIDTH));
+	viewY = max(0, min(viewY + dy, height - VIEWPORT_HEIGHT));
+}
+
+void Map::displayMap(int viewer) const {
+	displayViewport(viewer);
+	displayMinimap(viewer);
+}
+
+void Map::displayViewport(int viewer) const {
+	int right = min(width, viewX + VIEWPORT_WIDTH);
+	int bottom = min(height, viewY + VIEWPORT_HEIGHT);
+	cout << "\nWorld Map (" << viewX << "," << viewY << ") to (" << right - 1 << "," << bottom - 1 << "):\n    ";
+	for (int i = viewX; i < right; i++) cout << setw(3) << i;
+	cout << endl;
+	for (int j = viewY; j < bottom; j++) {
+		cout << setw(4) << j;
+		for (int i = viewX; i < right; i++) {
+			if (viewer >= 0 && fog && !fog->canSee(viewer, i, j)) cout << setw(3) << '?';
+			else if (grid[i][j] != 0) cout << setw(3) << grid[i][j];
+			else if (tileOwner[i][j] >= 0) cout << setw(3) << char('a' + tileOwner[i][j]);
+			else cout << setw(3) << TERRAIN_INFO[getTerrain(i, j)].symbol;
+		}
+		cout << endl;
+	}
+	cout << "Digits mark kingdoms, letters mark their territory (a = 1, b = 2, ...), ? is out of sight\n";
+	cout << "Open land: . plains, * forest, ^ hills, # mountains, ~ water\n";
+}
+
+// Cells the viewer sees whole come straight from the pyramid; the rest are summed over the tiles in sight
+void Map::displayMinimap(int viewer) const {
+	// Coarsest level detailed enough to use the minimap space
+	int level = 0;
+	while (level < PYRAMID_LEVELS - 1 && (levelWidth(level) > MINIMAP_SIZE || levelHeight(level) > MINIMAP_SIZE)) {
+		level++;
+	}
+	int block = 1 << level;
+	cout << "\nMinimap (" << block << "x" << block << " tiles per cell, owner:avg control, [] = view, ? = out of sight):\n";
+	for (int j = 0; j < levelHeight(level); j++) {
+		for (int i = 0; i < levelWidth(level); i++) {
+			const MapSummary& cell = summaryAt(level, i, j);
+			int left = i * block, top = j * block, right = min(width, left + block), bottom = min(height, top + block);
+			int seen = viewer >= 0 && fog ? fog->countVisible(viewer, -1, left, top, right, bottom) : cell.tileCount;
+			int owned[MAX_KINGDOMS];
+			int controlSum = cell.controlSum;
+			for (int k = 0; k < MAX_KINGDOMS; k++) {
+				owned[k] = seen == cell.tileCount ? cell.ownedTiles[k] : fog->countVisible(viewer, k, left, top, right, bottom);
+			}
+			if (seen > 0 && seen < cell.tileCount) {
+				controlSum = 0;
+				for (int x = left; x < right; x++) {
+					for (int y = top; y < bottom; y++) {
+						if (fog->canSee(viewer, x, y)) controlSum += tileControl[x][y];
+					}
+				}
+			}
+			int dominant = -1;
+			for (int k = 0; k < MAX_KINGDOMS; k++) {
+				if (owned[k] > 0 && (dominant < 0 || owned[k] > owned[dominant])) {
+					dominant = k;
+				}
 			}
+			bool inView = (i + 1) * block > viewX && i * block < viewX + VIEWPORT_WIDTH &&
+				(j + 1) * block > viewY && j * block < viewY + VIEWPORT_HEIGHT;
+			cout << (inView ? '[' : ' ');
+			if (seen == 0) cout << "?:  ?";
+			else {
+				if (dominant < 0) cout << ".";
+				else cout << dominant + 1;
+				cout << ":" << setw(3) << controlSum / seen;
+			}
+			cout << (inView ? ']' : ' ');
 		}
+		cout << endl;
 	}
+}
+
+void Map::displayTerritory(Kingdom* kingdom) const {
+	int kingdomIndex = getKingdomIndexAt(kingdom->getX(), kingdom->getY());
 	if (kingdomIndex == -1) {
 		cout << "Kingdom not found!\n";
 		return;
 	}
-	cout << "\nTerritory for " << kingdom->getName() << ":\n  ";
+	cout << "\nTerritory for " << kingdom->getName() << " (" << ownedArea[kingdomIndex] << " tiles owned, seat on "
+		<< TERRAIN_INFO[getTerrain(kingdom->getX(), kingdom->getY())].name << "):\n";
+	cout << "The land yields " << landYield[kingdomIndex][GOLD] << " gold, " << landYield[kingdomIndex][FOOD] << " food, "
+		<< landYield[kingdomIndex][WOOD] << " wood and " << landYield[kingdomIndex][STONE] << " stone per turn.\n  ";
 	for (int i = 0; i < width; i++) cout << i << " ";
 	cout << endl;
 	for (int j = 0; j < height; j++) {
@@ -609,40 +2050,31 @@ void Map::displayTerritory(Kingdom* kingdom) const {
 	}
 }
 
-void Map::launchAttack(Kingdom* attacker, Kingdom* defender) {
+bool Map::isInAttackRange(const Kingdom* attacker, const Kingdom* defender) const {
 	int distance = abs(attacker->getX() - defender->getX()) + abs(attacker->getY() - defender->getY());
-	if (distance > 3) {
-		cout << "Target too far to attack!\n";
-		return;
-	}
-	int attackPower = attacker->getMilitary().calculateAttackPower();
-	int defensePower = defender->getMilitary().calculateDefensePower();
-	cout << attacker->getName() << " attacks " << defender->getName() << "!\n";
-	attackPower = attackPower * (80 + rand() % 41) / 100;
-	defensePower = defensePower * (80 + rand() % 41) / 100;
-	int attackerCasualties = defensePower / 10;
-	int defenderCasualties = attackPower / 8;
-	if (attackPower > defensePower) {
-		cout << attacker->getName() << " wins!\n";
-		attacker->getMilitary().takeCasualties(attackerCasualties);
-		defender->getMilitary().takeCasualties(defenderCasualties);
-		int goldPlunder = defender->getGold() / 5;
-		int foodPlunder = defender->getFood() / 5;
-		defender->spendGold(goldPlunder);
-		defender->spendFood(foodPlunder);
-		attacker->addGold(goldPlunder);
-		attacker->addFood(foodPlunder);
+	return distance <= 3;
+}
+
+bool Map::launchAttack(Kingdom* attacker, Kingdom* defender, BattleQueue& queue) {
+	if (!isInAttackRange(attacker, defender)) {
+		EventLog::record(LOG_ATTACK_OUT_OF_RANGE, attacker->getIndex(), defender->getIndex(), 0);
+		return false;
 	}
-	else {
-		cout << defender->getName() << " defends successfully!\n";
-		attacker->getMilitary().takeCasualties(attackerCasualties * 2);
-		defender->getMilitary().takeCasualties(defenderCasualties / 2);
+	int attackerIndex = grid[attacker->getX()][attacker->getY()] - 1;
+	int defenderIndex = grid[defender->getX()][defender->getY()] - 1;
+	int defenseBonus = getDefenseBonus(defender->getX(), defender->getY());
+	if (attackerIndex < 0 || defenderIndex < 0 || !queue.queueAttack(attackerIndex, defenderIndex, defenseBonus)) {
+		EventLog::record(LOG_ATTACK_REFUSED, attacker->getIndex(), defender->getIndex(), 0);
+		return false;
 	}
+	EventLog::record(LOG_ATTACK_LAUNCHED, attackerIndex, defenderIndex, 0);
+	return true;
 }
 
 void Map::saveToFile(ofstream& outFile) {
 	outFile.write((char*)&width, sizeof(width));
 	outFile.write((char*)&height, sizeof(height));
+	outFile.write((char*)&terrainSeed, sizeof(terrainSeed));
 	for (int i = 0; i < width; i++) {
 		for (int j = 0; j < height; j++) {
 			outFile.write((char*)&grid[i][j], sizeof(grid[i][j]));
@@ -660,6 +2092,8 @@ void Map::saveToFile(ofstream& outFile) {
 void Map::loadFromFile(ifstream& inFile) {
 	inFile.read((char*)&width, sizeof(width));
 	inFile.read((char*)&height, sizeof(height));
+	inFile.read((char*)&terrainSeed, sizeof(terrainSeed));
+	for (int c = 0; c < OWNERSHIP_CHUNKS; c++) terrainReady[c] = 0;
 	for (int i = 0; i < width; i++) {
 		for (int j = 0; j < height; j++) {
 			inFile.read((char*)&grid[i][j], sizeof(grid[i][j]));
@@ -672,361 +2106,4381 @@ void Map::loadFromFile(ifstream& inFile) {
 			}
 		}
 	}
+	for (size_t i = 0; i < changedTiles.size(); i++) tileChanged[changedTiles[i] / MAP_SIZE][changedTiles[i] % MAP_SIZE] = 0;
+	changedTiles.clear();
+	rebuildPyramid();
 }
 
-// DiplomacyManager class implementation
-DiplomacyManager::DiplomacyManager() : treatyCount(0) {
-	for (int i = 0; i < MAX_KINGDOMS; i++) {
-		for (int j = 0; j < MAX_KINGDOMS; j++) {
-			relations[i][j] = NEUTRAL;
-		}
+// One tile's grid entry and every kingdom's control over it
+void Map::saveTile(ofstream& outFile, int tile) {
+	int x = tile / MAP_SIZE, y = tile % MAP_SIZE;
+	outFile.write((char*)&tile, sizeof(tile));
+	outFile.write((char*)&grid[x][y], sizeof(grid[x][y]));
+	for (int k = 0; k < MAX_KINGDOMS; k++) {
+		outFile.write((char*)&territoryControl[k][x][y], sizeof(territoryControl[k][x][y]));
 	}
 }
 
-bool DiplomacyManager::hasTreaty(Kingdom* k1, Kingdom* k2) const {
-	for (int i = 0; i < treatyCount; i++) {
-		if ((strcmp(treaties[i].kingdom1, k1->getName()) == 0 && strcmp(treaties[i].kingdom2, k2->getName()) == 0) ||
-			(strcmp(treaties[i].kingdom1, k2->getName()) == 0 && strcmp(treaties[i].kingdom2, k1->getName()) == 0)) {
-			return treaties[i].active;
-		}
-	}
-	return false;
+// Owners are resolved once for the whole batch
+void Map::loadTiles(ifstream& inFile, int count) {
+	for (int i = 0; i < count && inFile; i++) loadTile(inFile);
+	resolveOwnership();
 }
 
-bool DiplomacyManager::proposeTreaty(Kingdom* proposer, Kingdom* receiver) {
-	if (treatyCount >= MAX_TREATIES || hasTreaty(proposer, receiver)) {
-		cout << "Cannot propose treaty!\n";
-		return false;
+void Map::loadTile(ifstream& inFile) {
+	int tile = -1;
+	inFile.read((char*)&tile, sizeof(tile));
+	int x = tile / MAP_SIZE, y = tile % MAP_SIZE;
+	if (!inFile || tile < 0 || x >= width || y >= height) {
+		inFile.setstate(ios::failbit);
+		return;
 	}
-	cout << "Choose treaty type:\n1. Peace\n2. Alliance\n3. Trade\n4. Non-Aggression\n";
-	int choice;
-	cin >> choice;
-	if (choice < 1 || choice > 4) {
-		cout << "Invalid treaty type!\n";
-		return false;
+	int oldCost = movementCost(x, y);
+	int oldGrid = grid[x][y];
+	inFile.read((char*)&grid[x][y], sizeof(grid[x][y]));
+	for (int k = 0; k < MAX_KINGDOMS; k++) {
+		inFile.read((char*)&territoryControl[k][x][y], sizeof(territoryControl[k][x][y]));
 	}
-	TreatyType type = static_cast<TreatyType>(choice - 1);
-	cout << "Enter duration (turns): ";
-	int duration;
-	cin >> duration;
-	if (duration <= 0) return false;
-	Treaty& t = treaties[treatyCount++];
-	strcpy_s(t.kingdom1, proposer->getName());
-	strcpy_s(t.kingdom2, receiver->getName());
-	t.type = type;
-	t.turnEstablished = 0;
-	t.duration = duration;
-	t.active = true;
-	updateRelations(proposer, receiver, 2);
-	cout << "Treaty proposed!\n";
+	if (grid[x][y] != oldGrid) {
+		TileChange change = { x, y, oldCost };
+		costChanges.push_back(change);
+	}
+	markChunk(x);
+}
+
+// BattleQueue class implementation
+BattleQueue::BattleQueue() {}
+
+// A marching army fights with its own forces; the pointer must stay valid until resolve()
+bool BattleQueue::queueAttack(int attacker, int defender, int bonus, Military* army) {
+	if (attacker == defender) return false;
+	for (size_t i = 0; army == nullptr && i < attackers.size(); i++) {
+		if (attackers[i] == attacker && defenders[i] == defender && forces[i] == nullptr) return false;
+	}
+	attackers.push_back(attacker);
+	defenders.push_back(defender);
+	forces.push_back(army);
+	defenseBonus.push_back(bonus);
 	return true;
 }
 
-bool DiplomacyManager::breakTreaty(Kingdom* kingdom) {
-	cout << "Select treaty to break:\n";
-	int validCount = 0;
-	for (int i = 0; i < treatyCount; i++) {
-		if (treaties[i].active && (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ||
-			strcmp(treaties[i].kingdom2, kingdom->getName()) == 0)) {
-			validCount++;
-			cout << validCount << ". " << (treaties[i].type == PEACE ? "Peace" : treaties[i].type == ALLIANCE ? "Alliance" : treaties[i].type == TRADE ? "Trade" : "Non-Aggression")
-				<< " with " << (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ? treaties[i].kingdom2 : treaties[i].kingdom1) << endl;
-		}
+int BattleQueue::getPendingCount() const { return (int)attackers.size(); }
+
+// Branch-free combat math over contiguous records so the compiler can vectorize it
+void BattleQueue::resolveCombat(int count, const int* attack, const int* defense, const int* attackRolls,
+	const int* defenseRolls, int* attackerLosses, int* defenderLosses, unsigned char* won) {
+	for (int i = 0; i < count; i++) {
+		int a = attack[i] * attackRolls[i] / 100;
+		int d = defense[i] * defenseRolls[i] / 100;
+		int w = a > d;
+		won[i] = (unsigned char)w;
+		attackerLosses[i] = (d / 10) << (1 - w); // Failed attacks lose twice as many
+		defenderLosses[i] = (a / 8) >> (1 - w); // and inflict half as many
 	}
-	if (validCount == 0) {
-		cout << "No treaties to break.\n";
-		return false;
+}
+
+// Temporaries come from the scratch arena, which the caller empties between turns
+void BattleQueue::resolve(Kingdom* kingdoms[], int kingdomCount, Arena& scratch) {
+	reports.clear();
+	int count = (int)attackers.size();
+	if (count == 0) return;
+
+	// Deterministic order independent of submission: by defender, then attacker
+	int* order = scratch.allocateArray<int>(count);
+	for (int i = 0; i < count; i++) order[i] = i;
+	sort(order, order + count, [this](int a, int b) {
+		if (defenders[a] != defenders[b]) return defenders[a] < defenders[b];
+		if (attackers[a] != attackers[b]) return attackers[a] < attackers[b];
+		return a < b;
+	});
+	int* sortedAttackers = scratch.allocateArray<int>(count);
+	int* sortedDefenders = scratch.allocateArray<int>(count);
+	Military** sortedForces = scratch.allocateArray<Military*>(count);
+	int* sortedBonuses = scratch.allocateArray<int>(count);
+	for (int i = 0; i < count; i++) {
+		sortedAttackers[i] = attackers[order[i]];
+		sortedDefenders[i] = defenders[order[i]];
+		sortedForces[i] = forces[order[i]];
+		sortedBonuses[i] = defenseBonus[order[i]];
 	}
-	cout << "Enter number (0 to cancel): ";
-	int choice;
-	cin >> choice;
-	if (choice <= 0 || choice > validCount) return false;
-	int counter = 0;
-	for (int i = 0; i < treatyCount; i++) {
-		if (treaties[i].active && (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ||
-			strcmp(treaties[i].kingdom2, kingdom->getName()) == 0)) {
-			counter++;
-			if (counter == choice) {
-				treaties[i].active = false;
-				cout << "Treaty broken!\n";
-				return true;
+	attackers.assign(sortedAttackers, sortedAttackers + count);
+	defenders.assign(sortedDefenders, sortedDefenders + count);
+	forces.assign(sortedForces, sortedForces + count);
+	defenseBonus.assign(sortedBonuses, sortedBonuses + count);
+
+	// Powers are snapshotted before any casualties so all battles of a turn are simultaneous.
+	// A kingdom fighting on several fronts splits its army between them: attackers evenly,
+	// defenders in proportion to the strength of each incoming attack. Marching armies
+	// bring their own forces.
+	int* fronts = scratch.allocateArray<int>(kingdomCount);
+	long long* incomingAttack = scratch.allocateArray<long long>(kingdomCount);
+	for (int i = 0; i < count; i++) {
+		if (!forces[i]) fronts[attackers[i]]++;
+	}
+	Military* armies = scratch.allocateArray<Military>(kingdomCount);
+	int* kingdomAttack = scratch.allocateArray<int>(kingdomCount);
+	int* kingdomDefense = scratch.allocateArray<int>(kingdomCount);
+	for (int k = 0; k < kingdomCount; k++) armies[k] = kingdoms[k]->getMilitary();
+	Military::computePowers(armies, kingdomCount, kingdomAttack, kingdomDefense);
+	attackPower.resize(count);
+	defensePower.resize(count);
+	attackRoll.resize(count);
+	defenseRoll.resize(count);
+	for (int i = 0; i < count; i++) {
+		attackPower[i] = forces[i] ? forces[i]->calculateAttackPower()
+			: kingdomAttack[attackers[i]] / fronts[attackers[i]];
+		incomingAttack[defenders[i]] += attackPower[i];
+	}
+	for (int i = 0; i < count; i++) {
+		long long defense = kingdomDefense[defenders[i]];
+		long long incoming = incomingAttack[defenders[i]];
+		defensePower[i] = incoming > 0 ? (int)(defense * attackPower[i] / incoming) : (int)defense;
+		defensePower[i] += defensePower[i] * defenseBonus[i] / 100;
+		attackRoll[i] = 80 + rand() % 41;
+		defenseRoll[i] = 80 + rand() % 41;
+	}
+
+	attackerCasualties.resize(count);
+	defenderCasualties.resize(count);
+	attackerWon.resize(count);
+	resolveCombat(count, attackPower.data(), defensePower.data(), attackRoll.data(), defenseRoll.data(),
+		attackerCasualties.data(), defenderCasualties.data(), attackerWon.data());
+
+	// Losses from every front are summed and applied once per kingdom
+	int* losses = scratch.allocateArray<int>(kingdomCount);
+	reports.resize(count);
+	for (int i = 0; i < count; i++) {
+		if (forces[i]) forces[i]->takeCasualties(attackerCasualties[i]);
+		else losses[attackers[i]] += attackerCasualties[i];
+		losses[defenders[i]] += defenderCasualties[i];
+		BattleReport& report = reports[i];
+		report.attacker = attackers[i];
+		report.defender = defenders[i];
+		report.attackPower = attackPower[i] * attackRoll[i] / 100;
+		report.defensePower = defensePower[i] * defenseRoll[i] / 100;
+		report.attackerCasualties = attackerCasualties[i];
+		report.defenderCasualties = defenderCasualties[i];
+		report.goldPlunder = 0;
+		report.foodPlunder = 0;
+		report.attackerWon = attackerWon[i] != 0;
+	}
+
+	// Victorious attackers on the same defender share one fifth of its stores by attack strength
+	for (int begin = 0; begin < count;) {
+		int end = begin;
+		long long winningAttack = 0;
+		while (end < count && defenders[end] == defenders[begin]) {
+			if (attackerWon[end]) winningAttack += max(1, reports[end].attackPower);
+			end++;
+		}
+		if (winningAttack > 0) {
+			Kingdom* defender = kingdoms[defenders[begin]];
+			int goldPool = defender->getGold() / 5;
+			int foodPool = defender->getFood() / 5;
+			int goldLeft = goldPool, foodLeft = foodPool;
+			int firstWinner = -1;
+			for (int i = begin; i < end; i++) {
+				if (!attackerWon[i]) continue;
+				if (firstWinner < 0) firstWinner = i;
+				long long share = max(1, reports[i].attackPower);
+				reports[i].goldPlunder = (int)(goldPool * share / winningAttack);
+				reports[i].foodPlunder = (int)(foodPool * share / winningAttack);
+				goldLeft -= reports[i].goldPlunder;
+				foodLeft -= reports[i].foodPlunder;
+			}
+			reports[firstWinner].goldPlunder += goldLeft;
+			reports[firstWinner].foodPlunder += foodLeft;
+			defender->spendGold(goldPool);
+			defender->spendFood(foodPool);
+			for (int i = begin; i < end; i++) {
+				kingdoms[attackers[i]]->addGold(reports[i].goldPlunder);
+				kingdoms[attackers[i]]->addFood(reports[i].foodPlunder);
 			}
 		}
+		begin = end;
 	}
-	return false;
+
+	// The snapshot taken above is still current, so losses are applied to it in one batch
+	Military::applyCasualties(armies, losses, kingdomCount);
+	for (int k = 0; k < kingdomCount; k++) {
+		if (losses[k] > 0) kingdoms[k]->getMilitary() = armies[k];
+	}
+	attackers.clear();
+	defenders.clear();
+	forces.clear();
+	defenseBonus.clear();
 }
 
-bool DiplomacyManager::breakTreaty(Kingdom* k1, Kingdom* k2) {
-	for (int i = 0; i < treatyCount; i++) {
-		if (treaties[i].active && ((strcmp(treaties[i].kingdom1, k1->getName()) == 0 && strcmp(treaties[i].kingdom2, k2->getName()) == 0) ||
-			(strcmp(treaties[i].kingdom1, k2->getName()) == 0 && strcmp(treaties[i].kingdom2, k1->getName()) == 0))) {
-			treaties[i].active = false;
-			updateRelations(k1, k2, -2);
-			return true;
+const vector<BattleReport>& BattleQueue::getReports() const { return reports; }
+
+void BattleQueue::displayReports(Kingdom* kingdoms[]) const {
+	if (reports.empty()) return;
+	cout << "\nBattle reports:\n";
+	for (size_t i = 0; i < reports.size(); i++) {
+		const BattleReport& r = reports[i];
+		cout << kingdoms[r.attacker]->getName() << " (" << r.attackPower << ") attacks "
+			<< kingdoms[r.defender]->getName() << " (" << r.defensePower << "): ";
+		if (r.attackerWon) {
+			cout << kingdoms[r.attacker]->getName() << " wins and plunders " << r.goldPlunder << " gold, "
+				<< r.foodPlunder << " food.";
+		}
+		else {
+			cout << kingdoms[r.defender]->getName() << " defends successfully!";
 		}
+		cout << " Losses: " << r.attackerCasualties << " / " << r.defenderCasualties << endl;
 	}
-	return false;
 }
 
-void DiplomacyManager::viewTreaties(Kingdom* kingdom) const {
-	bool found = false;
-	cout << "Treaties for " << kingdom->getName() << ":\n";
-	for (int i = 0; i < treatyCount; i++) {
-		if (treaties[i].active && (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ||
-			strcmp(treaties[i].kingdom2, kingdom->getName()) == 0)) {
-			found = true;
-			cout << (treaties[i].type == PEACE ? "Peace" : treaties[i].type == ALLIANCE ? "Alliance" : treaties[i].type == TRADE ? "Trade" : "Non-Aggression")
-				<< " with " << (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ? treaties[i].kingdom2 : treaties[i].kingdom1)
-				<< " (" << treaties[i].duration << " turns)\n";
+void BattleQueue::clear() {
+	attackers.clear();
+	defenders.clear();
+	forces.clear();
+	defenseBonus.clear();
+	reports.clear();
+}
+
+// FlowFieldCache class implementation
+static const int UNREACHABLE = 1 << 30;
+static const int NEIGHBOUR_DX[4] = { 1, -1, 0, 0 };
+static const int NEIGHBOUR_DY[4] = { 0, 0, 1, -1 };
+
+FlowFieldCache::FlowFieldCache() : useCounter(0), builds(0), hits(0) {}
+
+// Dijkstra outward from the tiles in open. distance[t] is the cost of walking from t to the
+// target, paying the entry cost of every tile on the way (entering the target costs 1).
+void FlowFieldCache::propagate(Field& field, const Map& map,
+	priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > >& open) {
+	int height = map.getHeight();
+	while (!open.empty()) {
+		pair<int, int> top = open.top();
+		open.pop();
+		int tile = top.second;
+		if (top.first != field.distance[tile]) continue;
+		int x = tile / height, y = tile % height;
+		bool isTarget = x == field.targetX && y == field.targetY;
+		int cost = isTarget ? 1 : map.movementCost(x, y);
+		if (cost < 0) continue; // Impassable tiles get a distance but nothing routes through them
+		for (int d = 0; d < 4; d++) {
+			int nx = x + NEIGHBOUR_DX[d], ny = y + NEIGHBOUR_DY[d];
+			if (nx < 0 || nx >= map.getWidth() || ny < 0 || ny >= height) continue;
+			int next = nx * height + ny;
+			int candidate = top.first + cost;
+			if (candidate < field.distance[next]) {
+				field.distance[next] = candidate;
+				open.push(make_pair(candidate, next));
+			}
 		}
 	}
-	if (!found) cout << "No active treaties.\n";
 }
 
-void DiplomacyManager::checkRelations(Kingdom* kingdom) const {
-	cout << "Relations for " << kingdom->getName() << ":\n";
-	// Simplified: relations are not tied to kingdom index
+void FlowFieldCache::build(Field& field, const Map& map) {
+	field.distance.assign(map.getWidth() * map.getHeight(), UNREACHABLE);
+	int target = field.targetX * map.getHeight() + field.targetY;
+	field.distance[target] = 0;
+	priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > > open;
+	open.push(make_pair(0, target));
+	propagate(field, map, open);
+	field.stale = false;
+	builds++;
 }
 
-void DiplomacyManager::declareWar(Kingdom* declarer, Kingdom* target) {
-	if (hasTreaty(declarer, target)) {
-		cout << "Breaking treaty to declare war!\n";
-		breakTreaty(declarer, target);
+const vector<int>& FlowFieldCache::getField(const Map& map, int targetX, int targetY) {
+	useCounter++;
+	for (size_t i = 0; i < fields.size(); i++) {
+		if (fields[i].targetX == targetX && fields[i].targetY == targetY) {
+			fields[i].lastUsed = useCounter;
+			if (fields[i].stale) build(fields[i], map);
+			else hits++;
+			return fields[i].distance;
+		}
+	}
+	size_t slot = fields.size();
+	if (fields.size() < (size_t)FLOW_FIELD_CACHE_SIZE) {
+		fields.push_back(Field());
 	}
-	updateRelations(declarer, target, -3);
-	cout << declarer->getName() << " declares war on " << target->getName() << "!\n";
+	else {
+		slot = 0;
+		for (size_t i = 1; i < fields.size(); i++) {
+			if (fields[i].lastUsed < fields[slot].lastUsed) slot = i;
+		}
+	}
+	Field& field = fields[slot];
+	field.targetX = targetX;
+	field.targetY = targetY;
+	field.lastUsed = useCounter;
+	build(field, map);
+	return field.distance;
 }
 
-RelationshipStatus DiplomacyManager::getRelationship(Kingdom* k1, Kingdom* k2) const {
-	return NEUTRAL; // Simplified
+// Cheaper tiles are relaxed in place; a dearer tile only invalidates fields that may route through it
+void FlowFieldCache::applyChanges(const Map& map, const vector<TileChange>& changes) {
+	if (changes.empty()) return;
+	int height = map.getHeight();
+	for (size_t f = 0; f < fields.size(); f++) {
+		Field& field = fields[f];
+		if (field.stale) continue;
+		priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > > open;
+		for (size_t c = 0; c < changes.size() && !field.stale; c++) {
+			const TileChange& change = changes[c];
+			if (change.x == field.targetX && change.y == field.targetY) continue;
+			int tile = change.x * height + change.y;
+			int newCost = map.movementCost(change.x, change.y);
+			if (change.oldCost >= 0 && (newCost < 0 || newCost > change.oldCost)) {
+				// Some neighbour's shortest path may have gone through this tile
+				for (int d = 0; d < 4 && !field.stale; d++) {
+					int nx = change.x + NEIGHBOUR_DX[d], ny = change.y + NEIGHBOUR_DY[d];
+					if (nx < 0 || nx >= map.getWidth() || ny < 0 || ny >= height) continue;
+					if (field.distance[tile] < UNREACHABLE && field.distance[nx * height + ny] == field.distance[tile] + change.oldCost) {
+						field.stale = true;
+					}
+				}
+			}
+			else if (newCost >= 0 && field.distance[tile] < UNREACHABLE) {
+				open.push(make_pair(field.distance[tile], tile));
+			}
+		}
+		if (!field.stale) propagate(field, map, open);
+	}
 }
 
-void DiplomacyManager::updateRelations(Kingdom* k1, Kingdom* k2, int change) {
-	// Simplified: no actual relation update
+void FlowFieldCache::clear() { fields.clear(); }
+int FlowFieldCache::getBuildCount() const { return builds; }
+int FlowFieldCache::getHitCount() const { return hits; }
+
+// ArmyManager class implementation
+ArmyManager::ArmyManager() {}
+
+bool ArmyManager::dispatchArmy(Kingdom* kingdoms[], int owner, int target, int percent) {
+	if (owner == target) return false;
+	Army army;
+	army.owner = owner;
+	army.target = target;
+	army.x = kingdoms[owner]->getX();
+	army.y = kingdoms[owner]->getY();
+	army.forces = kingdoms[owner]->getMilitary().detach(percent);
+	army.arrived = false;
+	if (army.forces.getTotalUnits() == 0) {
+		kingdoms[owner]->getMilitary().merge(army.forces);
+		return false;
+	}
+	armies.push_back(army);
+	return true;
 }
 
-void DiplomacyManager::saveToFile(ofstream& outFile) {
-	outFile.write((char*)&treatyCount, sizeof(treatyCount));
-	for (int i = 0; i < treatyCount; i++) {
-		outFile.write((char*)&treaties[i], sizeof(Treaty));
+// Moves every army along the flow field toward its target. Armies that reach the target
+// queue a battle with their own forces.
+void ArmyManager::advanceArmies(Kingdom* kingdoms[], Map& map, BattleQueue& battles) {
+	map.takeCostChanges(changes);
+	flowFields.applyChanges(map, changes);
+	int height = map.getHeight();
+	for (size_t i = 0; i < armies.size(); i++) {
+		Army& army = armies[i];
+		if (army.arrived) continue;
+		int targetX = kingdoms[army.target]->getX();
+		int targetY = kingdoms[army.target]->getY();
+		const vector<int>& distance = flowFields.getField(map, targetX, targetY);
+		int points = ARMY_MOVE_POINTS;
+		while (points > 0) {
+			int bestX = -1, bestY = -1, bestDistance = distance[army.x * height + army.y];
+			for (int d = 0; d < 4; d++) {
+				int nx = army.x + NEIGHBOUR_DX[d], ny = army.y + NEIGHBOUR_DY[d];
+				if (nx < 0 || nx >= map.getWidth() || ny < 0 || ny >= height) continue;
+				bool isTarget = nx == targetX && ny == targetY;
+				if (!isTarget && map.movementCost(nx, ny) < 0) continue;
+				if (distance[nx * height + ny] < bestDistance) {
+					bestDistance = distance[nx * height + ny];
+					bestX = nx;
+					bestY = ny;
+				}
+			}
+			if (bestX < 0) {
+				army.arrived = true; // No way through, the army turns back
+				break;
+			}
+			if (bestX == targetX && bestY == targetY) {
+				army.arrived = true;
+				battles.queueAttack(army.owner, army.target, map.getDefenseBonus(targetX, targetY), &army.forces);
+				break;
+			}
+			int cost = map.movementCost(bestX, bestY);
+			if (cost > points) break;
+			points -= cost;
+			army.x = bestX;
+			army.y = bestY;
+		}
 	}
 }
 
-void DiplomacyManager::loadFromFile(ifstream& inFile) {
-	inFile.read((char*)&treatyCount, sizeof(treatyCount));
-	for (int i = 0; i < treatyCount; i++) {
-		inFile.read((char*)&treaties[i], sizeof(Treaty));
+void ArmyManager::returnSurvivors(Kingdom* kingdoms[]) {
+	size_t kept = 0;
+	for (size_t i = 0; i < armies.size(); i++) {
+		if (armies[i].arrived) kingdoms[armies[i].owner]->getMilitary().merge(armies[i].forces);
+		else armies[kept++] = armies[i];
 	}
+	armies.resize(kept);
 }
 
-// MarketPlace class implementation
-MarketPlace::MarketPlace() : offerCount(0) {
-	prices[GOLD] = 100;
-	prices[FOOD] = 10;
-	prices[WOOD] = 20;
-	prices[STONE] = 30;
+int ArmyManager::getArmyCount() const { return (int)armies.size(); }
+
+const vector<Army>& ArmyManager::getArmies() const { return armies; }
+
+int ArmyManager::getArmyCount(int owner) const {
+	int count = 0;
+	for (size_t i = 0; i < armies.size(); i++) {
+		if (armies[i].owner == owner) count++;
+	}
+	return count;
 }
 
-void MarketPlace::displayPrices() const {
-	cout << "Market Prices:\n";
-	cout << "Gold: " << prices[GOLD] << endl;
-	cout << "Food: " << prices[FOOD] << endl;
-	cout << "Wood: " << prices[WOOD] << endl;
-	cout << "Stone: " << prices[STONE] << endl;
+void ArmyManager::displayArmies(Kingdom* kingdoms[], const Map& map, int owner) {
+	bool found = false;
+	cout << "Armies on the march:\n";
+	for (size_t i = 0; i < armies.size(); i++) {
+		const Army& army = armies[i];
+		if (army.owner != owner) continue;
+		found = true;
+		const Kingdom* target = kingdoms[army.target];
+		const vector<int>& distance = flowFields.getField(map, target->getX(), target->getY());
+		int remaining = distance[army.x * map.getHeight() + army.y];
+		cout << "At (" << army.x << "," << army.y << ") marching on " << target->getName() << " with "
+			<< army.forces.getTotalUnits() << " units (attack " << army.forces.calculateAttackPower() << "), ";
+		if (remaining >= UNREACHABLE) cout << "no route\n";
+		else cout << "about " << (remaining + ARMY_MOVE_POINTS - 1) / ARMY_MOVE_POINTS << " turns away\n";
+	}
+	if (!found) cout << "None.\n";
 }
 
-void MarketPlace::updatePrices() {
-	for (int i = 0; i < 4; i++) {
-		prices[i] = prices[i] * (90 + rand() % 21) / 100;
+void ArmyManager::saveToFile(ofstream& outFile) {
+	int count = (int)armies.size();
+	outFile.write((char*)&count, sizeof(count));
+	for (int i = 0; i < count; i++) {
+		outFile.write((char*)&armies[i].owner, sizeof(armies[i].owner));
+		outFile.write((char*)&armies[i].target, sizeof(armies[i].target));
+		outFile.write((char*)&armies[i].x, sizeof(armies[i].x));
+		outFile.write((char*)&armies[i].y, sizeof(armies[i].y));
+		armies[i].forces.saveToFile(outFile);
 	}
 }
 
-void MarketPlace::buyResources(Kingdom* kingdom) {
-	cout << "Buy Resources:\n";
-	cout << "1. Food (Price: " << prices[FOOD] << " Gold)\n";
-	cout << "2. Wood (Price: " << prices[WOOD] << " Gold)\n";
-	cout << "3. Stone (Price: " << prices[STONE] << " Gold)\n";
-	int choice;
-	cin >> choice;
-	cout << "Enter quantity: ";
-	int quantity = 0;
-	cin >> choice;
-	if (quantity <= 0) return;
-	ResourceType type;
-	int price;
-	switch (choice) {
-	case 1: type = FOOD; price = prices[FOOD]; break;
-	case 2: type = WOOD; price = prices[WOOD]; break;
-	case 3: type = STONE; price = prices[STONE]; break;
-	default: cout << "Invalid choice.\n"; return;
+void ArmyManager::loadFromFile(ifstream& inFile) {
+	int count = 0;
+	inFile.read((char*)&count, sizeof(count));
+	armies.resize(count);
+	for (int i = 0; i < count; i++) {
+		inFile.read((char*)&armies[i].owner, sizeof(armies[i].owner));
+		inFile.read((char*)&armies[i].target, sizeof(armies[i].target));
+		inFile.read((char*)&armies[i].x, sizeof(armies[i].x));
+		inFile.read((char*)&armies[i].y, sizeof(armies[i].y));
+		armies[i].forces.loadFromFile(inFile);
+		armies[i].arrived = false;
 	}
-	if (kingdom->spendGold(price * quantity)) {
-		switch (type) {
-		case FOOD: kingdom->addFood(quantity); break;
-		case WOOD: kingdom->addWood(quantity); break;
-		case STONE: kingdom->addStone(quantity); break;
-		default: break;
+	flowFields.clear();
+}
+
+// CaravanManager class implementation
+CaravanManager::CaravanManager() {}
+
+// Follows the flow field from one seat to the other, or returns -1 when there is no way through.
+// Laid routes are kept for later caravans between the same seats; failures are tried again.
+int CaravanManager::layRoute(const Map& map, int origin, int destination) {
+	long long key = (long long)origin * MAP_SIZE * MAP_SIZE + destination;
+	auto found = routeIndex.find(key);
+	if (found != routeIndex.end()) return found->second;
+	int height = map.getHeight();
+	int x = origin / MAP_SIZE, y = origin % MAP_SIZE;
+	int targetX = destination / MAP_SIZE, targetY = destination % MAP_SIZE;
+	const vector<int>& distance = flowFields.getField(map, targetX, targetY);
+	Route route;
+	route.start = (int)routeTiles.size();
+	routeTiles.push_back(origin);
+	while (x != targetX || y != targetY) {
+		int bestX = -1, bestY = -1, bestDistance = distance[x * height + y];
+		for (int d = 0; d < 4; d++) {
+			int nx = x + NEIGHBOUR_DX[d], ny = y + NEIGHBOUR_DY[d];
+			if (nx < 0 || nx >= map.getWidth() || ny < 0 || ny >= height) continue;
+			bool isTarget = nx == targetX && ny == targetY;
+			if (!isTarget && map.movementCost(nx, ny) < 0) continue;
+			if (distance[nx * height + ny] < bestDistance) {
+				bestDistance = distance[nx * height + ny];
+				bestX = nx;
+				bestY = ny;
+			}
 		}
-		cout << "Purchased " << quantity << " units.\n";
-	}
-	else {
-		cout << "Not enough gold!\n";
+		if (bestX < 0) {
+			routeTiles.resize(route.start);
+			return -1;
+		}
+		x = bestX;
+		y = bestY;
+		routeTiles.push_back(x * MAP_SIZE + y);
 	}
+	route.length = (int)routeTiles.size() - route.start - 1;
+	routes.push_back(route);
+	routeIndex[key] = (int)routes.size() - 1;
+	return (int)routes.size() - 1;
 }
 
-void MarketPlace::sellResources(Kingdom* kingdom) {
-	cout << "Sell Resources:\n";
-	cout << "1. Food (Price: " << prices[FOOD] / 2 << " Gold)\n";
-	cout << "2. Wood (Price: " << prices[WOOD] / 2 << " Gold)\n";
-	cout << "3. Stone (Price: " << prices[STONE] / 2 << " Gold)\n";
-	int choice;
-	cin >> choice;
-	cout << "Enter quantity: ";
-	int quantity;
-	cin >> quantity;
-	if (quantity <= 0) return;
-	ResourceType type;
-	int price;
-	switch (choice) {
-	case 1: type = FOOD; price = prices[FOOD] / 2; break;
-	case 2: type = WOOD; price = prices[WOOD] / 2; break;
-	case 3: type = STONE; price = prices[STONE] / 2; break;
-	default: cout << "Invalid choice.\n"; return;
-	}
-	bool success;
-	switch (type) {
-	case FOOD: success = kingdom->spendFood(quantity); break;
-	case WOOD: success = kingdom->spendWood(quantity); break;
-	case STONE: success = kingdom->spendStone(quantity); break;
-	default: success = false; break;
+void CaravanManager::moveCaravan(int from, int to) {
+	senders[to] = senders[from];
+	receivers[to] = receivers[from];
+	origins[to] = origins[from];
+	destinations[to] = destinations[from];
+	routeIds[to] = routeIds[from];
+	progress[to] = progress[from];
+	cargo[to] = cargo[from];
+	payouts[to] = payouts[from];
+	smuggled[to] = smuggled[from];
+}
+
+void CaravanManager::resizeColumns(int count) {
+	senders.resize(count);
+	receivers.resize(count);
+	origins.resize(count);
+	destinations.resize(count);
+	routeIds.resize(count);
+	progress.resize(count);
+	cargo.resize(count);
+	payouts.resize(count);
+	smuggled.resize(count);
+}
+
+// The goods must already have left the sender
+void CaravanManager::dispatch(const Kingdom* sender, const Kingdom* receiver, const Resource& goods, bool isSmuggled, int payout) {
+	senders.push_back(sender->getIndex());
+	receivers.push_back(receiver->getIndex());
+	origins.push_back(sender->getX() * MAP_SIZE + sender->getY());
+	destinations.push_back(receiver->getX() * MAP_SIZE + receiver->getY());
+	routeIds.push_back(-1);
+	progress.push_back(0);
+	cargo.push_back(goods);
+	payouts.push_back(payout);
+	smuggled.push_back(isSmuggled ? 1 : 0);
+}
+
+// Lays the routes of caravans that set out this turn, then moves every caravan and decides its
+// fate in one pass over the columns. Rolls depend only on the caravan's place in the list and one
+// draw from rand(), so the pass splits across threads without changing the outcome. Goods change
+// hands afterwards, in dispatch order.
+void CaravanManager::advance(Kingdom* kingdoms[], int kingdomCount, const Map& map, const DiplomacyManager& diplomacy) {
+	int count = (int)senders.size();
+	if (count == 0) return;
+	bool fieldsCleared = false;
+	for (int i = 0; i < count; i++) {
+		if (routeIds[i] >= 0) continue;
+		if (!fieldsCleared) {
+			flowFields.clear(); // Movement costs have changed since the last routes were laid
+			fieldsCleared = true;
+		}
+		routeIds[i] = layRoute(map, origins[i], destinations[i]);
 	}
-	if (success) {
-		kingdom->addGold(price * quantity);
-		cout << "Sold " << quantity << " units.\n";
+
+	unsigned char hostile[MAX_KINGDOMS][MAX_KINGDOMS];
+	for (int a = 0; a < kingdomCount; a++) {
+		for (int b = 0; b < kingdomCount; b++) {
+			hostile[a][b] = a != b && diplomacy.getRelationship(kingdoms[a], kingdoms[b]) >= HOSTILE ? 1 : 0;
+		}
 	}
-	else {
-		cout << "Not enough resources!\n";
+	unsigned int seed = (unsigned int)rand();
+	tileOwners.resize(count);
+	outcomes.resize(count);
+	// 0 = on the road, 1 = arrived, 2 = raided, 3 = no route, sent home
+	ThreadPool::shared().parallelFor(count, CARAVAN_TASK_SIZE, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			int id = routeIds[i];
+			if (id < 0) {
+				outcomes[i] = 3;
+				continue;
+			}
+			const Route& route = routes[id];
+			int step = min(progress[i] + CARAVAN_TILES_PER_TURN, route.length);
+			progress[i] = step;
+			int tile = routeTiles[route.start + step];
+			int owner = map.getTileOwner(tile / MAP_SIZE, tile % MAP_SIZE);
+			tileOwners[i] = owner;
+			unsigned int roll = seed ^ (0x9E3779B9u * (unsigned int)(i + 1));
+			roll ^= roll >> 16;
+			roll *= 0x7FEB352Du;
+			roll ^= roll >> 15;
+			int chance = smuggled[i] ? CARAVAN_RAID_PERCENT / 2 : CARAVAN_RAID_PERCENT;
+			bool exposed = owner >= 0 && owner < kingdomCount && (hostile[owner][senders[i]] | hostile[owner][receivers[i]]);
+			outcomes[i] = exposed && (int)(roll % 100) < chance ? 2 : step == route.length ? 1 : 0;
+		}
+	});
+
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		switch (outcomes[i]) {
+		case 0:
+			if (kept != i) moveCaravan(i, kept);
+			kept++;
+			break;
+		case 1:
+			if (smuggled[i]) {
+				kingdoms[senders[i]]->addGold(payouts[i]);
+				EventLog::record(LOG_SMUGGLING_PAID, senders[i], receivers[i], payouts[i]);
+			}
+			else {
+				kingdoms[receivers[i]]->addResources(cargo[i]);
+				EventLog::record(LOG_CARAVAN_ARRIVED, senders[i], receivers[i], 0);
+			}
+			break;
+		case 2:
+			kingdoms[tileOwners[i]]->addResources(cargo[i]);
+			EventLog::record(LOG_CARAVAN_RAIDED, tileOwners[i], senders[i], 0);
+			break;
+		case 3: kingdoms[senders[i]]->addResources(cargo[i]); break;
+		}
 	}
+	resizeColumns(kept);
 }
 
-bool MarketPlace::proposeTrade(Kingdom* offerer, Kingdom* receiver) {
-	if (offerCount >= MAX_TRADE_OFFERS) {
-		cout << "Maximum trade offers reached!\n";
-		return false;
+int CaravanManager::getCaravanCount() const { return (int)senders.size(); }
+
+int CaravanManager::getCaravanCount(int kingdom) const {
+	int count = 0;
+	for (size_t i = 0; i < senders.size(); i++) {
+		if (senders[i] == kingdom || receivers[i] == kingdom) count++;
 	}
-	cout << "Enter resources to offer (Gold Food Wood Stone): ";
-	int g, f, w, s;
-	cin >> g >> f >> w >> s;
-	cout << "Enter resources to request (Gold Food Wood Stone): ";
-	int rg, rf, rw, rs;
-	cin >> rg >> rf >> rw >> rs;
-	TradeOffer& offer = tradeOffers[offerCount++];
-	strcpy_s(offer.offerer, offerer->getName());
-	strcpy_s(offer.receiver, receiver->getName());
-	offer.offering = Resource(g, f, w, s);
-	offer.requesting = Resource(rg, rf, rw, rs);
-	offer.isSmuggling = false;
-	offer.accepted = false;
-	cout << "Trade proposed!\n";
-	return true;
+	return count;
 }
 
-void MarketPlace::viewTradeOffers(Kingdom* kingdom) const {
+int CaravanManager::getRouteCount() const { return (int)routes.size(); }
+
+void CaravanManager::displayCaravans(Kingdom* kingdoms[], int kingdom) const {
 	bool found = false;
-	cout << "Trade Offers for " << kingdom->getName() << ":\n";
-	for (int i = 0; i < offerCount; i++) {
-		if (strcmp(tradeOffers[i].receiver, kingdom->getName()) == 0 && !tradeOffers[i].accepted) {
-			found = true;
-			cout << i + 1 << ". From " << tradeOffers[i].offerer << ": Offer("
-				<< tradeOffers[i].offering.gold << "G, " << tradeOffers[i].offering.food << "F, "
-				<< tradeOffers[i].offering.wood << "W, " << tradeOffers[i].offering.stone << "S) Request("
-				<< tradeOffers[i].requesting.gold << "G, " << tradeOffers[i].requesting.food << "F, "
-				<< tradeOffers[i].requesting.wood << "W, " << tradeOffers[i].requesting.stone << "S)\n";
-		}
+	cout << "Caravans on the road:\n";
+	for (size_t i = 0; i < senders.size(); i++) {
+		if (senders[i] != kingdom && receivers[i] != kingdom) continue;
+		found = true;
+		if (senders[i] == kingdom) cout << (smuggled[i] ? "Smuggling to " : "To ") << kingdoms[receivers[i]]->getName();
+		else cout << "From " << kingdoms[senders[i]]->getName();
+		cout << ": (" << cargo[i].gold << "G, " << cargo[i].food << "F, " << cargo[i].wood << "W, " << cargo[i].stone << "S)";
+		if (smuggled[i]) cout << " for " << payouts[i] << " gold";
+		if (routeIds[i] < 0) cout << ", setting out\n";
+		else cout << ", " << progress[i] << " of " << routes[routeIds[i]].length << " tiles\n";
 	}
-	if (!found) cout << "No trade offers.\n";
+	if (!found) cout << "None.\n";
 }
 
-bool MarketPlace::respondToOffer(Kingdom* kingdom, int offerIndex, bool accept) {
-	if (offerIndex < 0 || offerIndex >= offerCount || tradeOffers[offerIndex].accepted) return false;
-	if (strcmp(tradeOffers[offerIndex].receiver, kingdom->getName()) != 0) return false;
-	if (!accept) {
-		tradeOffers[offerIndex].accepted = true; // Mark as processed
-		return true;
+// Routes go with the caravans so a loaded game keeps them on the roads they were on
+void CaravanManager::saveToFile(ofstream& outFile) {
+	int routeCount = (int)routes.size();
+	int tileCount = (int)routeTiles.size();
+	outFile.write((char*)&routeCount, sizeof(routeCount));
+	outFile.write((char*)routes.data(), routeCount * sizeof(Route));
+	outFile.write((char*)&tileCount, sizeof(tileCount));
+	outFile.write((char*)routeTiles.data(), tileCount * sizeof(int));
+	int count = (int)senders.size();
+	outFile.write((char*)&count, sizeof(count));
+	outFile.write((char*)senders.data(), count * sizeof(int));
+	outFile.write((char*)receivers.data(), count * sizeof(int));
+	outFile.write((char*)origins.data(), count * sizeof(int));
+	outFile.write((char*)destinations.data(), count * sizeof(int));
+	outFile.write((char*)routeIds.data(), count * sizeof(int));
+	outFile.write((char*)progress.data(), count * sizeof(int));
+	outFile.write((char*)cargo.data(), count * sizeof(Resource));
+	outFile.write((char*)payouts.data(), count * sizeof(int));
+	outFile.write((char*)smuggled.data(), count * sizeof(unsigned char));
+}
+
+void CaravanManager::loadFromFile(ifstream& inFile) {
+	int routeCount = 0, tileCount = 0, count = 0;
+	inFile.read((char*)&routeCount, sizeof(routeCount));
+	routes.resize(max(routeCount, 0));
+	inFile.read((char*)routes.data(), routes.size() * sizeof(Route));
+	inFile.read((char*)&tileCount, sizeof(tileCount));
+	routeTiles.resize(max(tileCount, 0));
+	inFile.read((char*)routeTiles.data(), routeTiles.size() * sizeof(int));
+	inFile.read((char*)&count, sizeof(count));
+	resizeColumns(max(count, 0));
+	count = (int)senders.size();
+	inFile.read((char*)senders.data(), count * sizeof(int));
+	inFile.read((char*)receivers.data(), count * sizeof(int));
+	inFile.read((char*)origins.data(), count * sizeof(int));
+	inFile.read((char*)destinations.data(), count * sizeof(int));
+	inFile.read((char*)routeIds.data(), count * sizeof(int));
+	inFile.read((char*)progress.data(), count * sizeof(int));
+	inFile.read((char*)cargo.data(), count * sizeof(Resource));
+	inFile.read((char*)payouts.data(), count * sizeof(int));
+	inFile.read((char*)smuggled.data(), count * sizeof(unsigned char));
+	if (!inFile) {
+		routes.clear();
+		routeTiles.clear();
+		resizeColumns(0);
 	}
-	// Simplified: assume trade is valid
-	tradeOffers[offerIndex].accepted = true;
-	cout << "Trade accepted!\n";
-	return true;
+	routeIndex.clear();
+	for (size_t r = 0; r < routes.size(); r++) {
+		const Route& route = routes[r];
+		long long key = (long long)routeTiles[route.start] * MAP_SIZE * MAP_SIZE + routeTiles[route.start + route.length];
+		routeIndex[key] = (int)r;
+	}
+	flowFields.clear();
 }
 
-void MarketPlace::initiateSmuggling(Kingdom* kingdom) {
-	cout << "Smuggling not implemented.\n";
+// FogOfWar class implementation
+static int countBits(unsigned long long bits) {
+#ifdef _MSC_VER
+	return (int)__popcnt64(bits);
+#else
+	return __builtin_popcountll(bits);
+#endif
 }
 
-void MarketPlace::saveToFile(ofstream& outFile) {
-	outFile.write((char*)prices, sizeof(prices));
-	outFile.write((char*)&offerCount, sizeof(offerCount));
-	for (int i = 0; i < offerCount; i++) {
-		outFile.write((char*)&tradeOffers[i], sizeof(TradeOffer));
+FogOfWar::FogOfWar() {
+	clear(MAP_SIZE, MAP_SIZE);
+	for (int v = 0; v < MAX_KINGDOMS; v++) {
+		for (int k = 0; k < MAX_KINGDOMS; k++) seatsSeen[v][k] = -1;
 	}
 }
 
-void MarketPlace::loadFromFile(ifstream& inFile) {
-	inFile.read((char*)prices, sizeof(prices));
-	inFile.read((char*)&offerCount, sizeof(offerCount));
-	for (int i = 0; i < offerCount; i++) {
-		inFile.read((char*)&tradeOffers[i], sizeof(TradeOffer));
+void FogOfWar::clear(int mapWidth, int mapHeight) {
+	width = min(mapWidth, MAP_SIZE);
+	height = min(mapHeight, MAP_SIZE);
+	memset(territory, 0, sizeof(territory));
+	memset(visible, 0, sizeof(visible));
+	for (int k = 0; k < MAX_KINGDOMS; k++) {
+		sightKeys[k] = 0;
+		territoryDirty[k] = true;
 	}
 }
 
-// CommunicationSystem class implementation
-CommunicationSystem::CommunicationSystem() : messageCount(0) {}
-
-void CommunicationSystem::sendMessage(const char* sender, const char* receiver, const char* content) {
-	if (messageCount >= MAX_MESSAGES) return;
-	Message& msg = messages[messageCount++];
-	strcpy_s(msg.sender, sender);
-	strcpy_s(msg.receiver, receiver);
-	strncpy_s(msg.content, content, MAX_MESSAGE_LENGTH - 1);
-	msg.content[MAX_MESSAGE_LENGTH - 1] = '\0';
-	msg.read = false;
-}
-void CommunicationSystem::showMessages(const char* kingdomName) {
-	bool found = false;
-	cout << "Messages for " << kingdomName << ":\n";
-	for (int i = 0; i < messageCount; i++) {
-		if (strcmp(messages[i].receiver, kingdomName) == 0) {
-			found = true;
-			cout << (messages[i].read ? "[Read] " : "[Unread] ") << "From " << messages[i].sender << ": " << messages[i].content << endl;
-			messages[i].read = true; // Now allowed without const
-		}
-	}
-	if (!found) cout << "No messages.\n";
+// Bits of one row word that fall in [left, right)
+unsigned long long FogOfWar::rowMask(int word, int left, int right) const {
+	int low = max(left - word * 64, 0);
+	int high = min(right - word * 64, 64);
+	if (low >= high) return 0;
+	unsigned long long upper = high == 64 ? ~0ULL : (1ULL << high) - 1;
+	return upper & ~((1ULL << low) - 1);
 }
 
-void CommunicationSystem::sendNewMessage(Kingdom* sender) {
-	cout << "Enter recipient kingdom name: ";
-	char receiver[MAX_NAME_LENGTH];
-	cin.ignore();
-	cin.getline(receiver, MAX_NAME_LENGTH);
-	cout << "Enter message (max " << MAX_MESSAGE_LENGTH << " chars): ";
-	char content[MAX_MESSAGE_LENGTH];
-	cin.getline(content, MAX_MESSAGE_LENGTH);
-	sendMessage(sender->getName(), receiver, content);
-	cout << "Message sent!\n";
+void FogOfWar::setOwner(int x, int y, int oldOwner, int owner) {
+	int word = y * VISION_ROW_WORDS + (x >> 6);
+	unsigned long long bit = 1ULL << (x & 63);
+	if (oldOwner >= 0) {
+		territory[oldOwner][word] &= ~bit;
+		territoryDirty[oldOwner] = true;
+	}
+	if (owner >= 0) {
+		territory[owner][word] |= bit;
+		territoryDirty[owner] = true;
+	}
 }
 
-void CommunicationSystem::saveToFile(ofstream& outFile) {
-	outFile.write((char*)&messageCount, sizeof(messageCount));
-	for (int i = 0; i < messageCount; i++) {
-		outFile.write((char*)&messages[i], sizeof(Message));
+// A diamond of VISION_RADIUS around the tile, one row span at a time
+void FogOfWar::stamp(unsigned long long* bits, int x, int y) const {
+	for (int dy = -VISION_RADIUS; dy <= VISION_RADIUS; dy++) {
+		int row = y + dy;
+		if (row < 0 || row >= height) continue;
+		int reach = VISION_RADIUS - abs(dy);
+		int left = max(0, x - reach);
+		int right = min(width, x + reach + 1);
+		for (int w = left >> 6; w <= (right - 1) >> 6; w++) bits[row * VISION_ROW_WORDS + w] |= rowMask(w, left, right);
+	}
+}
+
+void FogOfWar::rebuild(int kingdom, const Kingdom* seat, const vector<Army>& armies) {
+	unsigned long long* bits = visible[kingdom];
+	unsigned long long grown[VISION_WORDS];
+	memcpy(bits, territory[kingdom], sizeof(territory[kingdom]));
+	// Each pass grows the set by one tile: every word takes in its row shifted both ways, with the
+	// bits carried over from the neighbouring words, and the rows above and below
+	for (int pass = 0; pass < VISION_RADIUS; pass++) {
+		for (int y = 0; y < height; y++) {
+			const unsigned long long* row = bits + y * VISION_ROW_WORDS;
+			for (int w = 0; w < VISION_ROW_WORDS; w++) {
+				unsigned long long word = row[w];
+				unsigned long long result = word | (word << 1) | (word >> 1);
+				if (w > 0) result |= row[w - 1] >> 63;
+				if (w + 1 < VISION_ROW_WORDS) result |= row[w + 1] << 63;
+				if (y > 0) result |= row[w - VISION_ROW_WORDS];
+				if (y + 1 < height) result |= row[w + VISION_ROW_WORDS];
+				grown[y * VISION_ROW_WORDS + w] = result & rowMask(w, 0, width);
+			}
+		}
+		memcpy(bits, grown, height * VISION_ROW_WORDS * sizeof(unsigned long long));
+	}
+	stamp(bits, seat->getX(), seat->getY());
+	for (size_t i = 0; i < armies.size(); i++) {
+		if (armies[i].owner == kingdom) stamp(bits, armies[i].x, armies[i].y);
+	}
+}
+
+// Cheap when nothing moved: one key per kingdom over its seat and army positions
+void FogOfWar::update(Kingdom* const kingdoms[], int kingdomCount, const vector<Army>& armies) {
+	unsigned long long keys[MAX_KINGDOMS];
+	for (int k = 0; k < kingdomCount; k++) keys[k] = (unsigned long long)(kingdoms[k]->getX() * MAP_SIZE + kingdoms[k]->getY() + 1);
+	for (size_t i = 0; i < armies.size(); i++) {
+		int owner = armies[i].owner;
+		if (owner < 0 || owner >= kingdomCount) continue;
+		keys[owner] = keys[owner] * 0x100000001B3ULL ^ (unsigned long long)(armies[i].x * MAP_SIZE + armies[i].y + 1);
+	}
+	for (int k = 0; k < kingdomCount; k++) {
+		if (!territoryDirty[k] && keys[k] == sightKeys[k]) continue;
+		rebuild(k, kingdoms[k], armies);
+		sightKeys[k] = keys[k];
+		territoryDirty[k] = false;
+	}
+	rememberSeats(kingdoms, kingdomCount);
+}
+
+// A seat in sight is remembered where it stands; a remembered tile seen empty means the seat has moved
+void FogOfWar::rememberSeats(Kingdom* const kingdoms[], int kingdomCount) {
+	for (int v = 0; v < kingdomCount; v++) {
+		for (int k = 0; k < kingdomCount; k++) {
+			if (k == v) continue;
+			int x = kingdoms[k]->getX(), y = kingdoms[k]->getY();
+			int& seen = seatsSeen[v][k];
+			if (canSee(v, x, y)) seen = x * MAP_SIZE + y;
+			else if (seen >= 0 && canSee(v, seen / MAP_SIZE, seen % MAP_SIZE)) seen = -1;
+		}
+	}
+}
+
+bool FogOfWar::canSee(int kingdom, int x, int y) const {
+	if (kingdom < 0 || kingdom >= MAX_KINGDOMS || x < 0 || x >= width || y < 0 || y >= height) return false;
+	return (visible[kingdom][y * VISION_ROW_WORDS + (x >> 6)] >> (x & 63)) & 1;
+}
+
+bool FogOfWar::knowsSeat(int viewer, int kingdom) const {
+	if (viewer < 0 || viewer >= MAX_KINGDOMS || kingdom < 0 || kingdom >= MAX_KINGDOMS) return false;
+	return seatsSeen[viewer][kingdom] >= 0;
+}
+
+bool FogOfWar::seesLand(int viewer, int owner) const {
+	if (viewer < 0 || viewer >= MAX_KINGDOMS || owner < 0 || owner >= MAX_KINGDOMS) return false;
+	for (int w = 0; w < VISION_WORDS; w++) {
+		if (visible[viewer][w] & territory[owner][w]) return true;
+	}
+	return false;
+}
+
+int FogOfWar::countVisible(int viewer, int owner, int left, int top, int right, int bottom) const {
+	left = max(left, 0);
+	top = max(top, 0);
+	right = min(right, width);
+	bottom = min(bottom, height);
+	int count = 0;
+	for (int y = top; y < bottom; y++) {
+		for (int w = left >> 6; left < right && w <= (right - 1) >> 6; w++) {
+			int word = y * VISION_ROW_WORDS + w;
+			unsigned long long bits = visible[viewer][word] & rowMask(w, left, right);
+			if (owner >= 0) bits &= territory[owner][word];
+			count += countBits(bits);
+		}
+	}
+	return count;
+}
+
+int FogOfWar::countVisible(int viewer) const {
+	int count = 0;
+	for (int w = 0; w < VISION_WORDS; w++) count += countBits(visible[viewer][w]);
+	return count;
+}
+
+void FogOfWar::saveToFile(ofstream& outFile) {
+	outFile.write((char*)seatsSeen, sizeof(seatsSeen));
+}
+
+void FogOfWar::loadFromFile(ifstream& inFile) {
+	inFile.read((char*)seatsSeen, sizeof(seatsSeen));
+}
+
+// BattlePredictor class implementation
+// The defender holds the ground its seat stands on, as in a real battle
+BattlePrediction BattlePredictor::predict(Kingdom* attacker, Kingdom* defender, const Map& map, int samples) {
+	const Military& attackArmy = attacker->getMilitary();
+	const Military& defenseArmy = defender->getMilitary();
+	return predict(attackArmy.calculateAttackPower(), map.getSeatDefense(defender), attackArmy.getTotalUnits(),
+		defenseArmy.getTotalUnits(), defender->getGold(), defender->getFood(), samples, (unsigned int)rand());
+}
+
+// Samples the same combat kernel the battle queue uses. The defence passed in must already include
+// the terrain bonus. Each chunk of samples has its own generator seeded from its position, so
+// results do not depend on the number of threads.
+BattlePrediction BattlePredictor::predict(int attackPower, int defensePower, int attackerUnits, int defenderUnits,
+	int defenderGold, int defenderFood, int samples, unsigned int seed) {
+	const int grain = 4096;
+	const int batch = 256;
+	int chunks = (samples + grain - 1) / grain;
+	vector<long long> wins(chunks, 0), attackerLosses(chunks, 0), defenderLosses(chunks, 0);
+
+	ThreadPool::shared().parallelFor(samples, grain, [&](int begin, int end) {
+		int chunk = begin / grain;
+		unsigned int state = seed ^ (0x9E3779B9u * (unsigned int)(chunk + 1));
+		if (state == 0) state = 1;
+		int attack[batch], defense[batch], attackRolls[batch], defenseRolls[batch];
+		int attackerLoss[batch], defenderLoss[batch];
+		unsigned char won[batch];
+		for (int i = 0; i < batch; i++) {
+			attack[i] = attackPower;
+			defense[i] = defensePower;
+		}
+		for (int first = begin; first < end; first += batch) {
+			int n = min(batch, end - first);
+			for (int i = 0; i < n; i++) {
+				attackRolls[i] = 80 + (int)(xorshift32(state) % 41);
+				defenseRolls[i] = 80 + (int)(xorshift32(state) % 41);
+			}
+			BattleQueue::resolveCombat(n, attack, defense, attackRolls, defenseRolls, attackerLoss, defenderLoss, won);
+			for (int i = 0; i < n; i++) {
+				wins[chunk] += won[i];
+				attackerLosses[chunk] += min(attackerLoss[i], attackerUnits);
+				defenderLosses[chunk] += min(defenderLoss[i], defenderUnits);
+			}
+		}
+	});
+
+	BattlePrediction prediction;
+	prediction.samples = samples;
+	if (samples <= 0) return prediction;
+	long long totalWins = 0, totalAttackerLosses = 0, totalDefenderLosses = 0;
+	for (int c = 0; c < chunks; c++) {
+		totalWins += wins[c];
+		totalAttackerLosses += attackerLosses[c];
+		totalDefenderLosses += defenderLosses[c];
+	}
+	prediction.winProbability = (double)totalWins / samples;
+	prediction.expectedAttackerCasualties = (double)totalAttackerLosses / samples;
+	prediction.expectedDefenderCasualties = (double)totalDefenderLosses / samples;
+	prediction.expectedGoldPlunder = prediction.winProbability * (defenderGold / 5);
+	prediction.expectedFoodPlunder = prediction.winProbability * (defenderFood / 5);
+	return prediction;
+}
+
+void BattlePredictor::display(const BattlePrediction& prediction) {
+	cout << "Battle forecast (" << prediction.samples << " simulations):\n";
+	cout << fixed << setprecision(1);
+	cout << "Chance of victory: " << prediction.winProbability * 100 << "%\n";
+	cout << "Expected losses: " << prediction.expectedAttackerCasualties << " of ours, "
+		<< prediction.expectedDefenderCasualties << " of theirs\n";
+	cout << "Expected plunder: " << prediction.expectedGoldPlunder << " gold, " << prediction.expectedFoodPlunder << " food\n";
+	cout << defaultfloat << setprecision(6);
+}
+
+// UtilityAI class implementation
+static int stockOf(const Kingdom* kingdom, ResourceType type) {
+	switch (type) {
+	case GOLD: return kingdom->getGold();
+	case FOOD: return kingdom->getFood();
+	case WOOD: return kingdom->getWood();
+	case STONE: return kingdom->getStone();
+	}
+	return 0;
+}
+
+UtilityAI::UtilityAI() : startIndex(0), planningBudgetMicros(AI_PLANNING_BUDGET_MICROS), planIterations(0), lastFull(0), lastReduced(0),
+	lastFallback(0), lastPlanned(0), lastAsleep(0), lastMillis(0), events(nullptr) {
+}
+
+void UtilityAI::setPlanningBudget(int micros) { planningBudgetMicros = max(0, micros); }
+
+// Every kingdom then gets a full evaluation and each plan a fixed search, so the AI no longer
+// depends on the clock and a seed replays the same game. The planning budget still sets how many
+// kingdoms plan.
+void UtilityAI::setFixedWork(int iterations) { planIterations = max(0, iterations); }
+
+// Without a scheduler no kingdom is ever put to sleep
+void UtilityAI::attachScheduler(EventScheduler* scheduler) { events = scheduler; }
+
+void UtilityAI::wake(int kingdom) {
+	if (kingdom >= 0 && kingdom < (int)asleep.size()) asleep[kingdom] = 0;
+}
+
+void UtilityAI::setHumanControlled(int kingdom, bool controlled) {
+	if (kingdom < 0 || kingdom >= MAX_KINGDOMS) return;
+	if ((int)human.size() <= kingdom) human.resize(kingdom + 1, 0);
+	human[kingdom] = controlled ? 1 : 0;
+}
+
+// Constant-time move for kingdoms that missed the time budget
+AIAction UtilityAI::fallbackAction(const Kingdom* kingdom) {
+	if (kingdom->getHappiness() > 40 && kingdom->getGold() < 500) return AIAction(AI_TAX, GOLD, 0, -1, 0);
+	return AIAction();
+}
+
+// Scores every candidate action and returns the best. Only reads the world, so it can run
+// for several kingdoms at once.
+AIAction UtilityAI::chooseAction(Kingdom* kingdoms[], int kingdomCount, int self, const Map& map, const FogOfWar& fog,
+	const DiplomacyManager& diplomacy, const ArmyManager& armies, bool runPredictions, unsigned int seed) {
+	Kingdom* kingdom = kingdoms[self];
+	const Military& army = kingdom->getMilitary();
+	const Technology& tech = kingdom->getTechnology();
+	int gold = kingdom->getGold();
+	int food = kingdom->getFood();
+	int attack = army.calculateAttackPower();
+	int defense = max(1, map.getSeatDefense(kingdom));
+	const AllianceBlocs& blocs = diplomacy.getBlocs();
+	AIAction best(AI_IDLE, GOLD, 0, -1, 0.05f);
+
+	// Strongest hostile army that can reach us; allies of allies count as friends. Kingdoms whose
+	// seat has never been seen are not considered at all.
+	float threat = 0;
+	int threatSource = -1;
+	for (int i = 0; i < kingdomCount; i++) {
+		if (i == self || !fog.knowsSeat(self, i)) continue;
+		if (!map.isInAttackRange(kingdom, kingdoms[i]) || diplomacy.hasTreaty(kingdom, kingdoms[i]) || blocs.sameBloc(self, i)) continue;
+		float t = (float)kingdoms[i]->getMilitary().calculateAttackPower() / defense;
+		if (t > threat) {
+			threat = t;
+			threatSource = i;
+		}
+	}
+
+	// Tax
+	if (kingdom->getHappiness() > 30) {
+		float score = 0.2f + 0.6f * (kingdom->getHappiness() / 100.0f) * 300.0f / (gold + 300);
+		if (score > best.score) best = AIAction(AI_TAX, GOLD, 0, -1, score);
+	}
+
+	// Build where the stockpile is lowest relative to what the kingdom consumes
+	if (kingdom->getBuildingCount() + kingdom->getPendingBuildings() < MAX_BUILDINGS) {
+		float need[4];
+		need[GOLD] = 300.0f / (gold + 100);
+		need[FOOD] = kingdom->getPopulation() * 2.0f / (food + 50);
+		need[WOOD] = 150.0f / (kingdom->getWood() + 50);
+		need[STONE] = 150.0f / (kingdom->getStone() + 50);
+		ResourceType type = GOLD;
+		for (int r = FOOD; r <= STONE; r++) {
+			if (need[r] > need[type]) type = (ResourceType)r;
+		}
+		bool needsStone = type == GOLD || type == WOOD;
+		int goldCost = type == GOLD ? 150 : 100;
+		if (gold >= goldCost && (needsStone ? kingdom->getStone() : kingdom->getWood()) >= 50) {
+			float score = 0.3f + 0.3f * min(need[type], 2.0f);
+			if (score > best.score) best = AIAction(AI_BUILD, type, 0, -1, score);
+		}
+	}
+
+	// Recruit defenders when a neighbour outguns us
+	if (threat > 0.7f) {
+		int amount = min(gold / 20, food / 10);
+		float score = 0.4f + 0.5f * min(threat, 2.0f);
+		if (amount > 0 && score > best.score) best = AIAction(AI_RECRUIT, GOLD, amount, -1, score);
+	}
+
+	// Research
+	static const ResourceType researchOrder[4] = { FOOD, GOLD, WOOD, STONE };
+	int researchIndex = 0;
+	while (researchIndex < 4 && (tech.isAdvanced(researchOrder[researchIndex]) || tech.isResearching(researchOrder[researchIndex]))) {
+		researchIndex++;
+	}
+	if (researchIndex < 4) {
+		ResourceType research = researchOrder[researchIndex];
+		float score = 0.25f + (tech.getResearchPoints() >= 100 ? 0.5f : 0.0f);
+		if (score > best.score) best = AIAction(AI_RESEARCH, research, 0, -1, score);
+	}
+
+	// Trade a surplus for the scarcest material
+	ResourceType surplus = FOOD, scarce = FOOD;
+	for (int r = WOOD; r <= STONE; r++) {
+		if (stockOf(kingdom, (ResourceType)r) > stockOf(kingdom, surplus)) surplus = (ResourceType)r;
+		if (stockOf(kingdom, (ResourceType)r) < stockOf(kingdom, scarce)) scarce = (ResourceType)r;
+	}
+	if (stockOf(kingdom, surplus) > 3 * stockOf(kingdom, scarce) + 100) {
+		int partner = -1;
+		for (int i = 0; i < kingdomCount && partner < 0; i++) {
+			if (i != self && diplomacy.hasTreaty(kingdom, kingdoms[i])) partner = i;
+		}
+		if (partner < 0 && kingdomCount > 1) partner = (self + 1 + (int)(seed % (kingdomCount - 1))) % kingdomCount;
+		if (partner >= 0) {
+			AIAction trade(AI_TRADE, surplus, (stockOf(kingdom, surplus) - stockOf(kingdom, scarce)) / 4, partner, 0.3f);
+			trade.requested = scarce;
+			if (trade.score > best.score) best = trade;
+		}
+	}
+
+	// Seek a non-aggression pact with whoever threatens us most
+	if (threat > 1.0f) {
+		float score = 0.5f + 0.3f * min(threat, 3.0f);
+		if (score > best.score) best = AIAction(AI_TREATY, GOLD, NON_AGGRESSION, threatSource, score);
+	}
+
+	// Attack the most profitable target we expect to beat
+	for (int i = 0; i < kingdomCount; i++) {
+		if (i == self || !fog.knowsSeat(self, i)) continue;
+		if (!map.isInAttackRange(kingdom, kingdoms[i]) || diplomacy.hasTreaty(kingdom, kingdoms[i]) || blocs.sameBloc(self, i)) continue;
+		const Military& enemy = kingdoms[i]->getMilitary();
+		int enemyDefense = max(1, map.getSeatDefense(kingdoms[i]));
+		float ratio = (float)attack / enemyDefense;
+		// Nearly strong enough: train the best attackers for the money to tip the balance
+		if (ratio >= 0.5f && ratio < 0.8f && gold > 400) {
+			float score = 0.3f + 0.3f * ratio;
+			if (score > best.score) {
+				const UnitCatalog& catalog = UnitCatalog::shared();
+				int unit = catalog.bestAttackPerGold();
+				best = AIAction(AI_TRAIN, GOLD, (gold - 200) / (2 * catalog.getType(unit).goldCost), -1, score);
+				best.unit = unit;
+			}
+		}
+		if (ratio < 0.8f) continue;
+		float win;
+		if (runPredictions) {
+			win = (float)BattlePredictor::predict(attack, enemyDefense, army.getTotalUnits(), enemy.getTotalUnits(),
+				kingdoms[i]->getGold(), kingdoms[i]->getFood(), AI_PREDICTION_SAMPLES, seed ^ (unsigned int)(i * 2654435761u)).winProbability;
+		}
+		else {
+			// Rolls are +-20%, so odds go from nothing to certain between these ratios
+			win = min(1.0f, max(0.0f, (ratio - 0.8f) / 0.4f));
+		}
+		if (win < 0.6f) continue;
+		float score = 0.4f + win + (kingdoms[i]->getGold() / 5.0f) / (gold + 500);
+		// Attacking declares war, which brings in the target's bloc unless that war is already on
+		if (diplomacy.getRelationship(kingdom, kingdoms[i]) == WAR) score += 0.2f;
+		else score -= 0.1f * (blocs.getBlocSize(i) - 1);
+		if (score > best.score) best = AIAction(AI_ATTACK, GOLD, 0, i, score);
+	}
+
+	// Send half the army after a much weaker kingdom out of reach, one campaign at a time. Seeing
+	// its land is enough to set out, and the army finds the seat on the way.
+	if (armies.getArmyCount(self) == 0) {
+		for (int i = 0; i < kingdomCount; i++) {
+			if (i == self || !(fog.knowsSeat(self, i) || fog.seesLand(self, i))) continue;
+			if (map.isInAttackRange(kingdom, kingdoms[i]) || diplomacy.hasTreaty(kingdom, kingdoms[i]) || blocs.sameBloc(self, i)) continue;
+			float ratio = (float)attack / 2 / max(1, map.getSeatDefense(kingdoms[i]));
+			if (ratio < 1.2f) continue;
+			float score = 0.3f + 0.2f * min(ratio, 3.0f);
+			if (score > best.score) best = AIAction(AI_MARCH, GOLD, 50, i, score);
+		}
+	}
+
+	// Push the borders out while some kingdom has never been sighted; more land brings more in sight
+	for (int i = 0; i < kingdomCount; i++) {
+		if (i == self || fog.knowsSeat(self, i) || fog.seesLand(self, i)) continue;
+		if (0.15f > best.score) best = AIAction(AI_EXPAND, GOLD, 0, i, 0.15f);
+		break;
+	}
+	return best;
+}
+
+void UtilityAI::applyAction(Kingdom* kingdoms[], int self, const AIAction& action, Map& map,
+	DiplomacyManager& diplomacy, MarketPlace& market, BattleQueue& battles, ArmyManager& armies) {
+	Kingdom* kingdom = kingdoms[self];
+	switch (action.type) {
+	case AI_BUILD: kingdom->buildStructure(action.resource); break;
+	case AI_RECRUIT: kingdom->recruitSoldiers(action.amount); break;
+	case AI_TRAIN: kingdom->trainTroops(action.unit, action.amount); break;
+	case AI_TAX: kingdom->collectTaxes(map); break;
+	case AI_RESEARCH: kingdom->researchTechnology(action.resource); break;
+	case AI_TRADE: {
+		Resource offering, requesting;
+		int* offered[4] = { &offering.gold, &offering.food, &offering.wood, &offering.stone };
+		int* wanted[4] = { &requesting.gold, &requesting.food, &requesting.wood, &requesting.stone };
+		*offered[action.resource] = action.amount;
+		*wanted[action.requested] = action.amount;
+		market.proposeTrade(kingdom, kingdoms[action.target], offering, requesting);
+		break;
+	}
+	case AI_TREATY: diplomacy.proposeTreaty(kingdom, kingdoms[action.target], (TreatyType)action.amount, 10); break;
+	case AI_ATTACK:
+		if (diplomacy.getRelationship(kingdom, kingdoms[action.target]) != WAR) diplomacy.declareWar(kingdoms, self, action.target);
+		map.launchAttack(kingdom, kingdoms[action.target], battles);
+		break;
+	case AI_MARCH: armies.dispatchArmy(kingdoms, self, action.target, action.amount); break;
+	case AI_EXPAND: map.expandTerritory(kingdom); break;
+	case AI_IDLE: break;
+	}
+}
+
+void UtilityAI::takeTurns(World& world, int firstAI, int budgetMicros) {
+	Kingdom** kingdoms = world.kingdoms;
+	int kingdomCount = world.kingdomCount;
+	Map& map = *world.map;
+	DiplomacyManager& diplomacy = *world.diplomacy;
+	ArmyManager& armies = *world.armies;
+	const FogOfWar& fog = *world.fog;
+	world.updateVisibility(); // Takes in whatever the player did this turn
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	chrono::steady_clock::time_point deadline = start + chrono::microseconds(budgetMicros);
+	// In the last quarter of the budget, skip the Monte Carlo predictions
+	chrono::steady_clock::time_point reducedFrom = start + chrono::microseconds(budgetMicros * 3 / 4);
+	int aiCount = kingdomCount - firstAI;
+	lastFull = lastReduced = lastFallback = lastPlanned = lastAsleep = 0;
+	if (aiCount <= 0) return;
+	if (startIndex >= aiCount) startIndex = 0;
+	AIAction* decisions = world.getScratch().allocateArray<AIAction>(kingdomCount);
+	// 0 = fallback, 1 = without predictions, 2 = full, 3 = asleep, 4 = human
+	unsigned char* evaluation = world.getScratch().allocateArray<unsigned char>(kingdomCount);
+	if ((int)asleep.size() < kingdomCount) asleep.resize(kingdomCount, 0);
+	if ((int)human.size() < kingdomCount) human.resize(kingdomCount, 0);
+	unsigned int seed = (unsigned int)rand();
+
+	// Chunks are claimed in order, so the kingdoms at the front of the rotation are scored first
+	ThreadPool& pool = ThreadPool::shared();
+	int grain = max(1, aiCount / (pool.getThreadCount() * 8));
+	pool.parallelFor(aiCount, grain, [&](int begin, int end) {
+		for (int n = begin; n < end; n++) {
+			int self = firstAI + (startIndex + n) % aiCount;
+			if (human[self]) {
+				evaluation[self] = 4;
+				continue;
+			}
+			if (asleep[self]) {
+				evaluation[self] = 3;
+				continue;
+			}
+			chrono::steady_clock::time_point now = planIterations ? start : chrono::steady_clock::now();
+			if (now >= deadline) {
+				decisions[self] = fallbackAction(kingdoms[self]);
+				evaluation[self] = 0;
+				continue;
+			}
+			bool full = now < reducedFrom;
+			decisions[self] = chooseAction(kingdoms, kingdomCount, self, map, fog, diplomacy, armies, full, seed + (unsigned int)self * 7919u);
+			evaluation[self] = full ? 2 : 1;
+		}
+	});
+
+	// Lookahead for the kingdoms at the front of the rotation, as far as the planning budget stretches
+	if (planningBudgetMicros >= MCTS_MIN_PLAN_MICROS) {
+		int planned = min(aiCount, planningBudgetMicros / MCTS_MIN_PLAN_MICROS);
+		int slice = planningBudgetMicros / planned;
+		for (int n = 0; n < planned; n++) {
+			int self = firstAI + (startIndex + n) % aiCount;
+			if (asleep[self] || human[self]) continue;
+			// The simulation has no marching armies and no map
+			if (decisions[self].type == AI_MARCH || decisions[self].type == AI_EXPAND) continue;
+			SimState state = MCTSPlanner::capture(kingdoms, kingdomCount, self, diplomacy, map, fog);
+			unsigned int planSeed = seed ^ (unsigned int)(self * 2246822519u);
+			if (planIterations) decisions[self] = MCTSPlanner::plan(state, planIterations, planSeed);
+			else decisions[self] = MCTSPlanner::plan(state, slice, planSeed, nullptr);
+			lastPlanned++;
+		}
+	}
+
+	// Actions are applied in kingdom order so the outcome does not depend on thread timing
+	for (int self = firstAI; self < kingdomCount; self++) {
+		if (evaluation[self] == 4) continue;
+		world.market->answerOffers(kingdoms, kingdomCount, self); // Sleeping kingdoms still trade
+		if (evaluation[self] == 3) {
+			lastAsleep++;
+			continue;
+		}
+		applyAction(kingdoms, self, decisions[self], map, diplomacy, *world.market, *world.battles, armies);
+		if (evaluation[self] == 2) lastFull++;
+		else if (evaluation[self] == 1) lastReduced++;
+		else lastFallback++;
+		// A considered decision to do nothing means nothing is worth doing for a while
+		if (events && evaluation[self] != 0 && decisions[self].type == AI_IDLE) {
+			asleep[self] = 1;
+			events->schedule(AI_IDLE_SLEEP_TURNS, EVENT_AI_WAKEUP, self, 0);
+		}
+	}
+	// Start next turn with the first kingdom that did not get a full evaluation
+	for (int n = 0; n < aiCount; n++) {
+		int self = firstAI + (startIndex + n) % aiCount;
+		if (evaluation[self] < 2) {
+			startIndex = (startIndex + n) % aiCount;
+			break;
+		}
+	}
+	lastMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void UtilityAI::displaySummary() const {
+	cout << "AI kingdoms have taken their turns (" << lastPlanned << " with lookahead, " << lastFull << " scored, "
+		<< lastReduced << " quick, " << lastFallback << " default, " << lastAsleep << " idle, " << fixed << setprecision(2) << lastMillis << " ms).\n";
+	cout << defaultfloat << setprecision(6);
+}
+
+// SimState implementation
+static int simPower(const SimKingdom& k, const int* weights) { return dotUnits(k.units, weights); }
+
+static void simCasualties(SimKingdom& k, int amount) { Military::distributeLosses(k.units, amount); }
+
+int SimState::listActions(int k, AIAction* actions) const {
+	const SimKingdom& s = kingdoms[k];
+	int n = 0;
+	actions[n++] = AIAction();
+	actions[n++] = AIAction(AI_TAX, GOLD, 0, -1, 0);
+	if (s.buildingCount < MAX_BUILDINGS) {
+		for (int r = GOLD; r <= STONE; r++) {
+			int goldCost = r == GOLD ? 150 : 100;
+			int material = (r == GOLD || r == WOOD) ? STONE : WOOD;
+			if (s.resources[GOLD] >= goldCost && s.resources[material] >= 50) actions[n++] = AIAction(AI_BUILD, (ResourceType)r, 0, -1, 0);
+		}
+	}
+	int recruits = min(s.resources[GOLD] / 20, s.resources[FOOD] / 10);
+	if (recruits > 0) actions[n++] = AIAction(AI_RECRUIT, GOLD, recruits, -1, 0);
+	if (s.resources[GOLD] >= 400) {
+		const UnitCatalog& catalog = UnitCatalog::shared();
+		int unit = catalog.bestAttackPerGold();
+		actions[n] = AIAction(AI_TRAIN, GOLD, (s.resources[GOLD] - 200) / (2 * catalog.getType(unit).goldCost), -1, 0);
+		actions[n++].unit = unit;
+	}
+	static const ResourceType researchOrder[4] = { FOOD, GOLD, WOOD, STONE };
+	for (int i = 0; i < 4; i++) {
+		if (!(s.techMask & (1 << researchOrder[i]))) {
+			actions[n++] = AIAction(AI_RESEARCH, researchOrder[i], 0, -1, 0);
+			break;
+		}
+	}
+	for (int t = 0; t < kingdomCount && n + 2 <= SIM_MAX_ACTIONS; t++) {
+		if (t == k || (s.treatyMask & (1 << t))) continue;
+		if (abs(s.x - kingdoms[t].x) + abs(s.y - kingdoms[t].y) > 3) continue;
+		actions[n++] = AIAction(AI_ATTACK, GOLD, 0, t, 0);
+		actions[n++] = AIAction(AI_TREATY, GOLD, NON_AGGRESSION, t, 0);
+	}
+	return n;
+}
+
+void SimState::applyAction(int k, const AIAction& action, unsigned int& rng) {
+	SimKingdom& s = kingdoms[k];
+	int* res = s.resources;
+	switch (action.type) {
+	case AI_BUILD: {
+		int goldCost = action.resource == GOLD ? 150 : 100;
+		int material = (action.resource == GOLD || action.resource == WOOD) ? STONE : WOOD;
+		if (s.buildingCount >= MAX_BUILDINGS || res[GOLD] < goldCost || res[material] < 50) break;
+		res[GOLD] -= goldCost;
+		res[material] -= 50;
+		s.boosts[action.resource] += 20;
+		s.buildingCount++;
+		break;
+	}
+	case AI_RECRUIT:
+		if (res[GOLD] < action.amount * 10 || res[FOOD] < action.amount * 5) break;
+		res[GOLD] -= action.amount * 10;
+		res[FOOD] -= action.amount * 5;
+		s.units[0] += action.amount;
+		break;
+	case AI_TRAIN: {
+		int cost = UnitCatalog::shared().getType(action.unit).goldCost;
+		if (action.amount <= 0 || res[GOLD] < action.amount * cost) break;
+		res[GOLD] -= action.amount * cost;
+		s.units[action.unit] += action.amount;
+		break;
+	}
+	case AI_TAX:
+		res[GOLD] += s.population * 2 + s.ownedTiles * LAND_TAX_PER_TILE;
+		s.happiness = max(0, s.happiness - 5);
+		break;
+	case AI_RESEARCH:
+		if (s.researchPoints >= 100 && !(s.techMask & (1 << action.resource))) {
+			s.techMask |= (unsigned char)(1 << action.resource);
+			s.researchPoints -= 100;
+		}
+		s.researchPoints += 20;
+		break;
+	case AI_TREATY:
+		s.treatyMask |= (unsigned char)(1 << action.target);
+		kingdoms[action.target].treatyMask |= (unsigned char)(1 << k);
+		break;
+	case AI_ATTACK: {
+		SimKingdom& enemy = kingdoms[action.target];
+		const UnitCatalog& catalog = UnitCatalog::shared();
+		int attack = simPower(s, catalog.getAttackWeights());
+		int defense = simPower(enemy, catalog.getDefenseWeights());
+		defense += defense * enemy.defenseBonus / 100;
+		int attackRoll = 80 + (int)(xorshift32(rng) % 41);
+		int defenseRoll = 80 + (int)(xorshift32(rng) % 41);
+		int attackerLoss, defenderLoss;
+		unsigned char won;
+		BattleQueue::resolveCombat(1, &attack, &defense, &attackRoll, &defenseRoll, &attackerLoss, &defenderLoss, &won);
+		simCasualties(s, attackerLoss);
+		simCasualties(enemy, defenderLoss);
+		if (won) {
+			int gold = enemy.resources[GOLD] / 5;
+			int food = enemy.resources[FOOD] / 5;
+			enemy.resources[GOLD] -= gold;
+			enemy.resources[FOOD] -= food;
+			res[GOLD] += gold;
+			res[FOOD] += food;
+		}
+		break;
+	}
+	case AI_TRADE:
+	case AI_MARCH:
+	case AI_EXPAND:
+	case AI_IDLE:
+		break;
+	}
+}
+
+// Mirrors Kingdom::processTurn
+void SimState::advanceTurn() {
+	for (int k = 0; k < kingdomCount; k++) {
+		SimKingdom& s = kingdoms[k];
+		int* res = s.resources;
+		res[FOOD] += ((s.techMask & (1 << FOOD)) ? 100 : 50) + s.boosts[FOOD];
+		res[GOLD] += ((s.techMask & (1 << GOLD)) ? 200 : 100) + s.boosts[GOLD];
+		res[WOOD] += ((s.techMask & (1 << WOOD)) ? 50 : 20) + s.boosts[WOOD];
+		res[STONE] += ((s.techMask & (1 << STONE)) ? 50 : 20) + s.boosts[STONE];
+		res[GOLD] = max(0, res[GOLD] - dotUnits(s.units, UnitCatalog::shared().getUpkeepWeights()));
+		res[FOOD] -= s.population;
+		s.happiness = res[FOOD] >= 0 ? min(100, s.happiness + 5) : max(0, s.happiness - 10);
+		s.population = res[FOOD] >= 0 ? s.population + 10 : s.population - 10;
+		if (s.population < 0) s.population = 0;
+		if (res[FOOD] < 0) res[FOOD] = 0;
+	}
+}
+
+// Share of the total strength of the simulated region held by kingdom k
+double SimState::evaluate(int k) const {
+	const UnitCatalog& catalog = UnitCatalog::shared();
+	double total = 0, own = 0;
+	for (int i = 0; i < kingdomCount; i++) {
+		const SimKingdom& s = kingdoms[i];
+		if (s.population <= 0) continue;
+		int techs = 0;
+		for (int r = 0; r < 4; r++) techs += (s.techMask >> r) & 1;
+		// Production is credited for ten turns so investments pay off beyond the horizon
+		int production = s.boosts[GOLD] + s.boosts[FOOD] + s.boosts[WOOD] + s.boosts[STONE];
+		double strength = s.resources[GOLD] + (s.resources[FOOD] + s.resources[WOOD] + s.resources[STONE]) / 2.0 +
+			s.population * 10.0 + s.happiness * 5.0 + simPower(s, catalog.getAttackWeights()) + simPower(s, catalog.getDefenseWeights()) +
+			production * 10.0 + techs * 300.0;
+		total += strength;
+		if (i == k) own = strength;
+	}
+	return total > 0 ? own / total : 0;
+}
+
+// MCTSPlanner class implementation
+SimState MCTSPlanner::capture(Kingdom* kingdoms[], int kingdomCount, int self, const DiplomacyManager& diplomacy,
+	const Map& map, const FogOfWar& fog) {
+	// The planning kingdom and the neighbours closest to it, of those whose seat it knows
+	vector<int> order;
+	for (int i = 0; i < kingdomCount; i++) {
+		if (i != self && fog.knowsSeat(self, i)) order.push_back(i);
+	}
+	Kingdom* centre = kingdoms[self];
+	sort(order.begin(), order.end(), [&](int a, int b) {
+		int da = abs(kingdoms[a]->getX() - centre->getX()) + abs(kingdoms[a]->getY() - centre->getY());
+		int db = abs(kingdoms[b]->getX() - centre->getX()) + abs(kingdoms[b]->getY() - centre->getY());
+		return da != db ? da < db : a < b;
+	});
+	SimState state;
+	state.kingdomCount = min(SIM_MAX_KINGDOMS, (int)order.size() + 1);
+	state.sourceIndex[0] = self;
+	for (int i = 1; i < state.kingdomCount; i++) state.sourceIndex[i] = order[i - 1];
+
+	for (int i = 0; i < state.kingdomCount; i++) {
+		const Kingdom* kingdom = kingdoms[state.sourceIndex[i]];
+		SimKingdom& s = state.kingdoms[i];
+		s.resources[GOLD] = kingdom->getGold();
+		s.resources[FOOD] = kingdom->getFood();
+		s.resources[WOOD] = kingdom->getWood();
+		s.resources[STONE] = kingdom->getStone();
+		s.boosts[GOLD] = s.boosts[FOOD] = s.boosts[WOOD] = s.boosts[STONE] = 0;
+		for (int b = 0; b < kingdom->getBuildingCount(); b++) {
+			s.boosts[kingdom->getBuilding(b).getResourceBoost()] += kingdom->getBuilding(b).getBoostAmount();
+		}
+		const Military& army = kingdom->getMilitary();
+		for (int u = 0; u < MAX_UNIT_TYPES; u++) s.units[u] = army.getCount(u);
+		s.population = kingdom->getPopulation();
+		s.happiness = kingdom->getHappiness();
+		const Technology& tech = kingdom->getTechnology();
+		s.researchPoints = tech.getResearchPoints();
+		// Research under way counts as done; it cannot be started again
+		s.techMask = 0;
+		for (int r = GOLD; r <= STONE; r++) {
+			if (tech.isAdvanced((ResourceType)r) || tech.isResearching((ResourceType)r)) s.techMask |= (unsigned char)(1 << r);
+		}
+		s.buildingCount = kingdom->getBuildingCount() + kingdom->getPendingBuildings();
+		s.ownedTiles = map.getOwnedTiles(state.sourceIndex[i]);
+		for (int r = GOLD; r <= STONE; r++) s.boosts[r] += map.getLandYield(state.sourceIndex[i], (ResourceType)r);
+		s.x = kingdom->getX();
+		s.y = kingdom->getY();
+		s.defenseBonus = map.getDefenseBonus(s.x, s.y);
+		s.treatyMask = 0;
+	}
+	for (int i = 0; i < state.kingdomCount; i++) {
+		for (int j = i + 1; j < state.kingdomCount; j++) {
+			if (diplomacy.hasTreaty(kingdoms[state.sourceIndex[i]], kingdoms[state.sourceIndex[j]])) {
+				state.kingdoms[i].treatyMask |= (unsigned char)(1 << j);
+				state.kingdoms[j].treatyMask |= (unsigned char)(1 << i);
+			}
+		}
+	}
+	return state;
+}
+
+// One turn: the planning kingdom's move, random moves for everyone else, then production
+static void simulateTurn(SimState& state, const AIAction& own, unsigned int& rng) {
+	AIAction actions[SIM_MAX_ACTIONS];
+	state.applyAction(0, own, rng);
+	for (int k = 1; k < state.kingdomCount; k++) {
+		int n = state.listActions(k, actions);
+		state.applyAction(k, actions[xorshift32(rng) % n], rng);
+	}
+	state.advanceTurn();
+}
+
+// Builds one UCT tree until the deadline, or for maxIterations when that is set. The tree holds only the planning kingdom's moves;
+// other kingdoms are sampled afresh on every visit.
+void MCTSPlanner::searchTree(const SimState& root, chrono::steady_clock::time_point deadline, int maxIterations,
+	unsigned int seed, vector<int>& rootVisits, int& iterations) {
+	vector<Node> nodes;
+	nodes.reserve(4096);
+	Node rootNode;
+	rootNode.parent = -1;
+	rootNode.firstChild = -1;
+	rootNode.childCount = 0;
+	rootNode.visits = 0;
+	rootNode.value = 0;
+	nodes.push_back(rootNode);
+	unsigned int rng = seed ? seed : 1;
+	AIAction actions[SIM_MAX_ACTIONS];
+
+	for (iterations = 0; ; iterations++) {
+		if (maxIterations ? iterations >= maxIterations : (iterations & 15) == 0 && chrono::steady_clock::now() >= deadline) break;
+		SimState state = root; // Fork
+		int node = 0;
+		int depth = 0;
+
+		// Selection, stopping at the first child never tried before
+		while (depth < MCTS_HORIZON) {
+			if (nodes[node].firstChild < 0) {
+				if ((int)nodes.size() + SIM_MAX_ACTIONS > MCTS_MAX_NODES) break;
+				int n = state.listActions(0, actions);
+				nodes[node].firstChild = (int)nodes.size();
+				nodes[node].childCount = n;
+				for (int i = 0; i < n; i++) {
+					Node child;
+					child.action = actions[i];
+					child.parent = node;
+					child.firstChild = -1;
+					child.childCount = 0;
+					child.visits = 0;
+					child.value = 0;
+					nodes.push_back(child);
+				}
+			}
+			int first = nodes[node].firstChild;
+			double logVisits = log((double)max(1, nodes[node].visits));
+			int chosen = -1;
+			double bestBound = -1;
+			for (int i = first; i < first + nodes[node].childCount; i++) {
+				if (nodes[i].visits == 0) {
+					chosen = i;
+					break;
+				}
+				double bound = nodes[i].value / nodes[i].visits + 1.4 * sqrt(logVisits / nodes[i].visits);
+				if (bound > bestBound) {
+					bestBound = bound;
+					chosen = i;
+				}
+			}
+			bool fresh = nodes[chosen].visits == 0;
+			simulateTurn(state, nodes[chosen].action, rng);
+			node = chosen;
+			depth++;
+			if (fresh) break;
+		}
+
+		// Random playout to the horizon
+		while (depth < MCTS_HORIZON) {
+			int n = state.listActions(0, actions);
+			simulateTurn(state, actions[xorshift32(rng) % n], rng);
+			depth++;
+		}
+
+		double value = state.evaluate(0);
+		for (int n = node; n >= 0; n = nodes[n].parent) {
+			nodes[n].visits++;
+			nodes[n].value += value;
+		}
+	}
+
+	rootVisits.assign(nodes[0].childCount, 0);
+	for (int i = 0; i < nodes[0].childCount; i++) rootVisits[i] = nodes[nodes[0].firstChild + i].visits;
+}
+
+// Root-parallel search: independent trees on the pool threads, merged by visit count at the root
+AIAction MCTSPlanner::search(const SimState& root, int trees, chrono::steady_clock::time_point deadline, int maxIterations,
+	unsigned int seed, int* iterations) {
+	vector<vector<int> > visits(trees);
+	vector<int> counts(trees, 0);
+	ThreadPool::shared().parallelFor(trees, 1, [&](int begin, int end) {
+		for (int t = begin; t < end; t++) {
+			searchTree(root, deadline, maxIterations, seed + (unsigned int)t * 0x9E3779B9u, visits[t], counts[t]);
+		}
+	});
+
+	AIAction actions[SIM_MAX_ACTIONS];
+	int n = root.listActions(0, actions);
+	vector<int> total(n, 0);
+	int totalIterations = 0;
+	for (int t = 0; t < trees; t++) {
+		totalIterations += counts[t];
+		if ((int)visits[t].size() != n) continue;
+		for (int i = 0; i < n; i++) total[i] += visits[t][i];
+	}
+	if (iterations) *iterations = totalIterations;
+	int best = 0;
+	for (int i = 1; i < n; i++) {
+		if (total[i] > total[best]) best = i;
+	}
+	AIAction result = actions[best];
+	if (result.target >= 0) result.target = root.sourceIndex[result.target];
+	return result;
+}
+
+// One tree per pool thread, for as long as the budget lasts
+AIAction MCTSPlanner::plan(const SimState& root, int budgetMicros, unsigned int seed, int* iterations) {
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::microseconds(budgetMicros);
+	return search(root, ThreadPool::shared().getThreadCount(), deadline, 0, seed, iterations);
+}
+
+AIAction MCTSPlanner::plan(const SimState& root, int maxIterations, unsigned int seed) {
+	return search(root, MCTS_FIXED_TREES, chrono::steady_clock::now(), max(1, maxIterations), seed, nullptr);
+}
+
+// Treaties, trade offers and messages note each change for the journal; detail 1 means removed
+static void noteChange(vector<Change>& changes, ChangeKind kind, int subject, int detail) {
+	Change change = { kind, subject, detail };
+	changes.push_back(change);
+}
+
+// AllianceBlocs class implementation
+void AllianceBlocs::ensure(int kingdom) {
+	for (int k = (int)bloc.size(); k <= kingdom; k++) {
+		bloc.push_back(k);
+		members.push_back(vector<int>(1, k));
+		allies.push_back(vector<int>());
+		seen.push_back(0);
+	}
+}
+
+void AllianceBlocs::clear() {
+	bloc.clear();
+	members.clear();
+	allies.clear();
+	seen.clear();
+}
+
+void AllianceBlocs::addAlliance(int a, int b) {
+	if (a < 0 || b < 0 || a == b) return;
+	ensure(max(a, b));
+	allies[a].push_back(b);
+	allies[b].push_back(a);
+	int into = bloc[a], from = bloc[b];
+	if (into == from) return;
+	if (members[into].size() < members[from].size()) swap(into, from);
+	for (size_t i = 0; i < members[from].size(); i++) bloc[members[from][i]] = into;
+	members[into].insert(members[into].end(), members[from].begin(), members[from].end());
+	members[from].clear();
+}
+
+// Walks the remaining alliances from a. If b is not reached, the bloc splits in two, taking the
+// ids a and b, which were members of it and so are free.
+void AllianceBlocs::removeAlliance(int a, int b) {
+	if (a < 0 || b < 0 || a >= (int)bloc.size() || b >= (int)bloc.size()) return;
+	vector<int>::iterator link = find(allies[a].begin(), allies[a].end(), b);
+	if (link == allies[a].end()) return;
+	allies[a].erase(link);
+	allies[b].erase(find(allies[b].begin(), allies[b].end(), a));
+	vector<int> reached(1, a);
+	seen[a] = 1;
+	for (size_t i = 0; i < reached.size(); i++) {
+		const vector<int>& next = allies[reached[i]];
+		for (size_t j = 0; j < next.size(); j++) {
+			if (seen[next[j]]) continue;
+			seen[next[j]] = 1;
+			reached.push_back(next[j]);
+		}
+	}
+	bool split = !seen[b];
+	vector<int> old;
+	if (split) old.swap(members[bloc[a]]);
+	for (size_t i = 0; i < old.size(); i++) {
+		if (!seen[old[i]]) {
+			bloc[old[i]] = b;
+			members[b].push_back(old[i]);
+		}
+	}
+	for (size_t i = 0; i < reached.size(); i++) {
+		seen[reached[i]] = 0;
+		if (split) bloc[reached[i]] = a;
+	}
+	if (split) members[a].swap(reached);
+}
+
+int AllianceBlocs::blocOf(int kingdom) const {
+	return kingdom >= 0 && kingdom < (int)bloc.size() ? bloc[kingdom] : kingdom;
+}
+
+bool AllianceBlocs::sameBloc(int a, int b) const { return blocOf(a) == blocOf(b); }
+
+int AllianceBlocs::getBlocSize(int kingdom) const {
+	return kingdom >= 0 && kingdom < (int)bloc.size() ? (int)members[bloc[kingdom]].size() : 1;
+}
+
+void AllianceBlocs::getMembers(int kingdom, vector<int>& out) const {
+	out.clear();
+	if (kingdom >= 0 && kingdom < (int)bloc.size()) out = members[bloc[kingdom]];
+	else out.push_back(kingdom);
+}
+
+// DiplomacyManager class implementation
+DiplomacyManager::DiplomacyManager() : nextTreatyId(1), events(nullptr) {
+	for (int i = 0; i < MAX_KINGDOMS; i++) {
+		for (int j = 0; j < MAX_KINGDOMS; j++) {
+			relations[i][j] = NEUTRAL;
+		}
+	}
+}
+
+void DiplomacyManager::attachScheduler(EventScheduler* scheduler) { events = scheduler; }
+
+void DiplomacyManager::takeChanges(vector<Change>& out) {
+	out.insert(out.end(), changes.begin(), changes.end());
+	changes.clear();
+}
+
+// Expired and broken treaties give their slot back
+int DiplomacyManager::freeTreatySlot() const {
+	for (int i = 0; i < treaties.size(); i++) {
+		if (!treaties[i].active) return i;
+	}
+	return treaties.full() ? -1 : treaties.size();
+}
+
+bool DiplomacyManager::hasTreaty(Kingdom* k1, Kingdom* k2) const {
+	for (int i = 0; i < treaties.size(); i++) {
+		if (treaties[i].active &&
+			((strcmp(treaties[i].kingdom1, k1->getName()) == 0 && strcmp(treaties[i].kingdom2, k2->getName()) == 0) ||
+			(strcmp(treaties[i].kingdom1, k2->getName()) == 0 && strcmp(treaties[i].kingdom2, k1->getName()) == 0))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool DiplomacyManager::proposeTreaty(Kingdom* proposer, Kingdom* receiver) {
+	if (freeTreatySlot() < 0 || hasTreaty(proposer, receiver)) {
+		cout << "Cannot propose treaty!\n";
+		return false;
+	}
+	cout << "Choose treaty type:\n1. Peace\n2. Alliance\n3. Trade\n4. Non-Aggression\n";
+	int choice;
+	cin >> choice;
+	if (choice < 1 || choice > 4) {
+		cout << "Invalid treaty type!\n";
+		return false;
+	}
+	TreatyType type = static_cast<TreatyType>(choice - 1);
+	cout << "Enter duration (1 to " << MAX_TREATY_TURNS << " turns): ";
+	int duration;
+	cin >> duration;
+	if (!proposeTreaty(proposer, receiver, type, duration)) return false;
+	cout << "Treaty proposed!\n";
+	return true;
+}
+
+bool DiplomacyManager::proposeTreaty(Kingdom* proposer, Kingdom* receiver, TreatyType type, int duration) {
+	int slot = freeTreatySlot();
+	if (duration <= 0 || duration > MAX_TREATY_TURNS || slot < 0 || hasTreaty(proposer, receiver)) return false;
+	Treaty& t = slot == treaties.size() ? treaties.append() : treaties[slot];
+	strcpy_s(t.kingdom1, proposer->getName());
+	strcpy_s(t.kingdom2, receiver->getName());
+	t.type = type;
+	t.turnEstablished = events ? events->getCurrentTurn() : 0;
+	t.duration = duration;
+	t.active = true;
+	t.id = nextTreatyId++;
+	t.party1 = proposer->getIndex();
+	t.party2 = receiver->getIndex();
+	if (type == ALLIANCE) blocs.addAlliance(t.party1, t.party2);
+	if (events) events->schedule(duration, EVENT_TREATY_EXPIRY, t.id, 0);
+	noteChange(changes, CHANGE_TREATY, t.id, 0);
+	updateRelations(proposer, receiver, 2);
+	return true;
+}
+
+void DiplomacyManager::endTreaty(Treaty& treaty) {
+	treaty.active = false;
+	if (treaty.type == ALLIANCE) blocs.removeAlliance(treaty.party1, treaty.party2);
+	noteChange(changes, CHANGE_TREATY, treaty.id, 1);
+}
+
+// Ends the treaty if it is still in force; returns it so the caller can tell the parties
+const Treaty* DiplomacyManager::expireTreaty(int id) {
+	for (int i = 0; i < treaties.size(); i++) {
+		if (treaties[i].active && treaties[i].id == id) {
+			endTreaty(treaties[i]);
+			return &treaties[i];
+		}
+	}
+	return nullptr;
+}
+
+bool DiplomacyManager::breakTreaty(Kingdom* kingdom) {
+	cout << "Select treaty to break:\n";
+	int validCount = 0;
+	for (int i = 0; i < treaties.size(); i++) {
+		if (treaties[i].active && (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ||
+			strcmp(treaties[i].kingdom2, kingdom->getName()) == 0)) {
+			validCount++;
+			cout << validCount << ". " << (treaties[i].type == PEACE ? "Peace" : treaties[i].type == ALLIANCE ? "Alliance" : treaties[i].type == TRADE ? "Trade" : "Non-Aggression")
+				<< " with " << (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ? treaties[i].kingdom2 : treaties[i].kingdom1) << endl;
+		}
+	}
+	if (validCount == 0) {
+		cout << "No treaties to break.\n";
+		return false;
+	}
+	cout << "Enter number (0 to cancel): ";
+	int choice;
+	cin >> choice;
+	if (choice <= 0 || choice > validCount) return false;
+	int counter = 0;
+	for (int i = 0; i < treaties.size(); i++) {
+		if (treaties[i].active && (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ||
+			strcmp(treaties[i].kingdom2, kingdom->getName()) == 0)) {
+			counter++;
+			if (counter == choice) {
+				endTreaty(treaties[i]);
+				cout << "Treaty broken!\n";
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool DiplomacyManager::breakTreaty(Kingdom* k1, Kingdom* k2) {
+	for (int i = 0; i < treaties.size(); i++) {
+		if (treaties[i].active && ((strcmp(treaties[i].kingdom1, k1->getName()) == 0 && strcmp(treaties[i].kingdom2, k2->getName()) == 0) ||
+			(strcmp(treaties[i].kingdom1, k2->getName()) == 0 && strcmp(treaties[i].kingdom2, k1->getName()) == 0))) {
+			endTreaty(treaties[i]);
+			updateRelations(k1, k2, -2);
+			return true;
+		}
+	}
+	return false;
+}
+
+void DiplomacyManager::viewTreaties(Kingdom* kingdom) const {
+	bool found = false;
+	cout << "Treaties for " << kingdom->getName() << ":\n";
+	for (int i = 0; i < treaties.size(); i++) {
+		if (treaties[i].active && (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ||
+			strcmp(treaties[i].kingdom2, kingdom->getName()) == 0)) {
+			found = true;
+			cout << (treaties[i].type == PEACE ? "Peace" : treaties[i].type == ALLIANCE ? "Alliance" : treaties[i].type == TRADE ? "Trade" : "Non-Aggression")
+				<< " with " << (strcmp(treaties[i].kingdom1, kingdom->getName()) == 0 ? treaties[i].kingdom2 : treaties[i].kingdom1)
+				<< " (" << (events ? treaties[i].turnEstablished + treaties[i].duration - events->getCurrentTurn() : treaties[i].duration)
+				<< " turns" << (events ? " left" : "") << ")\n";
+		}
+	}
+	if (!found) cout << "No active treaties.\n";
+}
+
+void DiplomacyManager::checkRelations(Kingdom* const kingdoms[], int kingdomCount, int kingdom) const {
+	static const char* statusNames[] = { "Friendly", "Neutral", "Hostile", "At war" };
+	cout << "Relations for " << kingdoms[kingdom]->getName() << ":\n";
+	for (int k = 0; k < kingdomCount; k++) {
+		if (k == kingdom) continue;
+		cout << "  " << kingdoms[k]->getName() << ": " << statusNames[relations[kingdom][k]]
+			<< (blocs.sameBloc(kingdom, k) ? " (allied bloc)" : "") << "\n";
+	}
+	vector<int> bloc;
+	blocs.getMembers(kingdom, bloc);
+	cout << "Alliance bloc: " << bloc.size() << (bloc.size() == 1 ? " kingdom\n" : " kingdoms\n");
+}
+
+// Allies already in the declarer's own bloc stay out of it
+int DiplomacyManager::declareWar(Kingdom* const kingdoms[], int declarer, int target) {
+	Kingdom* attacker = kingdoms[declarer];
+	if (hasTreaty(attacker, kingdoms[target])) {
+		EventLog::record(LOG_TREATY_BROKEN_FOR_WAR, declarer, target, 0);
+		breakTreaty(attacker, kingdoms[target]);
+	}
+	updateRelations(attacker, kingdoms[target], -3);
+	noteChange(changes, CHANGE_RELATIONS, declarer, target);
+	EventLog::record(LOG_WAR_DECLARED, declarer, target, 0);
+	vector<int> bloc;
+	blocs.getMembers(target, bloc);
+	int drawnIn = 0;
+	for (size_t i = 0; i < bloc.size(); i++) {
+		Kingdom* ally = kingdoms[bloc[i]];
+		if (bloc[i] == target || bloc[i] == declarer || blocs.sameBloc(bloc[i], declarer)) continue;
+		if (hasTreaty(attacker, ally)) breakTreaty(attacker, ally);
+		updateRelations(attacker, ally, -3);
+		EventLog::record(LOG_ALLY_JOINED, bloc[i], declarer, 0);
+		drawnIn++;
+	}
+	return drawnIn;
+}
+
+RelationshipStatus DiplomacyManager::getRelationship(Kingdom* k1, Kingdom* k2) const {
+	return relations[k1->getIndex()][k2->getIndex()];
+}
+
+const AllianceBlocs& DiplomacyManager::getBlocs() const { return blocs; }
+
+// Positive changes move both sides towards friendly, negative ones towards war
+void DiplomacyManager::updateRelations(Kingdom* k1, Kingdom* k2, int change) {
+	int a = k1->getIndex(), b = k2->getIndex();
+	if (a < 0 || b < 0 || a == b) return;
+	int status = min((int)WAR, max((int)FRIENDLY, (int)relations[a][b] - change));
+	relations[a][b] = relations[b][a] = (RelationshipStatus)status;
+}
+
+void DiplomacyManager::saveToFile(ofstream& outFile) {
+	int treatyCount = treaties.size();
+	outFile.write((char*)&treatyCount, sizeof(treatyCount));
+	for (int i = 0; i < treatyCount; i++) {
+		outFile.write((char*)&treaties[i], sizeof(Treaty));
+	}
+	outFile.write((char*)relations, sizeof(relations));
+}
+
+void DiplomacyManager::loadFromFile(ifstream& inFile) {
+	int treatyCount = 0;
+	inFile.read((char*)&treatyCount, sizeof(treatyCount));
+	treaties.resize(treatyCount);
+	blocs.clear();
+	for (int i = 0; i < treaties.size(); i++) {
+		inFile.read((char*)&treaties[i], sizeof(Treaty));
+		nextTreatyId = max(nextTreatyId, treaties[i].id + 1);
+		if (treaties[i].active && treaties[i].type == ALLIANCE) blocs.addAlliance(treaties[i].party1, treaties[i].party2);
+	}
+	inFile.read((char*)relations, sizeof(relations));
+	changes.clear();
+}
+
+// MarketPlace class implementation
+MarketPlace::MarketPlace() : nextOfferId(1), events(nullptr), caravans(nullptr) {
+	prices[GOLD] = 100;
+	prices[FOOD] = 10;
+	prices[WOOD] = 20;
+	prices[STONE] = 30;
+}
+
+void MarketPlace::attachScheduler(EventScheduler* scheduler) { events = scheduler; }
+void MarketPlace::attachCaravans(CaravanManager* manager) { caravans = manager; }
+
+// In gold at today's prices
+int MarketPlace::valueOf(const Resource& goods) const {
+	return goods.gold + goods.food * prices[FOOD] + goods.wood * prices[WOOD] + goods.stone * prices[STONE];
+}
+
+// Goods already taken from the sender go by caravan, or straight over without one
+void MarketPlace::ship(Kingdom* sender, Kingdom* receiver, const Resource& goods) {
+	if (goods.gold == 0 && goods.food == 0 && goods.wood == 0 && goods.stone == 0) return;
+	if (caravans) caravans->dispatch(sender, receiver, goods, false, 0);
+	else receiver->addResources(goods);
+}
+
+void MarketPlace::takeChanges(vector<Change>& out) {
+	out.insert(out.end(), changes.begin(), changes.end());
+	changes.clear();
+}
+
+// Frees the offer's slot whether or not it was answered; returns true if it was still open
+bool MarketPlace::expireOffer(int id) {
+	for (int i = 0; i < tradeOffers.size(); i++) {
+		if (tradeOffers[i].id != id) continue;
+		bool pending = !tradeOffers[i].accepted;
+		tradeOffers.removeAt(i);
+		noteChange(changes, CHANGE_OFFER, id, 1);
+		return pending;
+	}
+	return false;
+}
+
+void MarketPlace::displayPrices() const {
+	cout << "Market Prices:\n";
+	cout << "Gold: " << prices[GOLD] << endl;
+	cout << "Food: " << prices[FOOD] << endl;
+	cout << "Wood: " << prices[WOOD] << endl;
+	cout << "Stone: " << prices[STONE] << endl;
+}
+
+void MarketPlace::updatePrices() {
+	for (int i = 0; i < 4; i++) {
+		prices[i] = prices[i] * (90 + rand() % 21) / 100;
+	}
+	noteChange(changes, CHANGE_PRICES, 0, 0);
+}
+
+void MarketPlace::buyResources(Kingdom* kingdom) {
+	cout << "Buy Resources:\n";
+	cout << "1. Food (Price: " << prices[FOOD] << " Gold)\n";
+	cout << "2. Wood (Price: " << prices[WOOD] << " Gold)\n";
+	cout << "3. Stone (Price: " << prices[STONE] << " Gold)\n";
+	int choice;
+	cin >> choice;
+	cout << "Enter quantity: ";
+	int quantity = 0;
+	cin >> choice;
+	if (quantity <= 0) return;
+	ResourceType type;
+	int price;
+	switch (choice) {
+	case 1: type = FOOD; price = prices[FOOD]; break;
+	case 2: type = WOOD; price = prices[WOOD]; break;
+	case 3: type = STONE; price = prices[STONE]; break;
+	default: cout << "Invalid choice.\n"; return;
+	}
+	if (kingdom->spendGold(price * quantity)) {
+		switch (type) {
+		case FOOD: kingdom->addFood(quantity); break;
+		case WOOD: kingdom->addWood(quantity); break;
+		case STONE: kingdom->addStone(quantity); break;
+		default: break;
+		}
+		cout << "Purchased " << quantity << " units.\n";
+	}
+	else {
+		cout << "Not enough gold!\n";
+	}
+}
+
+void MarketPlace::sellResources(Kingdom* kingdom) {
+	cout << "Sell Resources:\n";
+	cout << "1. Food (Price: " << prices[FOOD] / 2 << " Gold)\n";
+	cout << "2. Wood (Price: " << prices[WOOD] / 2 << " Gold)\n";
+	cout << "3. Stone (Price: " << prices[STONE] / 2 << " Gold)\n";
+	int choice;
+	cin >> choice;
+	cout << "Enter quantity: ";
+	int quantity;
+	cin >> quantity;
+	if (quantity <= 0) return;
+	ResourceType type;
+	int price;
+	switch (choice) {
+	case 1: type = FOOD; price = prices[FOOD] / 2; break;
+	case 2: type = WOOD; price = prices[WOOD] / 2; break;
+	case 3: type = STONE; price = prices[STONE] / 2; break;
+	default: cout << "Invalid choice.\n"; return;
+	}
+	bool success;
+	switch (type) {
+	case FOOD: success = kingdom->spendFood(quantity); break;
+	case WOOD: success = kingdom->spendWood(quantity); break;
+	case STONE: success = kingdom->spendStone(quantity); break;
+	default: success = false; break;
+	}
+	if (success) {
+		kingdom->addGold(price * quantity);
+		cout << "Sold " << quantity << " units.\n";
+	}
+	else {
+		cout << "Not enough resources!\n";
+	}
+}
+
+bool MarketPlace::proposeTrade(Kingdom* offerer, Kingdom* receiver) {
+	if (tradeOffers.full()) {
+		cout << "Maximum trade offers reached!\n";
+		return false;
+	}
+	cout << "Enter resources to offer (Gold Food Wood Stone): ";
+	int g, f, w, s;
+	cin >> g >> f >> w >> s;
+	cout << "Enter resources to request (Gold Food Wood Stone): ";
+	int rg, rf, rw, rs;
+	cin >> rg >> rf >> rw >> rs;
+	proposeTrade(offerer, receiver, Resource(g, f, w, s), Resource(rg, rf, rw, rs));
+	cout << "Trade proposed!\n";
+	return true;
+}
+
+bool MarketPlace::proposeTrade(Kingdom* offerer, Kingdom* receiver, const Resource& offering, const Resource& requesting) {
+	if (tradeOffers.full()) return false;
+	TradeOffer& offer = tradeOffers.append();
+	strcpy_s(offer.offerer, offerer->getName());
+	strcpy_s(offer.receiver, receiver->getName());
+	offer.offering = offering;
+	offer.requesting = requesting;
+	offer.isSmuggling = false;
+	offer.accepted = false;
+	offer.id = nextOfferId++;
+	if (events) events->schedule(OFFER_LIFETIME_TURNS, EVENT_OFFER_EXPIRY, offer.id, 0);
+	noteChange(changes, CHANGE_OFFER, offer.id, 0);
+	return true;
+}
+
+void MarketPlace::viewTradeOffers(Kingdom* kingdom) const {
+	bool found = false;
+	cout << "Trade Offers for " << kingdom->getName() << ":\n";
+	for (int i = 0; i < tradeOffers.size(); i++) {
+		if (strcmp(tradeOffers[i].receiver, kingdom->getName()) == 0 && !tradeOffers[i].accepted) {
+			found = true;
+			cout << i + 1 << ". From " << tradeOffers[i].offerer << ": Offer("
+				<< tradeOffers[i].offering.gold << "G, " << tradeOffers[i].offering.food << "F, "
+				<< tradeOffers[i].offering.wood << "W, " << tradeOffers[i].offering.stone << "S) Request("
+				<< tradeOffers[i].requesting.gold << "G, " << tradeOffers[i].requesting.food << "F, "
+				<< tradeOffers[i].requesting.wood << "W, " << tradeOffers[i].requesting.stone << "S)\n";
+		}
+	}
+	if (!found) cout << "No trade offers.\n";
+}
+
+bool MarketPlace::respondToOffer(Kingdom* const kingdoms[], int kingdomCount, Kingdom* kingdom) {
+	cout << "Enter offer number to answer (0 to skip): ";
+	int number = 0;
+	cin >> number;
+	if (number <= 0) return false;
+	cout << "Accept the offer? (y/n): ";
+	char answer;
+	cin >> answer;
+	bool accept = answer == 'y' || answer == 'Y';
+	if (!respondToOffer(kingdoms, kingdomCount, kingdom, number - 1, accept)) {
+		cout << "That offer cannot be taken up.\n";
+		return false;
+	}
+	if (!accept) cout << "Offer declined.\n";
+	else if (caravans) cout << "Trade accepted! The caravans have set out.\n";
+	else cout << "Trade accepted!\n";
+	return true;
+}
+
+// Both sides pay when the offer is accepted; the goods then travel by caravan. An offer neither
+// side can pay for any more stays open.
+bool MarketPlace::respondToOffer(Kingdom* const kingdoms[], int kingdomCount, Kingdom* kingdom, int offerIndex, bool accept) {
+	if (offerIndex < 0 || offerIndex >= tradeOffers.size() || tradeOffers[offerIndex].accepted) return false;
+	TradeOffer& offer = tradeOffers[offerIndex];
+	if (strcmp(offer.receiver, kingdom->getName()) != 0) return false;
+	if (!accept) {
+		offer.accepted = true; // Mark as processed
+		noteChange(changes, CHANGE_OFFER, offer.id, 0);
+		return true;
+	}
+	Kingdom* offerer = nullptr;
+	for (int k = 0; k < kingdomCount && !offerer; k++) {
+		if (strcmp(kingdoms[k]->getName(), offer.offerer) == 0) offerer = kingdoms[k];
+	}
+	if (!offerer || offerer == kingdom || !offerer->spendResources(offer.offering)) return false;
+	if (!kingdom->spendResources(offer.requesting)) {
+		offerer->addResources(offer.offering);
+		return false;
+	}
+	ship(offerer, kingdom, offer.offering);
+	ship(kingdom, offerer, offer.requesting);
+	offer.accepted = true;
+	noteChange(changes, CHANGE_OFFER, offer.id, 0);
+	EventLog::record(LOG_TRADE_ACCEPTED, kingdom->getIndex(), offerer->getIndex(), offer.id);
+	return true;
+}
+
+// Takes any offer worth at least what it asks at market prices and declines the rest
+void MarketPlace::answerOffers(Kingdom* const kingdoms[], int kingdomCount, int kingdom) {
+	Kingdom* self = kingdoms[kingdom];
+	for (int i = 0; i < tradeOffers.size(); i++) {
+		const TradeOffer& offer = tradeOffers[i];
+		if (offer.accepted || strcmp(offer.receiver, self->getName()) != 0) continue;
+		bool worthIt = valueOf(offer.offering) >= valueOf(offer.requesting);
+		if (!worthIt || !respondToOffer(kingdoms, kingdomCount, self, i, true)) respondToOffer(kingdoms, kingdomCount, self, i, false);
+	}
+}
+
+void MarketPlace::initiateSmuggling(Kingdom* smuggler, Kingdom* buyer) {
+	cout << "Smuggle goods to the black market in " << buyer->getName() << ":\n";
+	cout << "1. Food (Pays " << prices[FOOD] * SMUGGLING_MARKUP_PERCENT / 100 << " Gold)\n";
+	cout << "2. Wood (Pays " << prices[WOOD] * SMUGGLING_MARKUP_PERCENT / 100 << " Gold)\n";
+	cout << "3. Stone (Pays " << prices[STONE] * SMUGGLING_MARKUP_PERCENT / 100 << " Gold)\n";
+	int choice = 0;
+	cin >> choice;
+	cout << "Enter quantity: ";
+	int quantity = 0;
+	cin >> quantity;
+	if (quantity <= 0) return;
+	ResourceType type;
+	switch (choice) {
+	case 1: type = FOOD; break;
+	case 2: type = WOOD; break;
+	case 3: type = STONE; break;
+	default: cout << "Invalid choice.\n"; return;
+	}
+	if (initiateSmuggling(smuggler, buyer, type, quantity)) cout << "The smugglers have set out. Payment comes when the goods arrive.\n";
+	else cout << "Not enough resources!\n";
+}
+
+// The price is fixed when the goods leave; the smuggler is paid if they reach the buyer's seat.
+// Smugglers keep off the main roads, so raiders find them half as often.
+bool MarketPlace::initiateSmuggling(Kingdom* smuggler, Kingdom* buyer, ResourceType type, int amount) {
+	if (amount <= 0 || type == GOLD || smuggler == buyer) return false;
+	Resource goods;
+	int* slots[4] = { &goods.gold, &goods.food, &goods.wood, &goods.stone };
+	*slots[type] = amount;
+	if (!smuggler->spendResources(goods)) return false;
+	int payout = (int)min((long long)INT_MAX, (long long)prices[type] * amount * SMUGGLING_MARKUP_PERCENT / 100);
+	if (caravans) caravans->dispatch(smuggler, buyer, goods, true, payout);
+	else smuggler->addGold(payout);
+	return true;
+}
+
+void MarketPlace::saveToFile(ofstream& outFile) {
+	outFile.write((char*)prices, sizeof(prices));
+	int offerCount = tradeOffers.size();
+	outFile.write((char*)&offerCount, sizeof(offerCount));
+	for (int i = 0; i < offerCount; i++) {
+		outFile.write((char*)&tradeOffers[i], sizeof(TradeOffer));
+	}
+}
+
+void MarketPlace::loadFromFile(ifstream& inFile) {
+	inFile.read((char*)prices, sizeof(prices));
+	int offerCount = 0;
+	inFile.read((char*)&offerCount, sizeof(offerCount));
+	tradeOffers.resize(offerCount);
+	for (int i = 0; i < tradeOffers.size(); i++) {
+		inFile.read((char*)&tradeOffers[i], sizeof(TradeOffer));
+		nextOfferId = max(nextOfferId, tradeOffers[i].id + 1);
+	}
+	changes.clear();
+}
+
+// CommunicationSystem class implementation
+CommunicationSystem::CommunicationSystem() : nextMessageId(1), events(nullptr) {}
+
+void CommunicationSystem::attachScheduler(EventScheduler* scheduler) { events = scheduler; }
+
+void CommunicationSystem::takeChanges(vector<Change>& out) {
+	out.insert(out.end(), changes.begin(), changes.end());
+	changes.clear();
+}
+
+bool CommunicationSystem::expireMessage(int id) {
+	for (int i = 0; i < messages.size(); i++) {
+		if (messages[i].id != id) continue;
+		messages.removeAt(i);
+		noteChange(changes, CHANGE_MESSAGE, id, 1);
+		return true;
+	}
+	return false;
+}
+
+void CommunicationSystem::sendMessage(const char* sender, const char* receiver, const char* content) {
+	if (messages.full()) return;
+	Message& msg = messages.append();
+	strcpy_s(msg.sender, sender);
+	strcpy_s(msg.receiver, receiver);
+	strncpy_s(msg.content, content, MAX_MESSAGE_LENGTH - 1);
+	msg.content[MAX_MESSAGE_LENGTH - 1] = '\0';
+	msg.read = false;
+	msg.id = nextMessageId++;
+	if (events) events->schedule(MESSAGE_LIFETIME_TURNS, EVENT_MESSAGE_EXPIRY, msg.id, 0);
+	noteChange(changes, CHANGE_MESSAGE, msg.id, 0);
+}
+void CommunicationSystem::showMessages(const char* kingdomName) {
+	bool found = false;
+	cout << "Messages for " << kingdomName << ":\n";
+	for (int i = 0; i < messages.size(); i++) {
+		if (strcmp(messages[i].receiver, kingdomName) == 0) {
+			found = true;
+			cout << (messages[i].read ? "[Read] " : "[Unread] ") << "From " << messages[i].sender << ": " << messages[i].content << endl;
+			if (!messages[i].read) noteChange(changes, CHANGE_MESSAGE, messages[i].id, 0);
+			messages[i].read = true; // Now allowed without const
+		}
+	}
+	if (!found) cout << "No messages.\n";
+}
+
+void CommunicationSystem::sendNewMessage(Kingdom* sender) {
+	cout << "Enter recipient kingdom name: ";
+	char receiver[MAX_NAME_LENGTH];
+	cin.ignore();
+	cin.getline(receiver, MAX_NAME_LENGTH);
+	cout << "Enter message (max " << MAX_MESSAGE_LENGTH << " chars): ";
+	char content[MAX_MESSAGE_LENGTH];
+	cin.getline(content, MAX_MESSAGE_LENGTH);
+	sendMessage(sender->getName(), receiver, content);
+	cout << "Message sent!\n";
+}
+
+void CommunicationSystem::saveToFile(ofstream& outFile) {
+	int messageCount = messages.size();
+	outFile.write((char*)&messageCount, sizeof(messageCount));
+	for (int i = 0; i < messageCount; i++) {
+		outFile.write((char*)&messages[i], sizeof(Message));
 	}
 }
 
 void CommunicationSystem::loadFromFile(ifstream& inFile) {
+	int messageCount = 0;
 	inFile.read((char*)&messageCount, sizeof(messageCount));
-	for (int i = 0; i < messageCount; i++) {
+	messages.resize(messageCount);
+	for (int i = 0; i < messages.size(); i++) {
 		inFile.read((char*)&messages[i], sizeof(Message));
+		nextMessageId = max(nextMessageId, messages[i].id + 1);
+	}
+	changes.clear();
+}
+
+// MetricsHistory class implementation
+static const char* metricNames[METRIC_COUNT] = { "gold", "food", "wood", "stone", "population", "happiness", "attack",
+	"defense", "territory" };
+
+MetricsHistory::MetricsHistory() {
+	clear();
+}
+
+void MetricsHistory::clear() {
+	sealed.clear();
+	sealedBytes = 0;
+	openFirstTurn = 0;
+	openTurns = 0;
+	openKingdoms = 0;
+}
+
+// Each column starts from zero and stores differences, which stay within a byte or two from turn to turn
+void MetricsHistory::seal() {
+	Chunk chunk;
+	chunk.firstTurn = openFirstTurn;
+	chunk.kingdomCount = openKingdoms;
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		for (int k = 0; k < openKingdoms; k++) {
+			chunk.offsets.push_back((int)chunk.data.size());
+			int previous = 0;
+			for (int t = 0; t < HISTORY_CHUNK_TURNS; t++) {
+				int delta = open[m][k][t] - previous;
+				previous = open[m][k][t];
+				unsigned int zigzag = ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+				while (zigzag >= 0x80) {
+					chunk.data.push_back((unsigned char)(zigzag | 0x80));
+					zigzag >>= 7;
+				}
+				chunk.data.push_back((unsigned char)zigzag);
+			}
+		}
+	}
+	chunk.offsets.push_back((int)chunk.data.size());
+	chunk.data.shrink_to_fit();
+	sealedBytes += chunk.data.size() + chunk.offsets.size() * sizeof(int);
+	sealed.push_back(move(chunk));
+	while (sealedBytes > (size_t)HISTORY_MAX_BYTES && sealed.size() > 1) {
+		sealedBytes -= sealed.front().data.size() + sealed.front().offsets.size() * sizeof(int);
+		sealed.pop_front();
+	}
+	openFirstTurn += HISTORY_CHUNK_TURNS;
+	openTurns = 0;
+}
+
+void MetricsHistory::decodeColumn(const Chunk& chunk, int column, int* values) {
+	const unsigned char* p = chunk.data.data() + chunk.offsets[column];
+	int previous = 0;
+	for (int t = 0; t < HISTORY_CHUNK_TURNS; t++) {
+		unsigned int zigzag = 0;
+		int shift = 0;
+		while (*p & 0x80) {
+			zigzag |= (unsigned int)(*p++ & 0x7F) << shift;
+			shift += 7;
+		}
+		zigzag |= (unsigned int)*p++ << shift;
+		previous += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+		values[t] = previous;
+	}
+}
+
+void MetricsHistory::record(int turn, Kingdom* const kingdoms[], int kingdomCount, const Map& map) {
+	bool empty = getFirstTurn() < 0;
+	if (!empty && (turn != getLastTurn() + 1 || kingdomCount != openKingdoms)) {
+		clear();
+		empty = true;
+	}
+	if (empty) {
+		openFirstTurn = turn;
+		openKingdoms = kingdomCount;
+	}
+	for (int k = 0; k < kingdomCount; k++) {
+		const Kingdom* kingdom = kingdoms[k];
+		open[METRIC_GOLD][k][openTurns] = kingdom->getGold();
+		open[METRIC_FOOD][k][openTurns] = kingdom->getFood();
+		open[METRIC_WOOD][k][openTurns] = kingdom->getWood();
+		open[METRIC_STONE][k][openTurns] = kingdom->getStone();
+		open[METRIC_POPULATION][k][openTurns] = kingdom->getPopulation();
+		open[METRIC_HAPPINESS][k][openTurns] = kingdom->getHappiness();
+		open[METRIC_ATTACK][k][openTurns] = kingdom->getMilitary().calculateAttackPower();
+		open[METRIC_DEFENSE][k][openTurns] = kingdom->getMilitary().calculateDefensePower();
+		open[METRIC_TERRITORY][k][openTurns] = map.getOwnedTiles(k);
+	}
+	if (++openTurns == HISTORY_CHUNK_TURNS) seal();
+}
+
+int MetricsHistory::getFirstTurn() const {
+	if (!sealed.empty()) return sealed.front().firstTurn;
+	return openTurns > 0 ? openFirstTurn : -1;
+}
+
+int MetricsHistory::getLastTurn() const {
+	return getFirstTurn() < 0 ? -1 : openFirstTurn + openTurns - 1;
+}
+
+size_t MetricsHistory::getBytesUsed() const {
+	return sizeof(*this) + sealedBytes + sealed.size() * sizeof(Chunk);
+}
+
+int MetricsHistory::query(int kingdom, Metric metric, int fromTurn, int toTurn, vector<int>& values) const {
+	values.clear();
+	int first = getFirstTurn();
+	if (first < 0 || kingdom < 0 || kingdom >= openKingdoms || metric < 0 || metric >= METRIC_COUNT) return -1;
+	fromTurn = max(fromTurn, first);
+	toTurn = min(toTurn, getLastTurn());
+	if (fromTurn > toTurn) return -1;
+	values.reserve(toTurn - fromTurn + 1);
+	int column[HISTORY_CHUNK_TURNS];
+	// Sealed chunks are all full, so the first one needed is found by division
+	for (size_t c = (fromTurn - first) / HISTORY_CHUNK_TURNS; c < sealed.size(); c++) {
+		const Chunk& chunk = sealed[c];
+		if (chunk.firstTurn > toTurn) break;
+		decodeColumn(chunk, metric * chunk.kingdomCount + kingdom, column);
+		int begin = max(fromTurn, chunk.firstTurn) - chunk.firstTurn;
+		int end = min(toTurn, chunk.firstTurn + HISTORY_CHUNK_TURNS - 1) - chunk.firstTurn;
+		values.insert(values.end(), column + begin, column + end + 1);
+	}
+	if (toTurn >= openFirstTurn) {
+		int begin = max(fromTurn, openFirstTurn) - openFirstTurn;
+		values.insert(values.end(), open[metric][kingdom] + begin, open[metric][kingdom] + toTurn - openFirstTurn + 1);
+	}
+	return fromTurn;
+}
+
+const char* MetricsHistory::metricName(Metric metric) {
+	return metric >= 0 && metric < METRIC_COUNT ? metricNames[metric] : "unknown";
+}
+
+bool MetricsHistory::findMetric(const char* name, Metric& metric) {
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		if (strcmp(name, metricNames[m]) == 0) {
+			metric = (Metric)m;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Bar chart of the last turns; when there are more turns than columns, each column shows the mean of its turns
+void MetricsHistory::displayChart(const Kingdom* kingdom, int index, Metric metric, int turns) const {
+	vector<int> values;
+	int first = query(index, metric, getLastTurn() - turns + 1, getLastTurn(), values);
+	cout << "\n" << kingdom->getName() << ": " << metricName(metric);
+	if (first < 0) {
+		cout << " has no history yet.\n";
+		return;
+	}
+	cout << ", turns " << first << "-" << first + (int)values.size() - 1 << "\n";
+	int columns = min((int)values.size(), CHART_WIDTH);
+	vector<long long> means(columns);
+	long long low = 0, high = 0;
+	for (int c = 0; c < columns; c++) {
+		size_t begin = values.size() * c / columns, end = values.size() * (c + 1) / columns;
+		long long sum = 0;
+		for (size_t i = begin; i < end; i++) sum += values[i];
+		means[c] = sum / (long long)(end - begin);
+		if (c == 0 || means[c] < low) low = means[c];
+		if (c == 0 || means[c] > high) high = means[c];
+	}
+	if (low > 0) low = 0;
+	for (int row = CHART_HEIGHT; row >= 1; row--) {
+		long long level = low + (high - low) * (2 * row - 1) / (2 * CHART_HEIGHT);
+		cout << setw(8) << (row == CHART_HEIGHT ? high : row == 1 ? low : level) << " |";
+		for (int c = 0; c < columns; c++) cout << (high > low && means[c] > level ? '#' : ' ');
+		cout << "\n";
+	}
+	cout << setw(8) << "" << " +" << string(columns, '-') << "\n";
+	cout << "Kept: turns " << getFirstTurn() << "-" << getLastTurn() << " in " << getBytesUsed() / 1024 << " KB\n";
+}
+
+void MetricsHistory::exportCSV(ostream& out, Kingdom* const kingdoms[], int kingdomCount) const {
+	out << "turn,kingdom";
+	for (int m = 0; m < METRIC_COUNT; m++) out << "," << metricNames[m];
+	out << "\n";
+	vector<int> decoded(METRIC_COUNT * MAX_KINGDOMS * HISTORY_CHUNK_TURNS);
+	for (size_t c = 0; c <= sealed.size(); c++) {
+		bool openChunk = c == sealed.size();
+		int chunkKingdoms = openChunk ? openKingdoms : sealed[c].kingdomCount;
+		int turns = openChunk ? openTurns : HISTORY_CHUNK_TURNS;
+		int firstTurn = openChunk ? openFirstTurn : sealed[c].firstTurn;
+		for (int m = 0; m < METRIC_COUNT; m++) {
+			for (int k = 0; k < chunkKingdoms; k++) {
+				int* column = &decoded[(m * MAX_KINGDOMS + k) * HISTORY_CHUNK_TURNS];
+				if (openChunk) copy(open[m][k], open[m][k] + turns, column);
+				else decodeColumn(sealed[c], m * chunkKingdoms + k, column);
+			}
+		}
+		for (int t = 0; t < turns; t++) {
+			for (int k = 0; k < chunkKingdoms; k++) {
+				out << firstTurn + t << ",";
+				if (k < kingdomCount) out << kingdoms[k]->getName();
+				else out << k;
+				for (int m = 0; m < METRIC_COUNT; m++) out << "," << decoded[(m * MAX_KINGDOMS + k) * HISTORY_CHUNK_TURNS + t];
+				out << "\n";
+			}
+		}
+	}
+}
+
+void MetricsHistory::saveToFile(ofstream& outFile) {
+	int count = (int)sealed.size();
+	outFile.write((char*)&count, sizeof(count));
+	for (size_t c = 0; c < sealed.size(); c++) {
+		const Chunk& chunk = sealed[c];
+		int size = (int)chunk.data.size();
+		outFile.write((char*)&chunk.firstTurn, sizeof(chunk.firstTurn));
+		outFile.write((char*)&chunk.kingdomCount, sizeof(chunk.kingdomCount));
+		outFile.write((char*)chunk.offsets.data(), chunk.offsets.size() * sizeof(int));
+		outFile.write((char*)&size, sizeof(size));
+		outFile.write((char*)chunk.data.data(), size);
+	}
+	outFile.write((char*)&openFirstTurn, sizeof(openFirstTurn));
+	outFile.write((char*)&openTurns, sizeof(openTurns));
+	outFile.write((char*)&openKingdoms, sizeof(openKingdoms));
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		for (int k = 0; k < openKingdoms; k++) {
+			outFile.write((char*)open[m][k], openTurns * sizeof(int));
+		}
+	}
+}
+
+// The block has no overall length, so once anything in it is damaged nothing after it can be
+// found either: the history is dropped and the stream marked failed, which fails the whole load
+void MetricsHistory::loadFromFile(ifstream& inFile) {
+	clear();
+	int count = 0;
+	inFile.read((char*)&count, sizeof(count));
+	bool damaged = count < 0;
+	for (int c = 0; c < count && inFile && !damaged; c++) {
+		Chunk chunk;
+		int size = 0;
+		inFile.read((char*)&chunk.firstTurn, sizeof(chunk.firstTurn));
+		inFile.read((char*)&chunk.kingdomCount, sizeof(chunk.kingdomCount));
+		if (chunk.kingdomCount < 0 || chunk.kingdomCount > MAX_KINGDOMS) {
+			damaged = true;
+			break;
+		}
+		chunk.offsets.resize(METRIC_COUNT * chunk.kingdomCount + 1);
+		inFile.read((char*)chunk.offsets.data(), chunk.offsets.size() * sizeof(int));
+		inFile.read((char*)&size, sizeof(size));
+		damaged = size < 0 || size > HISTORY_MAX_BYTES || chunk.offsets.front() < 0 || chunk.offsets.back() != size;
+		// Columns are decoded from offsets[i] to offsets[i + 1], so they must never go backwards
+		for (size_t i = 1; i < chunk.offsets.size() && !damaged; i++) damaged = chunk.offsets[i] < chunk.offsets[i - 1];
+		if (damaged) break;
+		chunk.data.resize(size);
+		inFile.read((char*)chunk.data.data(), size);
+		sealedBytes += chunk.data.size() + chunk.offsets.size() * sizeof(int);
+		sealed.push_back(move(chunk));
+	}
+	if (!damaged) {
+		inFile.read((char*)&openFirstTurn, sizeof(openFirstTurn));
+		inFile.read((char*)&openTurns, sizeof(openTurns));
+		inFile.read((char*)&openKingdoms, sizeof(openKingdoms));
+		damaged = openTurns < 0 || openTurns >= HISTORY_CHUNK_TURNS || openKingdoms < 0 || openKingdoms > MAX_KINGDOMS;
+	}
+	for (int m = 0; m < METRIC_COUNT && !damaged; m++) {
+		for (int k = 0; k < openKingdoms; k++) {
+			inFile.read((char*)open[m][k], openTurns * sizeof(int));
+		}
+	}
+	if (damaged || !inFile) {
+		clear();
+		inFile.setstate(ios::failbit);
+	}
+}
+
+// OrderStatisticTree class implementation
+OrderStatisticTree::OrderStatisticTree() : root(-1), seed(2463534242u) {}
+
+void OrderStatisticTree::clear() {
+	nodes.clear();
+	root = -1;
+}
+
+bool OrderStatisticTree::before(int a, int b) const {
+	return nodes[a].score != nodes[b].score ? nodes[a].score > nodes[b].score : a < b;
+}
+
+int OrderStatisticTree::sizeOf(int node) const { return node < 0 ? 0 : nodes[node].size; }
+
+void OrderStatisticTree::pull(int node) {
+	nodes[node].size = 1 + sizeOf(nodes[node].left) + sizeOf(nodes[node].right);
+}
+
+// Every node of left must rank ahead of every node of right
+int OrderStatisticTree::merge(int left, int right) {
+	if (left < 0) return right;
+	if (right < 0) return left;
+	if (nodes[left].priority > nodes[right].priority) {
+		nodes[left].right = merge(nodes[left].right, right);
+		pull(left);
+		return left;
+	}
+	nodes[right].left = merge(left, nodes[right].left);
+	pull(right);
+	return right;
+}
+
+// Left gets the nodes ranking ahead of key, right the rest
+void OrderStatisticTree::split(int node, int key, int& left, int& right) {
+	if (node < 0) {
+		left = right = -1;
+		return;
+	}
+	if (before(node, key)) {
+		split(nodes[node].right, key, nodes[node].right, right);
+		left = node;
+	}
+	else {
+		split(nodes[node].left, key, left, nodes[node].left);
+		right = node;
+	}
+	pull(node);
+}
+
+int OrderStatisticTree::erase(int node, int key) {
+	if (node == key) return merge(nodes[node].left, nodes[node].right);
+	if (before(key, node)) nodes[node].left = erase(nodes[node].left, key);
+	else nodes[node].right = erase(nodes[node].right, key);
+	pull(node);
+	return node;
+}
+
+void OrderStatisticTree::set(int kingdom, int score) {
+	if (kingdom < 0) return;
+	if (kingdom >= (int)nodes.size()) {
+		Node unranked = { 0, 0, -1, -1, 0 };
+		nodes.resize(kingdom + 1, unranked);
+	}
+	if (contains(kingdom)) {
+		if (nodes[kingdom].score == score) return;
+		remove(kingdom);
+	}
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	Node& node = nodes[kingdom];
+	node.score = score;
+	node.priority = seed;
+	node.left = node.right = -1;
+	node.size = 1;
+	int left, right;
+	split(root, kingdom, left, right);
+	root = merge(merge(left, kingdom), right);
+}
+
+void OrderStatisticTree::remove(int kingdom) {
+	if (!contains(kingdom)) return;
+	root = erase(root, kingdom);
+	nodes[kingdom].size = 0;
+}
+
+bool OrderStatisticTree::contains(int kingdom) const {
+	return kingdom >= 0 && kingdom < (int)nodes.size() && nodes[kingdom].size > 0;
+}
+
+int OrderStatisticTree::getScore(int kingdom) const { return contains(kingdom) ? nodes[kingdom].score : 0; }
+
+int OrderStatisticTree::getCount() const { return sizeOf(root); }
+
+int OrderStatisticTree::rankOf(int kingdom) const {
+	if (!contains(kingdom)) return 0;
+	int rank = 0;
+	int node = root;
+	while (node >= 0) {
+		if (node == kingdom) return rank + sizeOf(nodes[node].left) + 1;
+		if (before(kingdom, node)) {
+			node = nodes[node].left;
+		}
+		else {
+			rank += sizeOf(nodes[node].left) + 1;
+			node = nodes[node].right;
+		}
+	}
+	return 0;
+}
+
+int OrderStatisticTree::kingdomAt(int rank) const {
+	if (rank < 1 || rank > getCount()) return -1;
+	int node = root;
+	while (true) {
+		int ahead = sizeOf(nodes[node].left);
+		if (rank <= ahead) {
+			node = nodes[node].left;
+		}
+		else if (rank == ahead + 1) {
+			return node;
+		}
+		else {
+			rank -= ahead + 1;
+			node = nodes[node].right;
+		}
+	}
+}
+
+// Leaderboards class implementation
+static const char* rankingNames[RANK_COUNT] = { "power", "gold", "population", "territory" };
+
+void Leaderboards::clear() {
+	for (int r = 0; r < RANK_COUNT; r++) boards[r].clear();
+}
+
+void Leaderboards::update(int index, const Kingdom& kingdom, unsigned int fields) {
+	if (fields & FIELD_MILITARY) boards[RANK_POWER].set(index, kingdom.getMilitary().calculateAttackPower());
+	if (fields & FIELD_RESOURCES) boards[RANK_GOLD].set(index, kingdom.getGold());
+	if (fields & FIELD_POPULATION) boards[RANK_POPULATION].set(index, kingdom.getPopulation());
+}
+
+void Leaderboards::updateTerritory(int index, int tiles) { boards[RANK_TERRITORY].set(index, tiles); }
+
+void Leaderboards::rebuild(Kingdom* const kingdoms[], int count, const Map& map) {
+	clear();
+	for (int k = 0; k < count; k++) {
+		update(k, *kingdoms[k], ALL_FIELDS);
+		updateTerritory(k, map.getOwnedTiles(k));
+	}
+}
+
+const OrderStatisticTree& Leaderboards::getBoard(Ranking ranking) const { return boards[ranking]; }
+
+const char* Leaderboards::rankingName(Ranking ranking) {
+	return ranking >= 0 && ranking < RANK_COUNT ? rankingNames[ranking] : "unknown";
+}
+
+bool Leaderboards::findRanking(const char* name, Ranking& ranking) {
+	for (int r = 0; r < RANK_COUNT; r++) {
+		if (strcmp(name, rankingNames[r]) == 0) {
+			ranking = (Ranking)r;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Leaderboards::display(Kingdom* const kingdoms[], int viewer, int top) const {
+	for (int r = 0; r < RANK_COUNT; r++) {
+		const OrderStatisticTree& board = boards[r];
+		cout << "\n--- " << rankingNames[r] << " ---\n";
+		for (int place = 1; place <= top && place <= board.getCount(); place++) {
+			int k = board.kingdomAt(place);
+			cout << setw(3) << place << ". " << left << setw(MAX_NAME_LENGTH / 2) << kingdoms[k]->getName() << right
+				<< board.getScore(k) << (k == viewer ? "  <- you" : "") << "\n";
+		}
+		int rank = board.rankOf(viewer);
+		if (rank > top) {
+			cout << "  ...\n" << setw(3) << rank << ". " << left << setw(MAX_NAME_LENGTH / 2) << kingdoms[viewer]->getName() << right
+				<< board.getScore(viewer) << "  <- you\n";
+		}
+	}
+}
+
+// World class implementation
+World::World() : arena(WORLD_ARENA_BLOCK), scratch(SCRATCH_ARENA_BLOCK), journalTurn(0), kingdomCount(0), map(nullptr),
+	market(nullptr), diplomacy(nullptr), comms(nullptr), battles(nullptr), ai(nullptr), armies(nullptr), caravans(nullptr), events(nullptr),
+	history(nullptr), rankings(nullptr) {
+	reset();
+}
+
+// Destroys everything and starts an empty world in the same memory
+void World::reset() {
+	arena.reset();
+	scratch.reset();
+	for (int i = 0; i < MAX_KINGDOMS; i++) kingdoms[i] = nullptr;
+	kingdomCount = 0;
+	map = arena.create<Map>(MAP_SIZE, MAP_SIZE);
+	market = arena.create<MarketPlace>();
+	diplomacy = arena.create<DiplomacyManager>();
+	comms = arena.create<CommunicationSystem>();
+	battles = arena.create<BattleQueue>();
+	ai = arena.create<UtilityAI>();
+	armies = arena.create<ArmyManager>();
+	caravans = arena.create<CaravanManager>();
+	market->attachCaravans(caravans);
+	events = arena.create<EventScheduler>();
+	fog = arena.create<FogOfWar>();
+	map->attachFog(fog);
+	history = arena.create<MetricsHistory>();
+	rankings = arena.create<Leaderboards>();
+	attachScheduler();
+	journal.clear();
+}
+
+Kingdom* World::addKingdom(const char* name) {
+	if (kingdomCount >= MAX_KINGDOMS) return nullptr;
+	Kingdom* kingdom = arena.create<Kingdom>(name);
+	kingdom->attachScheduler(events, kingdomCount);
+	kingdoms[kingdomCount++] = kingdom;
+	return kingdom;
+}
+
+void World::attachScheduler() {
+	for (int i = 0; i < kingdomCount; i++) {
+		kingdoms[i]->attachScheduler(events, i);
+	}
+	diplomacy->attachScheduler(events);
+	market->attachScheduler(events);
+	comms->attachScheduler(events);
+	ai->attachScheduler(events);
+}
+
+Arena& World::getScratch() { return scratch; }
+
+// The player's kingdom plus four AI rivals, each on its own tile
+void World::startNewGame(const char* playerName) {
+	reset();
+	EventLog::setTurn(events->getCurrentTurn());
+	map->setTerrainSeed((unsigned int)rand());
+	Kingdom* player = addKingdom(playerName);
+	int x, y, tries = 0;
+	// Seats go on dry land unless the map has too little of it
+	do {
+		x = rand() % MAP_SIZE;
+		y = rand() % MAP_SIZE;
+	} while (map->getTerrain(x, y) == TERRAIN_WATER && ++tries < 100);
+	map->placeKingdom(player, x, y);
+
+	const char* aiNames[] = { "Northland", "Westeros", "Eastfall", "Southreach" };
+	for (int i = 0; i < 4; i++) {
+		Kingdom* kingdom = addKingdom(aiNames[i]);
+		kingdom->addGold(500 + rand() % 500);
+		kingdom->addFood(300 + rand() % 300);
+		kingdom->addWood(400 + rand() % 200);
+		kingdom->addStone(200 + rand() % 200);
+		kingdom->recruitSoldiers(50 + rand() % 50);
+
+		int kx, ky;
+		tries = 0;
+		do {
+			kx = rand() % MAP_SIZE;
+			ky = rand() % MAP_SIZE;
+		} while (map->isOccupied(kx, ky) || (map->getTerrain(kx, ky) == TERRAIN_WATER && ++tries < 100));
+		map->placeKingdom(kingdom, kx, ky);
+	}
+	rankings->rebuild(kingdoms, kingdomCount, *map);
+	updateVisibility();
+}
+
+void World::updateVisibility() { fog->update(kingdoms, kingdomCount, armies->getArmies()); }
+
+void World::beginTurn() {
+	scratch.reset();
+	EventLog::setTurn(events->getCurrentTurn());
+}
+
+// A turn with nobody at the menus: the AI plays every kingdom not marked as human controlled
+void World::playTurn(int aiBudgetMicros) {
+	beginTurn();
+	ai->takeTurns(*this, 0, aiBudgetMicros);
+	resolveBattles();
+	endTurn();
+}
+
+void World::resolveBattles() {
+	armies->advanceArmies(kingdoms, *map, *battles);
+	battles->resolve(kingdoms, kingdomCount, scratch);
+	armies->returnSurvivors(kingdoms);
+	updateVisibility();
+}
+
+// Moves the caravans, runs every kingdom's economy and spreads influence, then moves to the next
+// turn and applies whatever comes due in it
+void World::endTurn() {
+	caravans->advance(kingdoms, kingdomCount, *map, *diplomacy);
+	for (int i = 0; i < kingdomCount; i++) {
+		kingdoms[i]->processTurn(*map);
+	}
+	map->updateInfluence(kingdoms, kingdomCount);
+	updateVisibility();
+
+	events->advance(dueEvents);
+	EventLog::setTurn(events->getCurrentTurn());
+	Kingdom* player = kingdoms[0];
+	for (size_t i = 0; i < dueEvents.size(); i++) {
+		const GameEvent& event = dueEvents[i];
+		switch (event.type) {
+		case EVENT_TREATY_EXPIRY: {
+			const Treaty* treaty = diplomacy->expireTreaty(event.subject);
+			if (treaty && (strcmp(treaty->kingdom1, player->getName()) == 0 || strcmp(treaty->kingdom2, player->getName()) == 0)) {
+				char content[MAX_MESSAGE_LENGTH];
+				snprintf(content, sizeof(content), "Our treaty with %s has expired.",
+					strcmp(treaty->kingdom1, player->getName()) == 0 ? treaty->kingdom2 : treaty->kingdom1);
+				comms->sendMessage("Royal Court", player->getName(), content);
+			}
+			break;
+		}
+		case EVENT_OFFER_EXPIRY: market->expireOffer(event.subject); break;
+		case EVENT_MESSAGE_EXPIRY: comms->expireMessage(event.subject); break;
+		case EVENT_CONSTRUCTION:
+			if (event.subject >= kingdomCount) break;
+			kingdoms[event.subject]->completeStructure((ResourceType)event.detail);
+			if (event.subject == 0) comms->sendMessage("Royal Court", player->getName(), "Construction has finished.");
+			break;
+		case EVENT_RESEARCH:
+			if (event.subject >= kingdomCount) break;
+			kingdoms[event.subject]->completeResearch((ResourceType)event.detail);
+			if (event.subject == 0) comms->sendMessage("Royal Court", player->getName(), "Our scholars have completed their research.");
+			break;
+		case EVENT_AI_WAKEUP: ai->wake(event.subject); break;
+		}
+	}
+	history->record(events->getCurrentTurn(), kingdoms, kingdomCount, *map);
+	collectChanges();
+}
+
+// Drains every dirty flag into the journal. The record lists may note one id several times in a
+// turn; only the last note for each is kept.
+void World::collectChanges() {
+	journal.clear();
+	journalTurn = events->getCurrentTurn();
+	for (int k = 0; k < kingdomCount; k++) {
+		unsigned int fields = kingdoms[k]->takeChangedFields();
+		if (!fields) continue;
+		Change change = { CHANGE_KINGDOM, k, (int)fields };
+		journal.push_back(change);
+		rankings->update(k, *kingdoms[k], fields);
+	}
+	map->takeTileChanges(journal);
+	rankTerritories();
+	size_t records = journal.size();
+	diplomacy->takeChanges(journal);
+	market->takeChanges(journal);
+	comms->takeChanges(journal);
+	stable_sort(journal.begin() + records, journal.end(), [](const Change& a, const Change& b) {
+		return a.kind != b.kind ? a.kind < b.kind : a.subject < b.subject;
+	});
+	size_t kept = records;
+	for (size_t i = records; i < journal.size(); i++) {
+		bool superseded = i + 1 < journal.size() && journal[i + 1].kind == journal[i].kind && journal[i + 1].subject == journal[i].subject;
+		if (!superseded) journal[kept++] = journal[i];
+	}
+	journal.resize(kept);
+}
+
+void World::rankTerritories() {
+	changedTerritories.clear();
+	map->takeTerritoryChanges(changedTerritories);
+	for (size_t i = 0; i < changedTerritories.size(); i++) {
+		int k = changedTerritories[i];
+		if (k < kingdomCount) rankings->updateTerritory(k, map->getOwnedTiles(k));
+	}
+}
+
+const vector<Change>& World::getChanges() const { return journal; }
+
+int World::countChanges(ChangeKind kind) const {
+	int count = 0;
+	for (size_t i = 0; i < journal.size(); i++) {
+		if (journal[i].kind == kind) count++;
+	}
+	return count;
+}
+
+void World::displayChanges(int kingdom) const {
+	if (journal.empty()) return;
+	static const char* fieldNames[] = { "resources", "population", "military", "technology", "buildings", "position" };
+	unsigned int fields = 0;
+	int tiles = 0, held = 0;
+	for (size_t i = 0; i < journal.size(); i++) {
+		const Change& change = journal[i];
+		if (change.kind == CHANGE_KINGDOM && change.subject == kingdom) fields = change.detail;
+		if (change.kind != CHANGE_TILE) continue;
+		tiles++;
+		if (change.detail == kingdom) held++;
+	}
+	cout << "Last turn:";
+	const char* separator = " ";
+	for (int f = 0; f < 6; f++) {
+		if (!(fields & (1 << f))) continue;
+		cout << separator << fieldNames[f];
+		separator = ", ";
+	}
+	if (fields) cout << " changed;";
+	cout << " " << tiles << " map tiles changed (" << held << " now ours), " << countChanges(CHANGE_TREATY) << " treaties, "
+		<< countChanges(CHANGE_OFFER) << " trade offers and " << countChanges(CHANGE_MESSAGE) << " messages updated.\n";
+}
+
+void World::saveToFile(ofstream& outFile) {
+	outFile.write((char*)&kingdomCount, sizeof(kingdomCount));
+	for (int i = 0; i < kingdomCount; i++) {
+		kingdoms[i]->saveToFile(outFile);
+	}
+	map->saveToFile(outFile);
+	diplomacy->saveToFile(outFile);
+	market->saveToFile(outFile);
+	comms->saveToFile(outFile);
+	armies->saveToFile(outFile);
+	caravans->saveToFile(outFile);
+	events->saveToFile(outFile);
+	history->saveToFile(outFile);
+	fog->saveToFile(outFile);
+}
+
+void World::loadFromFile(ifstream& inFile) {
+	reset();
+	int count = 0;
+	inFile.read((char*)&count, sizeof(count));
+	for (int i = 0; i < count && i < MAX_KINGDOMS; i++) {
+		kingdoms[kingdomCount] = arena.create<Kingdom>();
+		kingdoms[kingdomCount]->loadFromFile(inFile);
+		kingdomCount++;
+	}
+	map->loadFromFile(inFile);
+	diplomacy->loadFromFile(inFile);
+	market->loadFromFile(inFile);
+	comms->loadFromFile(inFile);
+	armies->loadFromFile(inFile);
+	caravans->loadFromFile(inFile);
+	events->loadFromFile(inFile);
+	history->loadFromFile(inFile);
+	fog->loadFromFile(inFile);
+	attachScheduler();
+	rankings->rebuild(kingdoms, kingdomCount, *map);
+	updateVisibility();
+	EventLog::setTurn(events->getCurrentTurn());
+}
+
+// Only what the last turn changed: dirty kingdoms whole, changed tiles, and any record list with a
+// change. The armies, the caravans and the scheduler change every turn, so they always go.
+void World::saveChanges(ofstream& outFile) {
+	outFile.write((char*)&journalTurn, sizeof(journalTurn));
+	int count = countChanges(CHANGE_KINGDOM);
+	outFile.write((char*)&count, sizeof(count));
+	for (size_t i = 0; i < journal.size(); i++) {
+		if (journal[i].kind != CHANGE_KINGDOM) continue;
+		outFile.write((char*)&journal[i].subject, sizeof(journal[i].subject));
+		kingdoms[journal[i].subject]->saveToFile(outFile);
+	}
+	count = countChanges(CHANGE_TILE);
+	outFile.write((char*)&count, sizeof(count));
+	for (size_t i = 0; i < journal.size(); i++) {
+		if (journal[i].kind == CHANGE_TILE) map->saveTile(outFile, journal[i].subject);
+	}
+	unsigned char lists = (countChanges(CHANGE_TREATY) || countChanges(CHANGE_RELATIONS) ? 1 : 0) |
+		(countChanges(CHANGE_OFFER) || countChanges(CHANGE_PRICES) ? 2 : 0) | (countChanges(CHANGE_MESSAGE) ? 4 : 0);
+	outFile.write((char*)&lists, sizeof(lists));
+	if (lists & 1) diplomacy->saveToFile(outFile);
+	if (lists & 2) market->saveToFile(outFile);
+	if (lists & 4) comms->saveToFile(outFile);
+	armies->saveToFile(outFile);
+	caravans->saveToFile(outFile);
+	events->saveToFile(outFile);
+}
+
+// Applies one block written by saveChanges. False at the end of the file, or when the block is
+// damaged, which leaves the world as far as the block got.
+bool World::loadChanges(ifstream& inFile) {
+	int turn = 0;
+	if (!inFile.read((char*)&turn, sizeof(turn))) return false;
+	int count = 0;
+	inFile.read((char*)&count, sizeof(count));
+	for (int i = 0; i < count && inFile; i++) {
+		int k = -1;
+		inFile.read((char*)&k, sizeof(k));
+		if (k < 0 || k >= kingdomCount) return false;
+		kingdoms[k]->loadFromFile(inFile);
+		rankings->update(k, *kingdoms[k], ALL_FIELDS);
+	}
+	count = 0;
+	inFile.read((char*)&count, sizeof(count));
+	map->loadTiles(inFile, count);
+	rankTerritories();
+	unsigned char lists = 0;
+	inFile.read((char*)&lists, sizeof(lists));
+	if (lists & 1) diplomacy->loadFromFile(inFile);
+	if (lists & 2) market->loadFromFile(inFile);
+	if (lists & 4) comms->loadFromFile(inFile);
+	armies->loadFromFile(inFile);
+	caravans->loadFromFile(inFile);
+	events->loadFromFile(inFile);
+	journalTurn = turn;
+	if (inFile.fail()) return false;
+	history->record(turn, kingdoms, kingdomCount, *map);
+	updateVisibility();
+	return true;
+}
+
+void World::displayAllocatorStats() const {
+	arena.displayStats("World arena");
+	scratch.displayStats("Scratch arena");
+}
+
+// CommandInterpreter class implementation
+static bool structureType(const char* word, ResourceType& type) {
+	if (strcmp(word, "farm") == 0) type = FOOD;
+	else if (strcmp(word, "market") == 0) type = GOLD;
+	else if (strcmp(word, "quarry") == 0) type = STONE;
+	else if (strcmp(word, "sawmill") == 0) type = WOOD;
+	else return false;
+	return true;
+}
+
+static bool technologyType(const char* word, ResourceType& type) {
+	if (strcmp(word, "agriculture") == 0) type = FOOD;
+	else if (strcmp(word, "economy") == 0) type = GOLD;
+	else if (strcmp(word, "construction") == 0) type = WOOD;
+	else if (strcmp(word, "military") == 0) type = STONE;
+	else return false;
+	return true;
+}
+
+static bool goodsType(const char* word, ResourceType& type) {
+	if (strcmp(word, "food") == 0) type = FOOD;
+	else if (strcmp(word, "wood") == 0) type = WOOD;
+	else if (strcmp(word, "stone") == 0) type = STONE;
+	else return false;
+	return true;
+}
+
+static bool treatyType(const char* word, TreatyType& type) {
+	if (strcmp(word, "peace") == 0) type = PEACE;
+	else if (strcmp(word, "alliance") == 0) type = ALLIANCE;
+	else if (strcmp(word, "trade") == 0) type = TRADE;
+	else if (strcmp(word, "non-aggression") == 0) type = NON_AGGRESSION;
+	else return false;
+	return true;
+}
+
+// The whole word must be a number
+static bool parseNumber(const char* word, int& value) {
+	char* end;
+	long parsed = strtol(word, &end, 10);
+	if (end == word || *end != '\0' || parsed < INT_MIN || parsed > INT_MAX) return false;
+	value = (int)parsed;
+	return true;
+}
+
+static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+CommandInterpreter::CommandInterpreter(World& gameWorld, int kingdom, int aiBudget, int turnLimit) : world(gameWorld), self(kingdom),
+	aiBudgetMicros(aiBudget), maxTurns(turnLimit), turnsPlayed(0) {
+}
+
+int CommandInterpreter::getTurnsPlayed() const { return turnsPlayed; }
+
+int CommandInterpreter::splitWords(char* line, char** words, int maxWords) {
+	int count = 0;
+	char* p = line;
+	while (count < maxWords) {
+		while (isBlank(*p)) p++;
+		if (*p == '\0') break;
+		words[count++] = p;
+		if (count == maxWords) {
+			char* end = p + strlen(p);
+			while (end > p && isBlank(end[-1])) end--;
+			*end = '\0';
+			break;
+		}
+		while (*p && !isBlank(*p)) p++;
+		if (*p) *p++ = '\0';
+	}
+	return count;
+}
+
+int CommandInterpreter::findKingdom(const char* name) const {
+	for (int k = 0; k < world.kingdomCount; k++) {
+		if (k != self && sameName(world.kingdoms[k]->getName(), name)) return k;
+	}
+	return -1;
+}
+
+bool CommandInterpreter::execute(char* line, string& reply) {
+	char* words[4];
+	int count = splitWords(line, words, 2);
+	if (count == 0) return true;
+	// The command picks its word count; only the last word may contain spaces
+	if (count > 1) count = splitWords(words[1], words + 1, 3) + 1;
+	const char* command = words[0];
+	Kingdom* kingdom = world.kingdoms[self];
+	Military& military = kingdom->getMilitary();
+	int number = 0, target = count > 1 ? findKingdom(words[1]) : -1;
+	char text[256];
+	ResourceType type;
+	TreatyType treaty;
+	if (strcmp(command, "status") == 0) {
+		snprintf(text, sizeof(text), "turn %d gold %d food %d wood %d stone %d population %d happiness %d army %d buildings %d\n",
+			world.events->getCurrentTurn(), kingdom->getGold(), kingdom->getFood(), kingdom->getWood(), kingdom->getStone(),
+			kingdom->getPopulation(), kingdom->getHappiness(), military.getTotalUnits(), kingdom->getBuildingCount());
+		reply += text;
+	}
+	else if (strcmp(command, "build") == 0) {
+		if (count < 2 || !structureType(words[1], type)) reply += "error usage: build farm|market|quarry|sawmill\n";
+		else reply += kingdom->buildStructure(type) ? "ok\n" : "error not enough resources\n";
+	}
+	else if (strcmp(command, "upgrade") == 0) {
+		if (count < 2 || !parseNumber(words[1], number)) reply += "error usage: upgrade <building number>\n";
+		else if (number < 1 || number > kingdom->getBuildingCount()) reply += "error no such building\n";
+		else reply += kingdom->upgradeBuilding(number - 1) ? "ok\n" : "error not enough resources\n";
+	}
+	else if (strcmp(command, "recruit") == 0) {
+		bool recruited = count > 1 && parseNumber(words[1], number) && kingdom->recruitSoldiers(number);
+		reply += recruited ? "ok\n" : "error not enough resources\n";
+	}
+	else if (strcmp(command, "train") == 0) {
+		int unit = count > 1 ? UnitCatalog::shared().findType(words[1]) : -1;
+		if (count < 3 || unit < 0 || !parseNumber(words[2], number)) reply += "error usage: train <unit> <amount>\n";
+		else reply += kingdom->trainTroops(unit, number) ? "ok\n" : "error not enough gold\n";
+	}
+	else if (strcmp(command, "research") == 0) {
+		if (count < 2 || !technologyType(words[1], type)) reply += "error usage: research agriculture|economy|construction|military\n";
+		else reply += kingdom->researchTechnology(type) ? "ok\n" : "error not enough research points\n";
+	}
+	else if (strcmp(command, "history") == 0) {
+		Metric metric;
+		number = 10;
+		if (count < 2 || !MetricsHistory::findMetric(words[1], metric) || (count > 2 && (!parseNumber(words[2], number) || number < 1))) {
+			reply += "error usage: history gold|food|wood|stone|population|happiness|attack|defense|territory [turns]\n";
+			return true;
+		}
+		vector<int> values;
+		int last = world.history->getLastTurn();
+		int first = world.history->query(self, metric, last - number + 1, last, values);
+		if (first < 0) {
+			reply += "error no history yet\n";
+			return true;
+		}
+		snprintf(text, sizeof(text), "history %s from %d:", MetricsHistory::metricName(metric), first);
+		reply += text;
+		for (size_t i = 0; i < values.size(); i++) {
+			snprintf(text, sizeof(text), " %d", values[i]);
+			reply += text;
+		}
+		reply += "\n";
+	}
+	else if (strcmp(command, "rankings") == 0) {
+		Ranking ranking;
+		number = LEADERBOARD_TOP;
+		if (count < 2 || !Leaderboards::findRanking(words[1], ranking) || (count > 2 && (!parseNumber(words[2], number) || number < 1))) {
+			reply += "error usage: rankings power|gold|population|territory [places]\n";
+			return true;
+		}
+		// The boards follow the journal; this turn's own changes are not in it yet
+		world.rankings->update(self, *kingdom, ALL_FIELDS);
+		const OrderStatisticTree& board = world.rankings->getBoard(ranking);
+		snprintf(text, sizeof(text), "%s rank %d of %d", Leaderboards::rankingName(ranking), board.rankOf(self), board.getCount());
+		reply += text;
+		for (int place = 1; place <= number && place <= board.getCount(); place++) {
+			int k = board.kingdomAt(place);
+			snprintf(text, sizeof(text), "; %d %s %d", place, world.kingdoms[k]->getName(), board.getScore(k));
+			reply += text;
+		}
+		reply += "\n";
+	}
+	else if (strcmp(command, "tax") == 0) {
+		kingdom->collectTaxes(*world.map);
+		reply += "ok\n";
+	}
+	else if (strcmp(command, "fortify") == 0) {
+		int before = military.getTotalUnits();
+		kingdom->fortify();
+		reply += military.getTotalUnits() > before ? "ok\n" : "error not enough resources\n";
+	}
+	else if (strcmp(command, "expand") == 0) {
+		world.map->expandTerritory(kingdom);
+		reply += "ok\n";
+	}
+	else if (strcmp(command, "attack") == 0 || strcmp(command, "war") == 0) {
+		if (count < 2) reply += strcmp(command, "war") == 0 ? "error usage: war <kingdom>\n" : "error usage: attack <kingdom>\n";
+		else if (target < 0) reply += "error no such kingdom\n";
+		else if (strcmp(command, "war") == 0) {
+			world.diplomacy->declareWar(world.kingdoms, self, target);
+			reply += "ok\n";
+		}
+		else {
+			reply += world.map->launchAttack(kingdom, world.kingdoms[target], *world.battles) ? "ok\n" : "error cannot attack\n";
+		}
+	}
+	else if (strcmp(command, "march") == 0) {
+		if (count < 3 || !parseNumber(words[2], number) || number < 1 || number > 100) reply += "error usage: march <kingdom> <percent>\n";
+		else if (target < 0) reply += "error no such kingdom\n";
+		else reply += world.armies->dispatchArmy(world.kingdoms, self, target, number) ? "ok\n" : "error no troops to send\n";
+	}
+	else if (strcmp(command, "smuggle") == 0) {
+		if (count < 4 || !goodsType(words[2], type) || !parseNumber(words[3], number) || number < 1) {
+			reply += "error usage: smuggle <kingdom> food|wood|stone <amount>\n";
+		}
+		else if (target < 0) reply += "error no such kingdom\n";
+		else reply += world.market->initiateSmuggling(kingdom, world.kingdoms[target], type, number) ? "ok\n" : "error not enough resources\n";
+	}
+	else if (strcmp(command, "caravans") == 0) {
+		snprintf(text, sizeof(text), "caravans %d of %d routes %d\n", world.caravans->getCaravanCount(self),
+			world.caravans->getCaravanCount(), world.caravans->getRouteCount());
+		reply += text;
+	}
+	else if (strcmp(command, "treaty") == 0) {
+		if (count < 4 || !treatyType(words[2], treaty) || !parseNumber(words[3], number) || number < 1 || number > MAX_TREATY_TURNS) {
+			snprintf(text, sizeof(text), "error usage: treaty <kingdom> peace|alliance|trade|non-aggression <turns, 1 to %d>\n", MAX_TREATY_TURNS);
+			reply += text;
+		}
+		else if (target < 0) reply += "error no such kingdom\n";
+		else reply += world.diplomacy->proposeTreaty(kingdom, world.kingdoms[target], treaty, number) ? "ok\n" : "error treaty refused\n";
+	}
+	else if (strcmp(command, "message") == 0) {
+		if (count < 3) reply += "error usage: message <kingdom> <text>\n";
+		else if (target < 0) reply += "error no such kingdom\n";
+		else {
+			// The text was split into words; join them back up
+			for (int w = 3; w < count; w++) words[w][-1] = ' ';
+			world.comms->sendMessage(kingdom->getName(), world.kingdoms[target]->getName(), words[2]);
+			reply += "ok\n";
+		}
+	}
+	else if (strcmp(command, "end-turn") == 0 || strcmp(command, "end") == 0) {
+		number = 1;
+		if (count > 1 && (!parseNumber(words[1], number) || number < 1)) {
+			reply += "error usage: end-turn [turns]\n";
+			return true;
+		}
+		if (number > maxTurns) {
+			snprintf(text, sizeof(text), "error too many turns, the limit is %d\n", maxTurns);
+			reply += text;
+			return true;
+		}
+		for (int t = 0; t < number && kingdom->getPopulation() > 0; t++) {
+			world.playTurn(aiBudgetMicros);
+			turnsPlayed++;
+		}
+		snprintf(text, sizeof(text), "turn %d%s\n", world.events->getCurrentTurn(), kingdom->getPopulation() <= 0 ? " fallen" : "");
+		reply += text;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+#ifndef _WIN32
+// LatencyHistogram class implementation
+LatencyHistogram::LatencyHistogram() {
+	for (int b = 0; b < LATENCY_BUCKETS; b++) buckets[b] = 0;
+}
+
+void LatencyHistogram::record(long long micros) {
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && (1LL << bucket) <= micros) bucket++;
+	buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+unsigned long long LatencyHistogram::count() const {
+	unsigned long long total = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) total += buckets[b].load(memory_order_relaxed);
+	return total;
+}
+
+long long LatencyHistogram::percentile(double fraction) const {
+	unsigned long long counts[LATENCY_BUCKETS];
+	unsigned long long total = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		counts[b] = buckets[b].load(memory_order_relaxed);
+		total += counts[b];
+	}
+	if (total == 0) return 0;
+	unsigned long long target = (unsigned long long)ceil(total * fraction);
+	unsigned long long seen = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		seen += counts[b];
+		if (seen >= target) return 1LL << b;
+	}
+	return 1LL << (LATENCY_BUCKETS - 1);
+}
+
+ShardStats::ShardStats() : games(0), clients(0) {}
+
+// EventPoller class implementation
+EventPoller::EventPoller() : epollFd(-1) {
+#ifdef __linux__
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+EventPoller::~EventPoller() {
+	if (epollFd >= 0) close(epollFd);
+}
+
+void EventPoller::add(int fd) {
+#ifdef __linux__
+	if (epollFd >= 0) {
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+		return;
+	}
+#endif
+	fds.push_back(fd);
+	writeWanted.push_back(0);
+}
+
+void EventPoller::setWritable(int fd, bool wanted) {
+#ifdef __linux__
+	if (epollFd >= 0) {
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = wanted ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		event.data.fd = fd;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < fds.size(); i++) {
+		if (fds[i] == fd) writeWanted[i] = wanted ? 1 : 0;
+	}
+}
+
+void EventPoller::remove(int fd) {
+#ifdef __linux__
+	if (epollFd >= 0) {
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < fds.size(); i++) {
+		if (fds[i] != fd) continue;
+		fds[i] = fds.back();
+		writeWanted[i] = writeWanted.back();
+		fds.pop_back();
+		writeWanted.pop_back();
+		return;
+	}
+}
+
+int EventPoller::wait(int timeoutMillis, vector<PollEvent>& events) {
+	events.clear();
+#ifdef __linux__
+	if (epollFd >= 0) {
+		epoll_event ready[256];
+		int count = epoll_wait(epollFd, ready, 256, timeoutMillis);
+		for (int i = 0; i < count; i++) {
+			PollEvent event;
+			event.fd = ready[i].data.fd;
+			event.readable = (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+			event.writable = (ready[i].events & EPOLLOUT) != 0;
+			events.push_back(event);
+		}
+		return count;
+	}
+#endif
+	vector<pollfd> polled(fds.size());
+	for (size_t i = 0; i < fds.size(); i++) {
+		polled[i].fd = fds[i];
+		polled[i].events = writeWanted[i] ? POLLIN | POLLOUT : POLLIN;
+		polled[i].revents = 0;
+	}
+	int count = poll(polled.data(), polled.size(), timeoutMillis);
+	for (size_t i = 0; count > 0 && i < polled.size(); i++) {
+		if (!polled[i].revents) continue;
+		PollEvent event;
+		event.fd = polled[i].fd;
+		event.readable = (polled[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+		event.writable = (polled[i].revents & POLLOUT) != 0;
+		events.push_back(event);
+	}
+	return count;
+}
+
+// WireWriter class implementation
+WireWriter::WireWriter(string& out, unsigned char type) : buffer(out), start(out.size()) {
+	buffer.append(2, '\0');
+	buffer.push_back((char)type);
+}
+
+void WireWriter::u8(int value) { buffer.push_back((char)(value & 0xFF)); }
+
+void WireWriter::i32(int value) {
+	unsigned int bits = (unsigned int)value;
+	for (int b = 0; b < 4; b++) buffer.push_back((char)((bits >> (8 * b)) & 0xFF));
+}
+
+void WireWriter::text(const char* value) {
+	int length = min((int)strlen(value), 255);
+	u8(length);
+	buffer.append(value, length);
+}
+
+void WireWriter::finish() {
+	size_t length = buffer.size() - start - WIRE_HEADER_SIZE;
+	buffer[start] = (char)(length & 0xFF);
+	buffer[start + 1] = (char)((length >> 8) & 0xFF);
+}
+
+// WireReader class implementation
+WireReader::WireReader(const char* payload, int length) : data((const unsigned char*)payload), size(length),
+	position(0), valid(true) {
+}
+
+int WireReader::u8() {
+	if (position + 1 > size) {
+		valid = false;
+		return 0;
+	}
+	return data[position++];
+}
+
+int WireReader::i32() {
+	if (position + 4 > size) {
+		valid = false;
+		return 0;
+	}
+	unsigned int bits = data[position] | (data[position + 1] << 8) | (data[position + 2] << 16) | ((unsigned int)data[position + 3] << 24);
+	position += 4;
+	return (int)bits;
+}
+
+void WireReader::text(char* out, int capacity) {
+	int length = u8();
+	if (position + length > size) {
+		valid = false;
+		length = 0;
+	}
+	int copied = min(length, capacity - 1);
+	memcpy(out, data + position, copied);
+	out[copied] = '\0';
+	position += length;
+}
+
+bool WireReader::ok() const { return valid; }
+
+int WireReader::frameSize(const char* data, size_t available) {
+	if (available < (size_t)WIRE_HEADER_SIZE) return 0;
+	int length = (unsigned char)data[0] | ((unsigned char)data[1] << 8);
+	if (length > WIRE_MAX_PAYLOAD) return -1;
+	if (available < (size_t)(WIRE_HEADER_SIZE + length)) return 0;
+	return WIRE_HEADER_SIZE + length;
+}
+
+static void setNonBlocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK); }
+
+int openSocket(const string& address, bool listening) {
+	size_t colon = address.rfind(':');
+	if (colon == string::npos) {
+		sockaddr_un unixAddress;
+		memset(&unixAddress, 0, sizeof(unixAddress));
+		unixAddress.sun_family = AF_UNIX;
+		strncpy(unixAddress.sun_path, address.c_str(), sizeof(unixAddress.sun_path) - 1);
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) return -1;
+		if (listening) unlink(address.c_str());
+		int result = listening ? ::bind(fd, (sockaddr*)&unixAddress, sizeof(unixAddress))
+			: connect(fd, (sockaddr*)&unixAddress, sizeof(unixAddress));
+		if (result < 0 || (listening && listen(fd, 512) < 0)) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	string host = address.substr(0, colon);
+	string port = address.substr(colon + 1);
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	addrinfo* found = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+	int fd = -1;
+	for (addrinfo* entry = found; entry && fd < 0; entry = entry->ai_next) {
+		fd = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+		if (fd < 0) continue;
+		int on = 1;
+		if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		else setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		int result = listening ? ::bind(fd, entry->ai_addr, entry->ai_addrlen) : connect(fd, entry->ai_addr, entry->ai_addrlen);
+		if (result < 0 || (listening && listen(fd, 512) < 0)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	return fd;
+}
+
+// GameServer class implementation
+static void signalFd(int fd) {
+	char byte = 1;
+	ssize_t written = write(fd, &byte, 1);
+	(void)written; // A full pipe already has a wakeup pending
+}
+
+static void wireError(string& out, int status) {
+	WireWriter frame(out, FRAME_ERROR);
+	frame.u8(status);
+	frame.finish();
+}
+
+GameServer::GameServer(const char* listenAddress, int shardCount) : address(listenAddress), listenFd(-1), stopping(false),
+	nextShard(0) {
+	stopFds[0] = stopFds[1] = -1;
+	if (pipe(stopFds) == 0) {
+		setNonBlocking(stopFds[0]);
+		setNonBlocking(stopFds[1]);
+	}
+	for (int i = 0; i < max(1, shardCount); i++) {
+		shards.push_back(unique_ptr<Shard>(new Shard()));
+		Shard& shard = *shards.back();
+		shard.wakeFds[0] = shard.wakeFds[1] = -1;
+		if (pipe(shard.wakeFds) == 0) {
+			setNonBlocking(shard.wakeFds[0]);
+			setNonBlocking(shard.wakeFds[1]);
+		}
+	}
+}
+
+GameServer::~GameServer() {
+	for (size_t i = 0; i < shards.size(); i++) {
+		Shard& shard = *shards[i];
+		if (shard.worker.joinable()) {
+			stopping = true;
+			signalFd(shard.wakeFds[1]);
+			shard.worker.join();
+		}
+		close(shard.wakeFds[0]);
+		close(shard.wakeFds[1]);
+	}
+	close(stopFds[0]);
+	close(stopFds[1]);
+}
+
+bool GameServer::run() {
+	listenFd = openSocket(address, true);
+	if (listenFd < 0) {
+		cerr << "Cannot listen on " << address << ": " << strerror(errno) << endl;
+		return false;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	// Game code reports to the console, which hosted games do not have
+	cout.setstate(ios::failbit);
+	unsigned int cores = max(1u, thread::hardware_concurrency());
+	for (size_t i = 0; i < shards.size(); i++) {
+		shards[i]->worker = thread(&GameServer::shardLoop, this, (int)i);
+#ifdef __linux__
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(i % cores, &cpus);
+		pthread_setaffinity_np(shards[i]->worker.native_handle(), sizeof(cpus), &cpus);
+#endif
+	}
+
+	while (!stopping) {
+		pollfd fds[2] = { { listenFd, POLLIN, 0 }, { stopFds[0], POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents) break;
+		if (!(fds[0].revents & POLLIN)) continue;
+		int fd = accept(listenFd, nullptr, nullptr);
+		if (fd < 0) continue;
+		setNonBlocking(fd);
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Fails harmlessly on Unix sockets
+		Connection connection;
+		connection.fd = fd;
+		connection.gameId = -1;
+		connection.seat = -1;
+		connection.pending = 0;
+		connection.binary = false;
+		connection.closing = false;
+		connection.outputSent = 0;
+		handOver(nextShard++ % (int)shards.size(), connection);
+	}
+
+	stopping = true;
+	for (size_t i = 0; i < shards.size(); i++) {
+		signalFd(shards[i]->wakeFds[1]);
+		shards[i]->worker.join();
+	}
+	close(listenFd);
+	listenFd = -1;
+	if (address.find(':') == string::npos) unlink(address.c_str());
+	cout.clear();
+	return true;
+}
+
+void GameServer::stop() {
+	stopping = true;
+	signalFd(stopFds[1]);
+}
+
+void GameServer::handOver(int index, Connection& connection) {
+	Shard& shard = *shards[index];
+	{
+		lock_guard<mutex> guard(shard.mailboxLock);
+		shard.mailbox.push_back(move(connection));
+	}
+	signalFd(shard.wakeFds[1]);
+}
+
+GameServer::HostedGame* GameServer::findGame(int index, int gameId) {
+	if (gameId < 0 || gameId % (int)shards.size() != index) return nullptr;
+	size_t slot = gameId / shards.size();
+	vector<unique_ptr<HostedGame>>& games = shards[index]->games;
+	return slot < games.size() ? games[slot].get() : nullptr;
+}
+
+// Only the shard that owns a connection touches it, so none of this is locked
+void GameServer::shardLoop(int index) {
+	ThreadPool::runInline(true);
+	Shard& shard = *shards[index];
+	shard.poller.add(shard.wakeFds[0]);
+	vector<PollEvent> events;
+	vector<Connection> arrivals;
+	while (!stopping) {
+		// Idle shards sleep until a client or another shard has something for them
+		bool idle = shard.ready.empty() && shard.dirty.empty();
+		if (shard.poller.wait(idle ? -1 : 0, events) < 0 && errno != EINTR) break;
+		for (size_t i = 0; i < events.size(); i++) {
+			const PollEvent& event = events[i];
+			if (event.fd == shard.wakeFds[0]) {
+				char drain[64];
+				while (read(shard.wakeFds[0], drain, sizeof(drain)) > 0) {}
+				continue;
+			}
+			map<int, Connection>::iterator it = shard.connections.find(event.fd);
+			if (it == shard.connections.end()) continue;
+			Connection& connection = it->second;
+			if (event.writable) flush(index, connection);
+			if (!event.readable) continue;
+			// Input that arrived before a hang-up is still answered
+			bool open = readInput(connection);
+			if (!takeInput(index, connection)) {
+				shard.connections.erase(it);
+				shard.stats.clients--;
+			}
+			else if (!open) {
+				connection.closing = true;
+			}
+		}
+
+		{
+			lock_guard<mutex> guard(shard.mailboxLock);
+			arrivals.swap(shard.mailbox);
+		}
+		for (size_t i = 0; i < arrivals.size(); i++) {
+			int fd = arrivals[i].fd;
+			Connection& connection = shard.connections[fd] = move(arrivals[i]);
+			connection.writeWatched = false;
+			connection.dirty = false;
+			shard.poller.add(fd);
+			shard.stats.clients++;
+			// A handed-over connection may already hold the rest of its input
+			if (!takeInput(index, connection)) {
+				shard.connections.erase(fd);
+				shard.stats.clients--;
+			}
+		}
+		arrivals.clear();
+
+		runRound(index);
+
+		// Replies from the whole pass go out together, one send per connection
+		for (size_t i = 0; i < shard.dirty.size(); i++) {
+			map<int, Connection>::iterator it = shard.connections.find(shard.dirty[i]);
+			if (it == shard.connections.end()) continue;
+			it->second.dirty = false;
+			flush(index, it->second);
+		}
+		shard.dirty.clear();
+
+		for (map<int, Connection>::iterator it = shard.connections.begin(); it != shard.connections.end();) {
+			Connection& connection = it->second;
+			if (!connection.closing || connection.pending > 0 || !connection.output.empty()) {
+				++it;
+				continue;
+			}
+			releaseSeat(index, connection); // May finish a turn and leave replies for the next pass
+			shard.poller.remove(connection.fd);
+			close(connection.fd);
+			it = shard.connections.erase(it);
+			shard.stats.clients--;
+		}
+	}
+	for (map<int, Connection>::iterator it = shard.connections.begin(); it != shard.connections.end(); ++it) {
+		close(it->first);
+	}
+	shard.connections.clear();
+}
+
+// Reads straight into the end of the input buffer. False when the client has gone away.
+bool GameServer::readInput(Connection& connection) {
+	for (;;) {
+		size_t used = connection.input.size();
+		connection.input.resize(used + 4096);
+		ssize_t received = read(connection.fd, &connection.input[used], 4096);
+		connection.input.resize(used + (received > 0 ? received : 0));
+		if (received > 0) continue;
+		if (received == 0) return false;
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+}
+
+// Until a client is in a game its commands run at once; after that everything joins the game's
+// queue, so replies come back in order. Frames and lines are parsed where they lie in the input
+// buffer. False when the connection was handed over to another shard and must be forgotten here.
+bool GameServer::takeInput(int index, Connection& connection) {
+	size_t start = 0;
+	if (!connection.binary && connection.gameId < 0 && !connection.input.empty() &&
+		(unsigned char)connection.input[0] == WIRE_MAGIC) {
+		connection.binary = true;
+		start = 1;
+	}
+	while (!connection.closing) {
+		const char* command = connection.input.data() + start;
+		size_t available = connection.input.size() - start;
+		size_t length;
+		size_t next;
+		if (connection.binary) {
+			int size = WireReader::frameSize(command, available);
+			if (size == 0) break;
+			if (size < 0) {
+				wireError(connection.output, WIRE_BAD_REQUEST);
+				connection.closing = true;
+				break;
+			}
+			length = size;
+			next = start + size;
+		}
+		else {
+			const char* newline = (const char*)memchr(command, '\n', available);
+			if (!newline) break;
+			length = newline - command;
+			next = start + length + 1;
+			if (length > 0 && command[length - 1] == '\r') length--;
+		}
+		size_t commandStart = start;
+		start = next;
+		if (length == 0) continue;
+
+		if (connection.gameId < 0) {
+			int target = connection.binary
+				? sessionFrame(index, connection, command + WIRE_HEADER_SIZE, (int)length - WIRE_HEADER_SIZE, (unsigned char)command[2])
+				: sessionCommand(index, connection, string(command, length));
+			if (target >= 0) {
+				connection.input.erase(0, commandStart);
+				shards[index]->poller.remove(connection.fd);
+				handOver(target, connection);
+				return false;
+			}
+			continue;
+		}
+		queueCommand(index, connection, command, length);
+	}
+	if (connection.closing) connection.input.clear();
+	else connection.input.erase(0, start);
+	if (!connection.binary && !connection.closing && connection.input.size() > (size_t)SERVER_MAX_LINE) {
+		connection.output += "error line too long\n";
+		connection.closing = true;
+	}
+	markDirty(index, connection);
+	return true;
+}
+
+void GameServer::queueCommand(int index, Connection& connection, const char* command, size_t length) {
+	Shard& shard = *shards[index];
+	HostedGame* game = findGame(index, connection.gameId);
+	PendingCommand pending;
+	pending.fd = connection.fd;
+	pending.command.assign(command, length);
+	pending.received = chrono::steady_clock::now();
+	game->commands.push_back(move(pending));
+	connection.pending++;
+	if (!game->ready) {
+		game->ready = true;
+		shard.ready.push_back(connection.gameId);
+	}
+}
+
+GameServer::HostedGame* GameServer::createGame(int index, const char* playerName, bool multiplayer, int& gameId) {
+	Shard& shard = *shards[index];
+	gameId = (int)(shard.games.size() * shards.size()) + index;
+	EventLog::setContext(gameId, 0);
+	HostedGame* game = new HostedGame();
+	shard.games.push_back(unique_ptr<HostedGame>(game));
+	game->ready = false;
+	game->multiplayer = multiplayer;
+	for (int k = 0; k < MAX_KINGDOMS; k++) {
+		game->seats[k] = -1;
+		game->turnEnded[k] = false;
+	}
+	game->world.startNewGame(playerName);
+	game->world.ai->setPlanningBudget(SERVER_AI_PLANNING_MICROS);
+	shard.stats.games++;
+	return game;
+}
+
+// Returns the shard to hand the connection to when it joins a game elsewhere, otherwise -1
+int GameServer::sessionCommand(int index, Connection& connection, const string& line) {
+	Shard& shard = *shards[index];
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+	char word[16] = "";
+	char argument[MAX_NAME_LENGTH] = "";
+	sscanf(line.c_str(), "%15s %49[^\n]", word, argument);
+	char reply[128];
+	if (strcmp(word, "new") == 0) {
+		int gameId;
+		HostedGame* game = createGame(index, argument[0] ? argument : "Player", false, gameId);
+		game->world.ai->setHumanControlled(0, true);
+		connection.gameId = gameId;
+		snprintf(reply, sizeof(reply), "game %d\n", gameId);
+		connection.output += reply;
+	}
+	else if (strcmp(word, "join") == 0) {
+		int gameId = -1;
+		if (sscanf(argument, "%d", &gameId) != 1 || gameId < 0) {
+			connection.output += "error usage: join <game>\n";
+			return -1;
+		}
+		if (gameId % (int)shards.size() != index) return gameId % (int)shards.size();
+		HostedGame* game = findGame(index, gameId);
+		if (!game || game->multiplayer) {
+			connection.output += game ? "error multiplayer games need the binary protocol\n" : "error no such game\n";
+			return -1;
+		}
+		connection.gameId = gameId;
+		snprintf(reply, sizeof(reply), "joined %d %s\n", gameId, game->world.kingdoms[0]->getName());
+		connection.output += reply;
+	}
+	else if (strcmp(word, "stats") == 0) {
+		connection.output += describeShards() + "\n";
+	}
+	else if (strcmp(word, "quit") == 0) {
+		connection.closing = true;
+	}
+	else {
+		connection.output += "error create or join a game first\n";
+	}
+	shard.stats.latency.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count());
+	return -1;
+}
+
+// A binary client takes a seat in a multiplayer game, creating the game when asked to.
+// Returns the shard to hand the connection to when the game is elsewhere, otherwise -1.
+int GameServer::sessionFrame(int index, Connection& connection, const char* payload, int length, unsigned char type) {
+	Shard& shard = *shards[index];
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+	WireReader reader(payload, length);
+	int gameId = reader.i32();
+	int seat = reader.i32();
+	char name[MAX_NAME_LENGTH];
+	reader.text(name, sizeof(name));
+	if (type != FRAME_JOIN) {
+		wireError(connection.output, WIRE_NOT_SEATED);
+		return -1;
+	}
+	if (!reader.ok()) {
+		wireError(connection.output, WIRE_BAD_REQUEST);
+		return -1;
+	}
+	HostedGame* game;
+	if (gameId < 0) {
+		game = createGame(index, name[0] ? name : "Player", true, gameId);
+	}
+	else {
+		if (gameId % (int)shards.size() != index) return gameId % (int)shards.size();
+		game = findGame(index, gameId);
+		if (!game || !game->multiplayer) {
+			wireError(connection.output, WIRE_NO_SUCH_GAME);
+			return -1;
+		}
+	}
+	World& world = game->world;
+	if (seat < 0) {
+		for (int k = 0; k < world.kingdomCount && seat < 0; k++) {
+			if (game->seats[k] < 0) seat = k;
+		}
+	}
+	if (seat < 0 || seat >= world.kingdomCount || game->seats[seat] >= 0) {
+		wireError(connection.output, WIRE_SEAT_TAKEN);
+		return -1;
+	}
+	game->seats[seat] = connection.fd;
+	game->turnEnded[seat] = false;
+	world.ai->setHumanControlled(seat, true);
+	connection.gameId = gameId;
+	connection.seat = seat;
+	WireWriter joined(connection.output, FRAME_JOINED);
+	joined.i32(gameId);
+	joined.i32(seat);
+	joined.i32(world.events->getCurrentTurn());
+	joined.finish();
+	shard.stats.latency.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count());
+	return -1;
+}
+
+// Kingdom commands go to the interpreter; only the session commands are the server's own
+void GameServer::gameCommand(int index, HostedGame& game, Connection& connection, const string& line) {
+	char word[16] = "";
+	sscanf(line.c_str(), "%15s", word);
+	if (strcmp(word, "stats") == 0) {
+		connection.output += describeShards() + "\n";
+	}
+	else if (strcmp(word, "new") == 0 || strcmp(word, "join") == 0) {
+		connection.output += "error already in a game\n";
+	}
+	else if (strcmp(word, "quit") == 0) {
+		connection.closing = true;
+	}
+	else {
+		char text[SERVER_MAX_LINE + 1];
+		size_t length = min(line.size(), (size_t)SERVER_MAX_LINE);
+		memcpy(text, line.data(), length);
+		text[length] = '\0';
+		CommandInterpreter commands(game.world, 0, SERVER_AI_TURN_MICROS, SERVER_MAX_TURNS);
+		if (!commands.execute(text, connection.output)) connection.output += "error unknown command\n";
+	}
+	markDirty(index, connection);
+}
+
+void GameServer::gameFrame(int index, HostedGame& game, Connection& connection, const string& frame) {
+	World& world = game.world;
+	unsigned char type = (unsigned char)frame[2];
+	WireReader reader(frame.data() + WIRE_HEADER_SIZE, (int)frame.size() - WIRE_HEADER_SIZE);
+	if (type == FRAME_END_TURN) {
+		game.turnEnded[connection.seat] = true;
+		endTurnIfReady(index, game);
+		return;
+	}
+	if (type != FRAME_ACTION) {
+		wireError(connection.output, WIRE_BAD_REQUEST);
+		markDirty(index, connection);
+		return;
+	}
+
+	int action = reader.u8();
+	int argument = reader.i32();
+	int amount = reader.i32();
+	int self = connection.seat;
+	Kingdom* kingdom = world.kingdoms[self];
+	bool validTarget = argument >= 0 && argument < world.kingdomCount && argument != self;
+	bool validResource = argument >= GOLD && argument <= STONE;
+	int status = WIRE_REJECTED;
+	if (!reader.ok()) status = WIRE_BAD_REQUEST;
+	else {
+		switch (action) {
+		case WIRE_BUILD:
+			if (!validResource) status = WIRE_BAD_REQUEST;
+			else if (kingdom->buildStructure((ResourceType)argument)) status = WIRE_OK;
+			break;
+		case WIRE_RECRUIT:
+			if (amount < 1 || amount > WIRE_MAX_UNITS) status = WIRE_BAD_REQUEST;
+			else if (kingdom->recruitSoldiers(amount)) status = WIRE_OK;
+			break;
+		case WIRE_TRAIN:
+			if (amount < 1 || amount > WIRE_MAX_UNITS) status = WIRE_BAD_REQUEST;
+			else if (kingdom->trainTroops(argument, amount)) status = WIRE_OK;
+			break;
+		case WIRE_RESEARCH:
+			if (!validResource) status = WIRE_BAD_REQUEST;
+			else if (kingdom->researchTechnology((ResourceType)argument)) status = WIRE_OK;
+			break;
+		case WIRE_TAX:
+			kingdom->collectTaxes(*world.map);
+			status = WIRE_OK;
+			break;
+		case WIRE_ATTACK:
+			if (!validTarget) status = WIRE_BAD_REQUEST;
+			else if (world.map->launchAttack(kingdom, world.kingdoms[argument], *world.battles)) status = WIRE_OK;
+			break;
+		case WIRE_MARCH:
+			if (!validTarget || amount < 1 || amount > 100) status = WIRE_BAD_REQUEST;
+			else if (world.armies->dispatchArmy(world.kingdoms, self, argument, amount)) status = WIRE_OK;
+			break;
+		default:
+			status = WIRE_BAD_REQUEST;
+		}
 	}
-}
\ No newline at end of file
+	WireWriter result(connection.output, FRAME_RESULT);
+	result.u8(action);
+	result.u8(status);
+	result.finish();
+	markDirty(index, connection);
+}
+
+// Lockstep: the turn is played once every seated player has ended it, then each player is
+// sent their kingdom's state and the battles they fought
+void GameServer::endTurnIfReady(int index, HostedGame& game) {
+	World& world = game.world;
+	bool seated = false;
+	for (int k = 0; k < world.kingdomCount; k++) {
+		if (game.seats[k] < 0) continue;
+		if (!game.turnEnded[k]) return;
+		seated = true;
+	}
+	if (!seated) return;
+	world.playTurn(SERVER_AI_TURN_MICROS);
+
+	Shard& shard = *shards[index];
+	const vector<BattleReport>& reports = world.battles->getReports();
+	for (int k = 0; k < world.kingdomCount; k++) {
+		if (game.seats[k] < 0) continue;
+		game.turnEnded[k] = false;
+		map<int, Connection>::iterator it = shard.connections.find(game.seats[k]);
+		if (it == shard.connections.end()) continue;
+		const Kingdom* kingdom = world.kingdoms[k];
+		int fought = 0;
+		for (size_t r = 0; r < reports.size(); r++) {
+			if (reports[r].attacker == k || reports[r].defender == k) fought++;
+		}
+		fought = min(fought, 255);
+		WireWriter turn(it->second.output, FRAME_TURN);
+		turn.i32(world.events->getCurrentTurn());
+		turn.i32(kingdom->getGold());
+		turn.i32(kingdom->getFood());
+		turn.i32(kingdom->getWood());
+		turn.i32(kingdom->getStone());
+		turn.i32(kingdom->getPopulation());
+		turn.i32(kingdom->getHappiness());
+		turn.i32(kingdom->getMilitary().getTotalUnits());
+		turn.u8(fought);
+		for (size_t r = 0; r < reports.size() && fought > 0; r++) {
+			const BattleReport& report = reports[r];
+			if (report.attacker != k && report.defender != k) continue;
+			turn.u8(report.attacker);
+			turn.u8(report.defender);
+			turn.u8(report.attackerWon ? 1 : 0);
+			turn.i32(report.attackerCasualties);
+			turn.i32(report.defenderCasualties);
+			fought--;
+		}
+		turn.finish();
+		markDirty(index, it->second);
+	}
+}
+
+// The kingdom goes back to the AI, and the others no longer wait for it
+void GameServer::releaseSeat(int index, Connection& connection) {
+	HostedGame* game = findGame(index, connection.gameId);
+	if (!game || connection.seat < 0) return;
+	game->seats[connection.seat] = -1;
+	game->turnEnded[connection.seat] = false;
+	game->world.ai->setHumanControlled(connection.seat, false);
+	connection.seat = -1;
+	EventLog::setContext(connection.gameId, game->world.events->getCurrentTurn());
+	endTurnIfReady(index, *game);
+}
+
+// One command from every game that has any, so a busy game cannot starve the others
+void GameServer::runRound(int index) {
+	Shard& shard = *shards[index];
+	size_t count = shard.ready.size();
+	for (size_t n = 0; n < count; n++) {
+		int gameId = shard.ready.front();
+		shard.ready.pop_front();
+		HostedGame* game = findGame(index, gameId);
+		if (game->commands.empty()) {
+			game->ready = false;
+			continue;
+		}
+		PendingCommand command = move(game->commands.front());
+		game->commands.pop_front();
+		EventLog::setContext(gameId, game->world.events->getCurrentTurn());
+		map<int, Connection>::iterator it = shard.connections.find(command.fd);
+		if (it != shard.connections.end()) {
+			Connection& connection = it->second;
+			connection.pending--;
+			if (connection.binary) gameFrame(index, *game, connection, command.command);
+			else gameCommand(index, *game, connection, command.command);
+		}
+		shard.stats.latency.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - command.received).count());
+		if (game->commands.empty()) game->ready = false;
+		else shard.ready.push_back(gameId);
+	}
+}
+
+void GameServer::markDirty(int index, Connection& connection) {
+	if (connection.dirty || connection.output.empty()) return;
+	connection.dirty = true;
+	shards[index]->dirty.push_back(connection.fd);
+}
+
+// Sends from an offset so the buffer is only reset, never shifted, and keeps its capacity
+void GameServer::flush(int index, Connection& connection) {
+	while (connection.outputSent < connection.output.size()) {
+		ssize_t sent = send(connection.fd, connection.output.data() + connection.outputSent,
+			connection.output.size() - connection.outputSent, MSG_NOSIGNAL);
+		if (sent > 0) {
+			connection.outputSent += sent;
+			continue;
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+		connection.outputSent = connection.output.size(); // The client is gone
+		connection.closing = true;
+	}
+	if (connection.outputSent == connection.output.size()) {
+		connection.output.clear();
+		connection.outputSent = 0;
+	}
+	bool waiting = !connection.output.empty();
+	if (waiting != connection.writeWatched) {
+		shards[index]->poller.setWritable(connection.fd, waiting);
+		connection.writeWatched = waiting;
+	}
+}
+
+// Latencies run from the moment a command is read to the moment it is answered
+string GameServer::describeShards() const {
+	string text;
+	for (size_t i = 0; i < shards.size(); i++) {
+		const ShardStats& stats = shards[i]->stats;
+		char line[160];
+		snprintf(line, sizeof(line), "%sshard %d: %d games, %d clients, %llu commands, p50 %lldus, p99 %lldus",
+			i ? " | " : "", (int)i, stats.games.load(), stats.clients.load(), stats.latency.count(),
+			stats.latency.percentile(0.5), stats.latency.percentile(0.99));
+		text += line;
+	}
+	return text;
+}
+
+// BotSwarm class implementation
+BotSwarm::BotSwarm(const char* serverAddress) : address(serverAddress), rng(2463534242u), framesSent(0), framesReceived(0),
+	errors(0) {
+}
+
+void BotSwarm::sendJoin(int index, int gameId) {
+	Bot& bot = bots[index];
+	char name[MAX_NAME_LENGTH];
+	snprintf(name, sizeof(name), "Bot %d", index);
+	WireWriter join(bot.output, FRAME_JOIN);
+	join.i32(gameId);
+	join.i32(-1);
+	join.text(name);
+	join.finish();
+	framesSent++;
+	flush(bot);
+}
+
+// A few random actions and the end of the turn, sent together
+void BotSwarm::playTurn(Bot& bot) {
+	int actions = 1 + xorshift32(rng) % 3;
+	for (int a = 0; a < actions; a++) {
+		WireWriter frame(bot.output, FRAME_ACTION);
+		switch (xorshift32(rng) % 6) {
+		case 0: frame.u8(WIRE_BUILD); frame.i32(xorshift32(rng) % 4); frame.i32(0); break;
+		case 1: frame.u8(WIRE_RECRUIT); frame.i32(0); frame.i32(5 + xorshift32(rng) % 20); break;
+		case 2: frame.u8(WIRE_TRAIN); frame.i32(xorshift32(rng) % UnitCatalog::shared().getTypeCount()); frame.i32(1 + xorshift32(rng) % 5); break;
+		case 3: frame.u8(WIRE_RESEARCH); frame.i32(xorshift32(rng) % 4); frame.i32(0); break;
+		case 4: frame.u8(WIRE_TAX); frame.i32(0); frame.i32(0); break;
+		default: frame.u8(WIRE_ATTACK); frame.i32(xorshift32(rng) % 5); frame.i32(0); break;
+		}
+		frame.finish();
+		framesSent++;
+	}
+	WireWriter end(bot.output, FRAME_END_TURN);
+	end.finish();
+	framesSent++;
+	bot.turnStarted = chrono::steady_clock::now();
+	flush(bot);
+}
+
+void BotSwarm::handleFrame(int index, unsigned char type, const char* payload, int length) {
+	Bot& bot = bots[index];
+	WireReader reader(payload, length);
+	framesReceived++;
+	switch (type) {
+	case FRAME_JOINED: {
+		int gameId = reader.i32();
+		bot.seat = reader.i32();
+		bot.joined = true;
+		// The first player of a group created the game; now the rest can join it
+		if (groupGames[bot.group] < 0) {
+			groupGames[bot.group] = gameId;
+			for (size_t i = index + 1; i < bots.size() && bots[i].group == bot.group; i++) sendJoin((int)i, gameId);
+		}
+		playTurn(bot);
+		break;
+	}
+	case FRAME_RESULT: break; // Rejected actions are part of playing
+	case FRAME_TURN:
+		turnLatency.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - bot.turnStarted).count());
+		if (--bot.turnsLeft > 0) playTurn(bot);
+		break;
+	default:
+		errors++;
+		bot.turnsLeft = 0;
+	}
+}
+
+void BotSwarm::flush(Bot& bot) {
+	while (bot.outputSent < bot.output.size()) {
+		ssize_t sent = send(bot.fd, bot.output.data() + bot.outputSent, bot.output.size() - bot.outputSent, MSG_NOSIGNAL);
+		if (sent <= 0) break;
+		bot.outputSent += sent;
+	}
+	if (bot.outputSent == bot.output.size()) {
+		bot.output.clear();
+		bot.outputSent = 0;
+	}
+	poller.setWritable(bot.fd, !bot.output.empty());
+}
+
+bool BotSwarm::run(int players, int playersPerGame, int turns) {
+	signal(SIGPIPE, SIG_IGN);
+	playersPerGame = max(1, playersPerGame);
+	groupGames.assign((players + playersPerGame - 1) / playersPerGame, -1);
+	map<int, int> botByFd;
+	for (int i = 0; i < players; i++) {
+		int fd = openSocket(address, false);
+		if (fd < 0) {
+			errors++;
+			continue;
+		}
+		setNonBlocking(fd);
+		Bot bot;
+		bot.fd = fd;
+		bot.group = i / playersPerGame;
+		bot.seat = -1;
+		bot.turnsLeft = turns;
+		bot.joined = false;
+		bot.outputSent = 0;
+		bot.output.push_back((char)WIRE_MAGIC);
+		botByFd[fd] = (int)bots.size();
+		bots.push_back(bot);
+		poller.add(fd);
+	}
+	if (bots.empty()) return false;
+	for (size_t i = 0; i < bots.size(); i++) {
+		if (i == 0 || bots[i].group != bots[i - 1].group) sendJoin((int)i, -1);
+	}
+
+	int active = (int)bots.size();
+	vector<PollEvent> events;
+	while (active > 0) {
+		if (poller.wait(10000, events) <= 0) {
+			cout << "No reply from the server for 10 seconds, giving up.\n";
+			errors += active;
+			break;
+		}
+		for (size_t e = 0; e < events.size(); e++) {
+			map<int, int>::iterator found = botByFd.find(events[e].fd);
+			if (found == botByFd.end()) continue;
+			int index = found->second;
+			Bot& bot = bots[index];
+			if (events[e].writable) flush(bot);
+			if (!events[e].readable) continue;
+			bool open = true;
+			char buffer[4096];
+			for (;;) {
+				ssize_t received = read(bot.fd, buffer, sizeof(buffer));
+				if (received > 0) bot.input.append(buffer, received);
+				else {
+					open = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+					break;
+				}
+			}
+			size_t offset = 0;
+			int size;
+			while ((size = WireReader::frameSize(bot.input.data() + offset, bot.input.size() - offset)) > 0) {
+				const char* frame = bot.input.data() + offset;
+				handleFrame(index, (unsigned char)frame[2], frame + WIRE_HEADER_SIZE, size - WIRE_HEADER_SIZE);
+				offset += size;
+			}
+			bot.input.erase(0, offset);
+			if (size < 0 || !open) {
+				if (bot.turnsLeft > 0) errors++;
+				bot.turnsLeft = 0;
+			}
+			if (bot.turnsLeft <= 0) {
+				poller.remove(bot.fd);
+				close(bot.fd);
+				botByFd.erase(found);
+				active--;
+			}
+		}
+	}
+	for (map<int, int>::iterator it = botByFd.begin(); it != botByFd.end(); ++it) close(it->first);
+	return true;
+}
+
+void BotSwarm::displayResults(double seconds) const {
+	unsigned long long turnsPlayed = turnLatency.count();
+	cout << bots.size() << " players in " << groupGames.size() << " games played " << turnsPlayed << " turns in "
+		<< fixed << setprecision(2) << seconds << " s (" << (seconds > 0 ? turnsPlayed / seconds : 0.0) << " turns/s).\n";
+	cout << "Frames sent " << framesSent << ", received " << framesReceived << ", errors " << errors << ".\n";
+	cout << "Turn latency p50 " << turnLatency.percentile(0.5) << " us, p99 " << turnLatency.percentile(0.99) << " us.\n";
+	cout << defaultfloat << setprecision(6);
+}
+#endif
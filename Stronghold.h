@@ -7,17 +7,187 @@
 #include <cstdlib>
 #include <string>
 #include<cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <queue>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <deque>
+#include <map>
+#include <memory>
 
 using namespace std;
 
+// Capacity policies. A policy fixes the world limits and the list type used for the per-world
+// collections. SmallWorld keeps every list in a fixed inline array and never touches the heap;
+// LargeWorld keeps them in vectors that grow with use, its limits only being upper bounds.
+// Define STRONGHOLD_LARGE_WORLD to build with LargeWorld.
+template <typename T, int Capacity>
+class InlineList {
+private:
+	T items[Capacity];
+	int count;
+
+public:
+	InlineList() : count(0) {}
+
+	int size() const { return count; }
+	bool full() const { return count >= Capacity; }
+	T& operator[](int index) { return items[index]; }
+	const T& operator[](int index) const { return items[index]; }
+
+	// Caller checks full() first
+	T& append() {
+		items[count] = T();
+		return items[count++];
+	}
+	void removeAt(int index) {
+		for (int i = index + 1; i < count; i++) items[i - 1] = items[i];
+		count--;
+	}
+	void resize(int newCount) { count = max(0, min(newCount, Capacity)); }
+	void clear() { count = 0; }
+};
+
+template <typename T, int Capacity>
+class GrowableList {
+private:
+	vector<T> items;
+
+public:
+	int size() const { return (int)items.size(); }
+	bool full() const { return (int)items.size() >= Capacity; }
+	T& operator[](int index) { return items[index]; }
+	const T& operator[](int index) const { return items[index]; }
+
+	T& append() {
+		items.push_back(T());
+		return items.back();
+	}
+	void removeAt(int index) { items.erase(items.begin() + index); }
+	void resize(int newCount) { items.resize(max(0, min(newCount, Capacity))); }
+	void clear() { items.clear(); }
+};
+
+struct SmallWorld {
+	static constexpr const char* name = "SmallWorld";
+	static const int maxKingdoms = 5;
+	static const int maxMessages = 20;
+	static const int maxTreaties = 10;
+	static const int maxTradeOffers = 15;
+	static const int maxBuildings = 10;
+	static const int maxUnitTypes = 8;
+	static const int mapSize = 10;
+	template <typename T, int Capacity> using List = InlineList<T, Capacity>;
+};
+
+struct LargeWorld {
+	static constexpr const char* name = "LargeWorld";
+	static const int maxKingdoms = 32;
+	static const int maxMessages = 4096;
+	static const int maxTreaties = 1024;
+	static const int maxTradeOffers = 2048;
+	static const int maxBuildings = 64;
+	static const int maxUnitTypes = 32;
+	static const int mapSize = 64;
+	template <typename T, int Capacity> using List = GrowableList<T, Capacity>;
+};
+
+#ifdef STRONGHOLD_LARGE_WORLD
+typedef LargeWorld CapacityPolicy;
+#else
+typedef SmallWorld CapacityPolicy;
+#endif
+
 // Constants
-const int MAX_KINGDOMS = 5;
-const int MAX_MESSAGES = 20;
-const int MAX_TREATIES = 10;
-const int MAX_TRADE_OFFERS = 15;
-const int MAP_SIZE = 10;
+const int MAX_KINGDOMS = CapacityPolicy::maxKingdoms;
+const int MAX_MESSAGES = CapacityPolicy::maxMessages;
+const int MAX_TREATIES = CapacityPolicy::maxTreaties;
+const int MAX_TRADE_OFFERS = CapacityPolicy::maxTradeOffers;
+const int MAX_BUILDINGS = CapacityPolicy::maxBuildings;
+const int MAX_UNIT_TYPES = CapacityPolicy::maxUnitTypes;
+const int MAX_ARMOUR = 90; // Percent; every unit type stays exposed to some losses
+const int MAP_SIZE = CapacityPolicy::mapSize;
 const int MAX_NAME_LENGTH = 50;
 const int MAX_MESSAGE_LENGTH = 200;
+const int WORLD_ARENA_BLOCK = 64 * 1024;
+const int SCRATCH_ARENA_BLOCK = 16 * 1024;
+const int VIEWPORT_WIDTH = 16;
+const int VIEWPORT_HEIGHT = 10;
+const int MINIMAP_SIZE = 8; // Max minimap cells per side
+const int OWNERSHIP_CHUNK_ROWS = 4; // Map rows resolved together when any tile in them changes
+const int OWNERSHIP_CHUNKS = (MAP_SIZE + OWNERSHIP_CHUNK_ROWS - 1) / OWNERSHIP_CHUNK_ROWS;
+const int LAND_TAX_PER_TILE = 2;
+// Influence update: a tile keeps INFLUENCE_KEEP 1024ths of its influence from the turn before, or
+// takes its strongest neighbour's less a falloff per tile, whichever is more. The falloff comes
+// down to INFLUENCE_MIN_FALLOFF as the army grows, which is the slope expandTerritory lays down.
+const int INFLUENCE_SHIFT = 10;
+const int INFLUENCE_KEEP = 768;
+const int INFLUENCE_MIN_FALLOFF = 10;
+const int INFLUENCE_TASK_TILES = 16 * 1024; // Tiles per parallel task before the update is split up
+const int TERRAIN_TASK_TILES = 4 * 1024; // Tiles of terrain generated per parallel task
+const int VISION_RADIUS = 3; // Tiles seen past a kingdom's borders and around its seat and armies
+const int VISION_ROW_WORDS = (MAP_SIZE + 63) / 64;
+const int VISION_WORDS = VISION_ROW_WORDS * MAP_SIZE;
+const int PLAYER_PREDICTION_SAMPLES = 20000;
+const int AI_PREDICTION_SAMPLES = 256; // Small enough to stay on the calling thread
+const int AI_TURN_BUDGET_MICROS = 2000; // Wall-clock budget for all AI decisions in a turn
+const int AI_PLANNING_BUDGET_MICROS = 20000; // Extra budget for lookahead planning per turn
+const int MCTS_MIN_PLAN_MICROS = 500; // Smallest slice worth planning with
+const int MCTS_HORIZON = 6; // Turns simulated per playout
+const int ARMY_MOVE_POINTS = 3; // Movement cost an army can spend per turn
+const int FLOW_FIELD_CACHE_SIZE = 16; // Distance fields kept, least recently used evicted
+const int CARAVAN_TILES_PER_TURN = 2;
+const int CARAVAN_RAID_PERCENT = 20; // Chance per turn in hostile territory; smugglers run half the risk
+const int CARAVAN_TASK_SIZE = 4 * 1024; // Caravans per parallel task when moving them
+const int SMUGGLING_MARKUP_PERCENT = 120; // Of the market price, paid for goods that reach the buyer's black market
+const int SIM_MAX_KINGDOMS = 8; // Planning kingdom plus its nearest neighbours
+const int SIM_MAX_ACTIONS = 24;
+const int MCTS_MAX_NODES = 1 << 16; // Per search tree
+const int MCTS_FIXED_TREES = 4; // Trees searched when planning by iteration count rather than by the clock
+const int SCRIPT_PLAN_ITERATIONS = 200; // Per tree, so scripted runs play the same game for the same seed
+const int CONSTRUCTION_TURNS = 2;
+const int RESEARCH_TURNS = 3;
+const int OFFER_LIFETIME_TURNS = 5;
+const int MAX_TREATY_TURNS = 1000;
+const int MESSAGE_LIFETIME_TURNS = 10;
+const int HISTORY_CHUNK_TURNS = 64; // Turns per compressed column chunk
+const int HISTORY_MAX_BYTES = 2 << 20; // Compressed history kept; the oldest chunks are dropped past it
+const int LEADERBOARD_TOP = 5; // Places shown per board
+const int CHART_WIDTH = 60;
+const int CHART_HEIGHT = 10;
+const int SAVE_SNAPSHOT_INTERVAL = 20; // Turns of appended changes before the save is rewritten whole
+const int AI_IDLE_SLEEP_TURNS = 3; // An AI with nothing worth doing is not evaluated again until then
+const int SERVER_AI_TURN_MICROS = 1000; // Hosted games share a core, so their AI gets smaller budgets
+const int SERVER_AI_PLANNING_MICROS = 2000;
+const int SERVER_MAX_LINE = 512; // Clients sending longer command lines are disconnected
+const int SERVER_MAX_TURNS = 1; // Per end-turn command, so one client cannot hold up a shard
+const int LATENCY_BUCKETS = 32; // Bucket b counts latencies under 2^b microseconds
+const unsigned char WIRE_MAGIC = 0xB7; // First byte from a binary client; no text command starts with it
+const int WIRE_HEADER_SIZE = 3; // u16 payload length and u8 frame type, little-endian
+const int WIRE_MAX_PAYLOAD = 1024;
+const int WIRE_MAX_UNITS = 100000; // Largest recruit or train order a client may send
+const int LOG_RING_SIZE = 1 << 14; // Event records a thread can have waiting; a power of two
+const int LOG_MAX_THREADS = 256; // Threads past this many have their events dropped
+const int LOG_WRITER_INTERVAL_MILLIS = 5;
+const int WHEEL_BITS = 6;
+const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+const int WHEEL_LEVELS = 3; // Events further out than 2^18 turns wait in an overflow list
+
+// Number of halvings needed to reduce a map side to a single cell
+constexpr int pyramidLevelsFor(int size) { return size <= 1 ? 1 : 1 + pyramidLevelsFor((size + 1) / 2); }
+const int PYRAMID_LEVELS = pyramidLevelsFor(MAP_SIZE);
+// Cells per side of pyramid level l, and how many cells the levels below it hold in total
+constexpr int pyramidSide(int level) { return (MAP_SIZE + (1 << level) - 1) >> level; }
+constexpr int pyramidCellsBelow(int level) { return level == 0 ? 0 : pyramidCellsBelow(level - 1) + pyramidSide(level - 1) * pyramidSide(level - 1); }
+const int PYRAMID_CELLS = pyramidCellsBelow(PYRAMID_LEVELS);
 
 // Enums
 enum ResourceType {
@@ -27,6 +197,15 @@ enum ResourceType {
 	STONE
 };
 
+enum Terrain {
+	TERRAIN_PLAINS,
+	TERRAIN_FOREST,
+	TERRAIN_HILLS,
+	TERRAIN_MOUNTAINS,
+	TERRAIN_WATER,
+	TERRAIN_TYPES
+};
+
 enum TreatyType {
 	PEACE,
 	ALLIANCE,
@@ -34,6 +213,70 @@ enum TreatyType {
 	NON_AGGRESSION
 };
 
+enum AIActionType {
+	AI_IDLE,
+	AI_BUILD,
+	AI_RECRUIT,
+	AI_TRAIN,
+	AI_TAX,
+	AI_RESEARCH,
+	AI_TRADE,
+	AI_TREATY,
+	AI_ATTACK,
+	AI_MARCH,
+	AI_EXPAND
+};
+
+enum GameEventType {
+	EVENT_TREATY_EXPIRY,
+	EVENT_OFFER_EXPIRY,
+	EVENT_MESSAGE_EXPIRY,
+	EVENT_CONSTRUCTION,
+	EVENT_RESEARCH,
+	EVENT_AI_WAKEUP
+};
+
+// Game events for the event log. Subject is the acting kingdom, target the other one or -1.
+enum LogEventType {
+	LOG_TAXES_COLLECTED, // amount = gold
+	LOG_FORTIFIED, // amount = units added
+	LOG_FORTIFY_FAILED,
+	LOG_ATTACK_LAUNCHED,
+	LOG_ATTACK_OUT_OF_RANGE,
+	LOG_ATTACK_REFUSED,
+	LOG_TREATY_BROKEN_FOR_WAR,
+	LOG_WAR_DECLARED,
+	LOG_ALLY_JOINED, // target = the declarer the ally turns on
+	LOG_TRADE_ACCEPTED, // amount = offer id
+	LOG_TILE_OCCUPIED, // amount = tile index
+	LOG_KINGDOMS_FULL,
+	LOG_CARAVAN_ARRIVED, // target = receiver
+	LOG_CARAVAN_RAIDED, // subject = raider, target = sender
+	LOG_SMUGGLING_PAID, // amount = gold
+	LOG_EVENT_TYPES
+};
+
+enum Metric {
+	METRIC_GOLD,
+	METRIC_FOOD,
+	METRIC_WOOD,
+	METRIC_STONE,
+	METRIC_POPULATION,
+	METRIC_HAPPINESS,
+	METRIC_ATTACK,
+	METRIC_DEFENSE,
+	METRIC_TERRITORY,
+	METRIC_COUNT
+};
+
+enum Ranking {
+	RANK_POWER,
+	RANK_GOLD,
+	RANK_POPULATION,
+	RANK_TERRITORY,
+	RANK_COUNT
+};
+
 enum RelationshipStatus {
 	FRIENDLY,
 	NEUTRAL,
@@ -57,12 +300,14 @@ struct Message {
 	char receiver[MAX_NAME_LENGTH];
 	char content[MAX_MESSAGE_LENGTH];
 	bool read;
+	int id;
 
 	Message() {
 		strcpy_s(sender, "");
 		strcpy_s(receiver, "");
 		strcpy_s(content, "");
 		read = false;
+		id = 0;
 	}
 };
 
@@ -73,6 +318,8 @@ struct Treaty {
 	int turnEstablished;
 	int duration;
 	bool active;
+	int id;
+	int party1, party2; // Kingdom indices of kingdom1 and kingdom2
 
 	Treaty() {
 		strcpy_s(kingdom1, "");
@@ -81,6 +328,8 @@ struct Treaty {
 		turnEstablished = 0;
 		duration = 0;
 		active = false;
+		id = 0;
+		party1 = party2 = -1;
 	}
 };
 
@@ -91,42 +340,462 @@ struct TradeOffer {
 	Resource requesting;
 	bool isSmuggling;
 	bool accepted;
+	int id;
 
 	TradeOffer() {
 		strcpy_s(offerer, "");
 		strcpy_s(receiver, "");
 		isSmuggling = false;
 		accepted = false;
+		id = 0;
+	}
+};
+
+// A timed effect, fired when the scheduler reaches dueTurn
+struct GameEvent {
+	int dueTurn;
+	GameEventType type;
+	int subject; // Kingdom index, or the id of a treaty, trade offer or message
+	int detail; // ResourceType for construction and research
+};
+
+// Kingdom fields tracked by the change journal
+enum KingdomField {
+	FIELD_RESOURCES = 1,
+	FIELD_POPULATION = 2, // Population and happiness
+	FIELD_MILITARY = 4,
+	FIELD_TECHNOLOGY = 8,
+	FIELD_BUILDINGS = 16, // Including construction under way
+	FIELD_POSITION = 32,
+	ALL_FIELDS = 63
+};
+
+enum ChangeKind {
+	CHANGE_KINGDOM,
+	CHANGE_TILE,
+	CHANGE_TREATY,
+	CHANGE_OFFER,
+	CHANGE_MESSAGE,
+	CHANGE_PRICES,
+	CHANGE_RELATIONS
+};
+
+// One entry of the change journal
+struct Change {
+	ChangeKind kind;
+	int subject; // Kingdom index, x * MAP_SIZE + y for a tile, or the id of a treaty, offer or message
+	int detail; // KingdomField bits, the tile's owner, or 1 when a record is gone
+};
+
+// Aggregate of a square block of map tiles, used for the minimap
+struct MapSummary {
+	int ownedTiles[MAX_KINGDOMS]; // Tiles in the block owned by each kingdom
+	int controlSum; // Sum of the owner's control over every owned tile
+	int tileCount;
+
+	MapSummary() : controlSum(0), tileCount(0) {
+		for (int k = 0; k < MAX_KINGDOMS; k++) ownedTiles[k] = 0;
 	}
 };
 
+// Binary protocol frames. Payload fields are little-endian i32 unless marked otherwise.
+enum WireFrame {
+	FRAME_JOIN = 1, // game (-1 for a new game), seat (-1 for any free kingdom), name (text)
+	FRAME_ACTION, // action (u8), argument, amount
+	FRAME_END_TURN, // Empty
+	FRAME_JOINED = 64, // game, seat, turn
+	FRAME_RESULT, // action (u8), status (u8)
+	FRAME_TURN, // turn, gold, food, wood, stone, population, happiness, army, battles (u8), then per
+	// battle: attacker (u8), defender (u8), attacker won (u8), attacker losses, defender losses
+	FRAME_ERROR // status (u8)
+};
+
+enum WireAction {
+	WIRE_BUILD = 1, // argument: ResourceType boosted
+	WIRE_RECRUIT, // amount
+	WIRE_TRAIN, // argument: unit type, amount
+	WIRE_RESEARCH, // argument: ResourceType
+	WIRE_TAX,
+	WIRE_ATTACK, // argument: kingdom
+	WIRE_MARCH // argument: kingdom, amount: percent of the army
+};
+
+enum WireStatus {
+	WIRE_OK,
+	WIRE_REJECTED, // Not enough resources, out of range and the like
+	WIRE_BAD_REQUEST,
+	WIRE_NO_SUCH_GAME,
+	WIRE_SEAT_TAKEN,
+	WIRE_NOT_SEATED
+};
+
+// Outcome of one resolved battle
+struct BattleReport {
+	int attacker; // Kingdom indices
+	int defender;
+	int attackPower; // After splitting across fronts and random scaling
+	int defensePower;
+	int attackerCasualties;
+	int defenderCasualties;
+	int goldPlunder;
+	int foodPlunder;
+	bool attackerWon;
+};
+
+// One event as it is logged and stored: fixed size, no text
+struct LogRecord {
+	unsigned short type; // LogEventType
+	unsigned short thread; // Ring the record came through
+	int game; // Context of the recording thread
+	int turn;
+	int subject;
+	int target;
+	int amount;
+};
+
+// Movement cost of a map tile before a change, -1 for impassable
+struct TileChange {
+	int x;
+	int y;
+	int oldCost;
+};
+
+// Expected result of an attack, estimated by sampling the combat model
+struct BattlePrediction {
+	int samples;
+	double winProbability;
+	double expectedAttackerCasualties;
+	double expectedDefenderCasualties;
+	double expectedGoldPlunder;
+	double expectedFoodPlunder;
+
+	BattlePrediction() : samples(0), winProbability(0), expectedAttackerCasualties(0),
+		expectedDefenderCasualties(0), expectedGoldPlunder(0), expectedFoodPlunder(0) {}
+};
+
+// A scored candidate action for an AI kingdom
+struct AIAction {
+	AIActionType type;
+	ResourceType resource; // Building, unit, technology or offered resource
+	ResourceType requested; // Resource asked for in a trade
+	int amount; // Units, trade quantity or treaty type
+	int target; // Kingdom index, -1 if none
+	int unit; // Unit type for AI_TRAIN
+	float score;
+
+	AIAction() : type(AI_IDLE), resource(GOLD), requested(GOLD), amount(0), target(-1), unit(0), score(0) {}
+	AIAction(AIActionType t, ResourceType r, int a, int tgt, float s)
+		: type(t), resource(r), requested(GOLD), amount(a), target(tgt), unit(0), score(s) {}
+};
+
+// Compact copy of one kingdom for lookahead simulation
+struct SimKingdom {
+	int resources[4]; // Indexed by ResourceType
+	int boosts[4]; // Per-turn production from buildings and land
+	int units[MAX_UNIT_TYPES]; // Indexed by unit type
+	int population;
+	int happiness;
+	int researchPoints;
+	int buildingCount;
+	int ownedTiles;
+	int x, y;
+	int defenseBonus; // Percent, from the ground the seat stands on
+	unsigned char techMask; // Bit per ResourceType, set once researched
+	unsigned char treatyMask; // Bit per simulated kingdom with an active treaty
+};
+static_assert(SIM_MAX_KINGDOMS <= 8, "SimKingdom::treatyMask has one bit per simulated kingdom");
+
+// Everything the planner simulates, in one plain block of memory so forking is a copy.
+// Slot 0 is the planning kingdom.
+struct SimState {
+	SimKingdom kingdoms[SIM_MAX_KINGDOMS];
+	int sourceIndex[SIM_MAX_KINGDOMS]; // Index in the real world
+	int kingdomCount;
+
+	int listActions(int k, AIAction* actions) const;
+	void applyAction(int k, const AIAction& action, unsigned int& rng);
+	void advanceTurn();
+	double evaluate(int k) const;
+};
+
 // Classes
+class ThreadPool {
+private:
+	struct Job {
+		const function<void(int, int)>* body;
+		int count;
+		int grain;
+		atomic<int> nextChunk;
+	};
+
+	vector<thread> workers;
+	mutex lock;
+	mutex submitLock; // One parallelFor at a time
+	condition_variable wake;
+	condition_variable finished;
+	Job* job;
+	unsigned long long generation;
+	int busyWorkers;
+	bool stopping;
+
+	void workerLoop();
+	static void runChunks(Job& current);
+
+public:
+	ThreadPool(int threadCount);
+	~ThreadPool();
+
+	int getThreadCount() const;
+
+	// Calls body(begin, end) over [0, count) in chunks of grain, on the pool and the caller
+	void parallelFor(int count, int grain, const function<void(int, int)>& body);
+	// Makes parallelFor run inline on the calling thread, for threads that own a core
+	static void runInline(bool enabled);
+
+	static ThreadPool& shared();
+};
+
+// Bump allocator. Memory comes out of large blocks and is only given back all at once by reset(),
+// which keeps the blocks for the next round. Objects with destructors are destroyed on reset,
+// newest first. Not thread-safe.
+class Arena {
+private:
+	struct Block {
+		char* data;
+		size_t size;
+	};
+	struct Finalizer {
+		void (*destroy)(void*);
+		void* object;
+		Finalizer* next;
+	};
+
+	vector<Block> blocks;
+	size_t currentBlock;
+	size_t offset; // Into the current block
+	size_t blockSize;
+	Finalizer* finalizers;
+	size_t bytesUsed;
+	size_t peakBytes;
+	long long allocations;
+	int blockMallocs;
+	int resets;
+
+	template <typename T>
+	static void destroyObject(void* object) { static_cast<T*>(object)->~T(); }
+
+public:
+	Arena(size_t defaultBlockSize);
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	~Arena();
+
+	void* allocate(size_t size, size_t alignment);
+	void reset();
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!is_trivially_destructible<T>::value) {
+			Finalizer* finalizer = static_cast<Finalizer*>(allocate(sizeof(Finalizer), alignof(Finalizer)));
+			finalizer->destroy = &destroyObject<T>;
+			finalizer->object = object;
+			finalizer->next = finalizers;
+			finalizers = finalizer;
+		}
+		return object;
+	}
+
+	// Value-initialized array, only for types that need no destructor
+	template <typename T>
+	T* allocateArray(int count) {
+		static_assert(is_trivially_destructible<T>::value, "Arena arrays are never destroyed");
+		T* items = static_cast<T*>(allocate(sizeof(T) * max(count, 1), alignof(T)));
+		for (int i = 0; i < count; i++) new (&items[i]) T();
+		return items;
+	}
+
+	size_t getBytesUsed() const;
+	size_t getPeakBytes() const;
+	size_t getBytesReserved() const;
+	long long getAllocationCount() const;
+	int getBlockMallocs() const;
+	int getResetCount() const;
+
+	void displayStats(const char* label) const;
+};
+
+class Kingdom;
+class Map;
+
+// Structured event log. Game logic records fixed-size events into a ring owned by the calling
+// thread: no lock, no formatting and no allocation on that path. Consumers drain the rings,
+// either directly (the interactive frontend) or through the background writer, and every
+// drained record also goes to the log file when one is open. Text is only made by describe().
+// A full ring drops new records and counts them rather than stall the game.
+class EventLog {
+private:
+	// Head and tail sit on their own cache lines so the owner and a drain do not contend
+	struct Ring {
+		LogRecord records[LOG_RING_SIZE];
+		alignas(64) atomic<unsigned int> head; // Advanced only by the owning thread
+		unsigned int cachedTail; // Owner's last look at tail; reread only when the ring seems full
+		atomic<unsigned int> dropped; // Written only by the owning thread
+		alignas(64) atomic<unsigned int> tail; // Advanced only by a drain
+	};
+	struct Context {
+		Ring* ring;
+		int game;
+		int turn;
+		unsigned short thread;
+		bool unattached; // Came after every ring was taken
+	};
+
+	Ring* rings[LOG_MAX_THREADS];
+	atomic<int> ringCount;
+	atomic<unsigned int> unattachedDrops;
+	mutex ringLock; // Attaching threads
+	mutex drainLock; // One consumer at a time; also guards the file
+	ofstream file;
+	long long written;
+	thread writer;
+	mutex writerLock;
+	condition_variable writerWake;
+	bool stopping;
+
+	static thread_local Context context;
+
+	EventLog();
+	~EventLog();
+	Ring* attachThread();
+	void writerLoop();
+
+public:
+	EventLog(const EventLog&) = delete;
+	EventLog& operator=(const EventLog&) = delete;
+
+	static void record(LogEventType type, int subject, int target, int amount);
+	// Stamped on the records of the calling thread from now on
+	static void setContext(int game, int turn);
+	static void setTurn(int turn);
+
+	// Appends everything recorded so far, oldest first within each thread
+	int drain(vector<LogRecord>& out);
+	bool openFile(const char* path);
+	void startWriter();
+	void close(); // Stops the writer, drains what is left and closes the file
+	long long getWritten() const;
+	long long getDropped() const;
+
+	static string describe(const LogRecord& record, Kingdom* const kingdoms[], int kingdomCount);
+	static bool readFile(const char* path, vector<LogRecord>& records);
+	static EventLog& shared();
+};
+
+// Hierarchical timing wheel. Level l has one slot per 2^(6l) turns; an event sits in the lowest
+// level that reaches its due turn and drops a level each time its slot comes round, so a turn
+// only touches the events due in it.
+class EventScheduler {
+private:
+	vector<GameEvent> wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+	vector<GameEvent> overflow;
+	vector<GameEvent> spill; // Reused while cascading a slot
+	int currentTurn;
+	int pendingCount;
+
+	void place(const GameEvent& event);
+	void cascade(int level);
+
+public:
+	EventScheduler();
+
+	int getCurrentTurn() const;
+	int getPendingCount() const;
+
+	void schedule(int delay, GameEventType type, int subject, int detail);
+	// Moves to the next turn and hands back the events due in it, in the order they were scheduled
+	void advance(vector<GameEvent>& due);
+	void clear();
+
+	void saveToFile(ofstream& outFile);
+	void loadFromFile(ifstream& inFile);
+};
+
+struct UnitType {
+	char name[MAX_NAME_LENGTH];
+	int goldCost;
+	int attack;
+	int defense;
+	int upkeep; // Gold per unit per turn
+	int armour; // Percent by which this type's share of casualties is reduced
+};
+
+// The unit types every kingdom can field, read from a data file at startup. Weights are kept
+// zero-padded to MAX_UNIT_TYPES so army power is a fixed-length dot product.
+class UnitCatalog {
+private:
+	UnitType types[MAX_UNIT_TYPES];
+	int typeCount;
+	int attackWeights[MAX_UNIT_TYPES];
+	int defenseWeights[MAX_UNIT_TYPES];
+	int upkeepWeights[MAX_UNIT_TYPES];
+	int exposureWeights[MAX_UNIT_TYPES]; // 100 - armour; casualties are shared out by count * exposure
+
+	void clearTypes();
+	bool addType(const char* name, int goldCost, int attack, int defense, int upkeep, int armour);
+
+public:
+	UnitCatalog();
+
+	void resetToDefaults();
+	bool loadFromFile(const char* path);
+
+	int getTypeCount() const;
+	const UnitType& getType(int index) const;
+	int findType(const char* name) const;
+	int bestAttackPerGold() const;
+
+	const int* getAttackWeights() const;
+	const int* getDefenseWeights() const;
+	const int* getUpkeepWeights() const;
+	const int* getExposureWeights() const;
+
+	void display() const;
+
+	static UnitCatalog& shared();
+};
+
 class Military {
 private:
-	int soldiers;
-	int archers;
-	int cavalry;
-	int siegeUnits;
+	int counts[MAX_UNIT_TYPES]; // Per catalog unit type; type 0 is the levy raised by recruiting
+	bool changed; // Since takeChanged() was last called
 
 public:
 	Military();
+	bool takeChanged();
 
-	void addSoldiers(int count);
-	void addArchers(int count);
-	void addCavalry(int count);
-	void addSiegeUnits(int count);
-
-	int getSoldiers() const;
-	int getArchers() const;
-	int getCavalry() const;
-	int getSiegeUnits() const;
+	void addUnits(int unitType, int count);
+	int getCount(int unitType) const;
+	int getTotalUnits() const;
 
 	int calculateDefensePower() const;
 	int calculateAttackPower() const;
+	int calculateUpkeep() const;
 
-	void trainUnits(ResourceType resourceType, int amount);
+	void trainUnits(int unitType, int amount);
 	void takeCasualties(int amount);
 
+	// Exact largest-remainder split of losses over a zero-padded array of unit counts
+	static void distributeLosses(int* counts, int amount);
+	// Applies losses[i] to armies[i] for a contiguous batch of armies
+	static void applyCasualties(Military* armies, const int* losses, int count);
+
+	Military detach(int percent);
+	void merge(const Military& other);
+
+	// Attack and defence power of many armies in one pass; either output may be null
+	static void computePowers(const Military* armies, int count, int* attackPower, int* defensePower);
+
 	void saveToFile(ofstream& outFile);
 	void loadFromFile(ifstream& inFile);
 
@@ -140,12 +809,21 @@ private:
 	bool constructionAdvanced;
 	bool economyAdvanced;
 	int researchPoints;
+	unsigned char researching; // Bit per ResourceType, set while research is under way
+
+	void setAdvanced(ResourceType type);
 
 public:
 	Technology();
 
 	void addResearchPoints(int points);
 	bool researchTechnology(ResourceType type);
+	bool beginResearch(ResourceType type);
+	void completeResearch(ResourceType type);
+	int getResearchPoints() const;
+
+	bool isAdvanced(ResourceType type) const;
+	bool isResearching(ResourceType type) const;
 
 	bool isAgricultureAdvanced() const;
 	bool isMilitaryAdvanced() const;
@@ -188,9 +866,21 @@ private:
 	Resource resources;
 	Military military;
 	Technology tech;
-	Building buildings[10];
-	int buildingCount;
+	CapacityPolicy::List<Building, MAX_BUILDINGS> buildings;
+	int pendingBuildings; // Paid for, waiting on the scheduler
 	int x, y; // Position on map
+	unsigned int changedFields; // KingdomField bits, military aside, since the journal last looked
+
+	// Per-turn yield by ResourceType from technology and buildings. Rebuilt lazily after a
+	// building is added or upgraded or a technology completes, so a turn is a plain add.
+	int production[4];
+	bool productionDirty;
+
+	void computeProduction(int* out) const;
+	void refreshProduction();
+
+	EventScheduler* events; // Null for instant construction and research
+	int index; // Position in the kingdom list, used as the subject of scheduled events
 
 public:
 	Kingdom();
@@ -214,15 +904,30 @@ public:
 	bool spendFood(int amount);
 	bool spendWood(int amount);
 	bool spendStone(int amount);
+	bool spendResources(const Resource& cost); // All or nothing
+	void addResources(const Resource& amount);
 
 	void setPosition(int newX, int newY);
 	int getX() const;
 	int getY() const;
 
 	Military& getMilitary();
-
-	void processTurn();
-	void collectTaxes();
+	const Military& getMilitary() const;
+	const Technology& getTechnology() const;
+	int getBuildingCount() const;
+	int getPendingBuildings() const;
+	const Building& getBuilding(int index) const;
+	int getProduction(ResourceType type);
+	bool checkProductionCache() const;
+	unsigned int takeChangedFields();
+
+	void attachScheduler(EventScheduler* scheduler, int kingdomIndex);
+	int getIndex() const;
+	void completeStructure(ResourceType type);
+	void completeResearch(ResourceType type);
+
+	void processTurn(const Map& map);
+	void collectTaxes(const Map& map);
 	void buildStructure();
 	void recruitUnits();
 	void trainTroops();
@@ -230,61 +935,421 @@ public:
 	void researchTechnology();
 	void fortify();
 
-	void recruitSoldiers(int count);
+	// Non-interactive versions used by the AI
+	bool buildStructure(ResourceType type);
+	bool trainTroops(int unitType, int amount);
+	bool researchTechnology(ResourceType type);
+	bool upgradeBuilding(int buildingIndex);
+
+	bool recruitSoldiers(int count);
 
 	void displayStatus() const;
 	void displayMilitary() const;
 
-	void spyOn(Kingdom* target);
+	void spyOn(const Kingdom* target, bool inSight);
 
 	void saveToFile(ofstream& outFile);
 	void loadFromFile(ifstream& inFile);
 };
 
+class BattleQueue;
+class DiplomacyManager;
+class MarketPlace;
+class FogOfWar;
+class World;
+
 class Map {
 private:
 	int width;
 	int height;
 	int grid[MAP_SIZE][MAP_SIZE]; // 0 for empty, >0 for kingdom index+1
-	int territoryControl[MAX_KINGDOMS][MAP_SIZE][MAP_SIZE]; // Territory control strength per kingdom
+	// Territory control strength per kingdom, kept twice: territoryControl points at the current
+	// copy and updateInfluence writes the other one before switching to it
+	int influence[2][MAX_KINGDOMS][MAP_SIZE][MAP_SIZE];
+	int (*territoryControl)[MAP_SIZE][MAP_SIZE];
+
+	int tileOwner[MAP_SIZE][MAP_SIZE]; // -1 for unowned
+	int tileControl[MAP_SIZE][MAP_SIZE];
+	// Level-of-detail pyramid: level l holds one summary per 2^l x 2^l block, stored level after
+	// level with each one only as large as it needs to be; summaryAt finds a cell
+	MapSummary pyramid[PYRAMID_CELLS];
+	int viewX, viewY; // Top-left corner of the viewport
+
+	vector<TileChange> costChanges; // Not yet collected by the army manager
+	unsigned char tileChanged[MAP_SIZE][MAP_SIZE]; // Tiles already in changedTiles
+	vector<int> changedTiles; // Not yet collected by the change journal
+	unsigned char territoryChanged[MAX_KINGDOMS]; // Kingdoms already in changedTerritories
+	vector<int> changedTerritories; // Kingdoms that gained or lost tiles, not yet collected
+	FogOfWar* fog; // Told of every change of tile owner
+
+	// Ownership is resolved a chunk of whole rows at a time: writes to territoryControl mark the
+	// chunk, and resolveOwnership recomputes every marked one before the map is read again
+	unsigned char chunkDirty[OWNERSHIP_CHUNKS];
+	vector<int> dirtyChunks;
+	int ownedArea[MAX_KINGDOMS]; // Tiles owned per kingdom
+
+	// Terrain is a function of the seed alone, so it is never saved. A chunk's rows are filled in
+	// the first time its ownership is resolved; until then readers work it out tile by tile.
+	unsigned int terrainSeed;
+	unsigned char terrain[MAP_SIZE][MAP_SIZE];
+	unsigned char terrainReady[OWNERSHIP_CHUNKS];
+	int landYield[MAX_KINGDOMS][4]; // Per-turn yield of the land each kingdom owns, by ResourceType
+
+	void markTile(int x, int y);
+	void markChunk(int x);
+	void resolveOwnership();
+	void loadTile(ifstream& inFile);
+	void applyOwnership(int x, int y, int owner, int control);
+	static void resolveOwners(const int* layers, int layerStride, int layerCount, int count, int* owner, int* control);
+	static int diffuseRow(const int* up, const int* row, const int* down, int* out, int count, int falloff);
+	void generateTerrain(const vector<int>& chunks);
+	static Terrain generateTile(unsigned int seed, int x, int y);
+	void rebuildPyramid();
+	int levelWidth(int level) const;
+	int levelHeight(int level) const;
+	MapSummary& summaryAt(int level, int i, int j);
+	const MapSummary& summaryAt(int level, int i, int j) const;
 
 public:
 	Map();
 	Map(int w, int h);
+	Map(const Map&) = delete; // territoryControl points into the map itself
+	Map& operator=(const Map&) = delete;
 
+	int getWidth() const;
+	int getHeight() const;
 	bool isOccupied(int x, int y) const;
+	bool isInAttackRange(const Kingdom* attacker, const Kingdom* defender) const;
+	int getKingdomIndexAt(int x, int y) const;
+	int getTileOwner(int x, int y) const;
+	int getOwnedTiles(int kingdom) const;
+	Terrain getTerrain(int x, int y) const;
+	int getDefenseBonus(int x, int y) const; // Percent
+	int getSeatDefense(const Kingdom* kingdom) const; // Defence power with the ground its seat stands on
+	int getLandYield(int kingdom, ResourceType type) const;
+	void setTerrainSeed(unsigned int seed);
+	int movementCost(int x, int y) const;
+	void takeCostChanges(vector<TileChange>& changes);
+	void takeTileChanges(vector<Change>& out);
+	void takeTerritoryChanges(vector<int>& out);
 	void placeKingdom(Kingdom* kingdom, int x, int y);
 	bool moveKingdom(Kingdom* kingdom);
 	void expandTerritory(Kingdom* kingdom);
+	void updateInfluence(Kingdom* kingdoms[], int kingdomCount);
+	void attachFog(FogOfWar* visibility);
 
-	void displayMap() const;
+	void centerViewport(int x, int y);
+	void scrollViewport(int dx, int dy);
+
+	// As seen by the viewer, or everything for a viewer of -1
+	void displayMap(int viewer) const;
+	void displayViewport(int viewer) const;
+	void displayMinimap(int viewer) const;
 	void displayTerritory(Kingdom* kingdom) const;
 
-	void launchAttack(Kingdom* attacker, Kingdom* defender);
+	bool launchAttack(Kingdom* attacker, Kingdom* defender, BattleQueue& queue);
 
 	void saveToFile(ofstream& outFile);
 	void loadFromFile(ifstream& inFile);
+	void saveTile(ofstream& outFile, int tile);
+	void loadTiles(ifstream& inFile, int count);
+};
+
+class BattleQueue {
+private:
+	// Battle records are kept column-wise so the combat pass runs over contiguous arrays
+	vector<int> attackers;
+	vector<int> defenders;
+	vector<Military*> forces; // Marching army, or null when the whole kingdom attacks
+	vector<int> defenseBonus; // Percent, from the ground the defender holds
+	vector<int> attackPower;
+	vector<int> defensePower;
+	vector<int> attackRoll;
+	vector<int> defenseRoll;
+	vector<int> attackerCasualties;
+	vector<int> defenderCasualties;
+	vector<unsigned char> attackerWon;
+	vector<BattleReport> reports;
+
+public:
+	BattleQueue();
+
+	bool queueAttack(int attacker, int defender, int bonus, Military* army = nullptr);
+	int getPendingCount() const;
+
+	void resolve(Kingdom* kingdoms[], int kingdomCount, Arena& scratch);
+	const vector<BattleReport>& getReports() const;
+	void displayReports(Kingdom* kingdoms[]) const;
+	void clear();
+
+	static void resolveCombat(int count, const int* attack, const int* defense, const int* attackRolls,
+		const int* defenseRolls, int* attackerLosses, int* defenderLosses, unsigned char* won);
+};
+
+// A detached force marching across the map toward another kingdom
+struct Army {
+	int owner; // Kingdom indices
+	int target;
+	int x, y;
+	Military forces;
+	bool arrived; // Fought this turn, or gave up; survivors go home after the battles
+};
+
+class FlowFieldCache {
+private:
+	// Distance to the target for every tile, shared by all armies marching on that tile
+	struct Field {
+		int targetX, targetY;
+		vector<int> distance;
+		bool stale;
+		unsigned long long lastUsed;
+	};
+
+	vector<Field> fields;
+	unsigned long long useCounter;
+	int builds;
+	int hits;
+
+	void build(Field& field, const Map& map);
+	void propagate(Field& field, const Map& map, priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > >& open);
+
+public:
+	FlowFieldCache();
+
+	const vector<int>& getField(const Map& map, int targetX, int targetY);
+	void applyChanges(const Map& map, const vector<TileChange>& changes);
+	void clear();
+
+	int getBuildCount() const;
+	int getHitCount() const;
+};
+
+class ArmyManager {
+private:
+	vector<Army> armies;
+	FlowFieldCache flowFields;
+	vector<TileChange> changes;
+
+public:
+	ArmyManager();
+
+	bool dispatchArmy(Kingdom* kingdoms[], int owner, int target, int percent);
+	void advanceArmies(Kingdom* kingdoms[], Map& map, BattleQueue& battles);
+	void returnSurvivors(Kingdom* kingdoms[]);
+
+	int getArmyCount() const;
+	int getArmyCount(int owner) const;
+	const vector<Army>& getArmies() const;
+	void displayArmies(Kingdom* kingdoms[], const Map& map, int owner);
+
+	void saveToFile(ofstream& outFile);
+	void loadFromFile(ifstream& inFile);
+};
+
+// Goods on the road between two kingdoms' seats. Routes are laid once per pair of seats along the
+// army flow fields and shared by every caravan on them. Caravans are kept as columns, in the order
+// they set out, and the whole set is moved, looked up and resolved in one pass a turn.
+class CaravanManager {
+private:
+	struct Route {
+		int start; // First tile in routeTiles
+		int length; // Steps from the first tile to the last
+	};
+
+	vector<Route> routes;
+	vector<int> routeTiles; // Tile indices, x * MAP_SIZE + y, seat to seat
+	map<long long, int> routeIndex; // By origin and destination tile
+	FlowFieldCache flowFields;
+
+	vector<int> senders; // Kingdom indices
+	vector<int> receivers;
+	vector<int> origins; // Seat tile indices
+	vector<int> destinations;
+	vector<int> routeIds; // -1 until the next pass lays the route
+	vector<int> progress; // Steps taken along the route
+	vector<Resource> cargo;
+	vector<int> payouts; // Gold the sender is paid on arrival, for smuggled goods
+	vector<unsigned char> smuggled;
+
+	// Per-pass scratch, kept to avoid reallocating
+	vector<int> tileOwners;
+	vector<unsigned char> outcomes;
+
+	int layRoute(const Map& map, int origin, int destination);
+	void moveCaravan(int from, int to);
+	void resizeColumns(int count);
+
+public:
+	CaravanManager();
+
+	void dispatch(const Kingdom* sender, const Kingdom* receiver, const Resource& goods, bool isSmuggled, int payout);
+	void advance(Kingdom* kingdoms[], int kingdomCount, const Map& map, const DiplomacyManager& diplomacy);
+
+	int getCaravanCount() const;
+	int getCaravanCount(int kingdom) const;
+	int getRouteCount() const;
+	void displayCaravans(Kingdom* kingdoms[], int kingdom) const;
+
+	void saveToFile(ofstream& outFile);
+	void loadFromFile(ifstream& inFile);
+};
+
+// What each kingdom can see, one bit per tile in rows of whole 64-bit words. A kingdom sees
+// VISION_RADIUS tiles past its territory and around its seat and its armies. Territory bits follow
+// the map tile by tile; a kingdom's visible set is only rebuilt, a word at a time, once its
+// territory, seat or armies have moved. Seats once seen are remembered until their tile is seen
+// empty, so a kingdom can still plan against rivals that have dropped out of sight.
+class FogOfWar {
+private:
+	unsigned long long territory[MAX_KINGDOMS][VISION_WORDS];
+	unsigned long long visible[MAX_KINGDOMS][VISION_WORDS];
+	unsigned long long sightKeys[MAX_KINGDOMS]; // Seat and army positions the visible set was built for
+	bool territoryDirty[MAX_KINGDOMS];
+	int seatsSeen[MAX_KINGDOMS][MAX_KINGDOMS]; // Tile (x * MAP_SIZE + y) where each viewer last saw each seat, -1 if never
+	int width;
+	int height;
+
+	void rebuild(int kingdom, const Kingdom* seat, const vector<Army>& armies);
+	void rememberSeats(Kingdom* const kingdoms[], int kingdomCount);
+	void stamp(unsigned long long* bits, int x, int y) const;
+	unsigned long long rowMask(int word, int left, int right) const;
+
+public:
+	FogOfWar();
+
+	void clear(int mapWidth, int mapHeight);
+	void setOwner(int x, int y, int oldOwner, int owner);
+	void update(Kingdom* const kingdoms[], int kingdomCount, const vector<Army>& armies);
+
+	bool canSee(int kingdom, int x, int y) const;
+	bool knowsSeat(int viewer, int kingdom) const;
+	bool seesLand(int viewer, int owner) const; // Any tile of the owner's in the viewer's sight
+	// Tiles in [left, right) x [top, bottom) the viewer sees, counting only the owner's with owner >= 0
+	int countVisible(int viewer, int owner, int left, int top, int right, int bottom) const;
+	int countVisible(int viewer) const;
+
+	// Only the remembered seats; what is in sight now follows from the map and the armies
+	void saveToFile(ofstream& outFile);
+	void loadFromFile(ifstream& inFile);
+};
+
+class BattlePredictor {
+public:
+	static BattlePrediction predict(Kingdom* attacker, Kingdom* defender, const Map& map, int samples);
+	static BattlePrediction predict(int attackPower, int defensePower, int attackerUnits, int defenderUnits,
+		int defenderGold, int defenderFood, int samples, unsigned int seed);
+	static void display(const BattlePrediction& prediction);
+};
+
+class UtilityAI {
+private:
+	int startIndex; // Kingdoms that ran out of time last turn are evaluated first
+	int planningBudgetMicros;
+	int planIterations; // Per tree; 0 to think for as long as the budgets allow
+	int lastFull, lastReduced, lastFallback, lastPlanned, lastAsleep;
+	double lastMillis;
+	vector<unsigned char> asleep; // Idle kingdoms waiting on a scheduled wake-up
+	vector<unsigned char> human; // Kingdoms played by remote clients, never evaluated
+	EventScheduler* events;
+
+	static AIAction fallbackAction(const Kingdom* kingdom);
+	static AIAction chooseAction(Kingdom* kingdoms[], int kingdomCount, int self, const Map& map, const FogOfWar& fog,
+		const DiplomacyManager& diplomacy, const ArmyManager& armies, bool runPredictions, unsigned int seed);
+	static void applyAction(Kingdom* kingdoms[], int self, const AIAction& action, Map& map,
+		DiplomacyManager& diplomacy, MarketPlace& market, BattleQueue& battles, ArmyManager& armies);
+
+public:
+	UtilityAI();
+
+	void setPlanningBudget(int micros);
+	void setFixedWork(int iterations);
+	void attachScheduler(EventScheduler* scheduler);
+	void wake(int kingdom);
+	void setHumanControlled(int kingdom, bool controlled);
+	void takeTurns(World& world, int firstAI, int budgetMicros);
+	void displaySummary() const;
+};
+
+class MCTSPlanner {
+private:
+	struct Node {
+		AIAction action;
+		int parent;
+		int firstChild; // Children are stored contiguously, -1 until expanded
+		int childCount;
+		int visits;
+		double value;
+	};
+
+	static void searchTree(const SimState& root, chrono::steady_clock::time_point deadline, int maxIterations,
+		unsigned int seed, vector<int>& rootVisits, int& iterations);
+	static AIAction search(const SimState& root, int trees, chrono::steady_clock::time_point deadline, int maxIterations,
+		unsigned int seed, int* iterations);
+
+public:
+	static SimState capture(Kingdom* kingdoms[], int kingdomCount, int self, const DiplomacyManager& diplomacy,
+		const Map& map, const FogOfWar& fog);
+	static AIAction plan(const SimState& root, int budgetMicros, unsigned int seed, int* iterations);
+	// MCTS_FIXED_TREES trees of maxIterations each, whatever the clock and the number of threads
+	static AIAction plan(const SimState& root, int maxIterations, unsigned int seed);
+};
+
+// Kingdoms joined by alliances, directly or through other allies. Every kingdom carries its
+// bloc's id, so "which bloc" and "same bloc" are one lookup and safe to read from the AI's worker
+// threads. A new alliance relabels the smaller bloc; one that ends rebuilds only its own bloc from
+// the alliances still standing, which splits it when nothing else holds it together.
+class AllianceBlocs {
+private:
+	vector<int> bloc; // Bloc id per kingdom: the index of one of its members
+	vector<vector<int>> members; // Indexed by bloc id; empty for kingdoms that are not an id
+	vector<vector<int>> allies; // Direct alliances per kingdom
+	vector<char> seen; // Scratch for removeAlliance
+
+	void ensure(int kingdom);
+
+public:
+	void clear();
+	void addAlliance(int a, int b);
+	void removeAlliance(int a, int b);
+
+	int blocOf(int kingdom) const;
+	bool sameBloc(int a, int b) const;
+	int getBlocSize(int kingdom) const;
+	void getMembers(int kingdom, vector<int>& out) const;
 };
 
 class DiplomacyManager {
 private:
-	Treaty treaties[MAX_TREATIES];
-	int treatyCount;
+	CapacityPolicy::List<Treaty, MAX_TREATIES> treaties;
 	RelationshipStatus relations[MAX_KINGDOMS][MAX_KINGDOMS];
+	AllianceBlocs blocs; // Rebuilt from the treaties on load
+	int nextTreatyId;
+	EventScheduler* events;
+	vector<Change> changes; // Not yet collected by the change journal
+
+	int freeTreatySlot() const;
+	void endTreaty(Treaty& treaty);
 
 public:
 	DiplomacyManager();
 
+	void attachScheduler(EventScheduler* scheduler);
+	const Treaty* expireTreaty(int id);
+	void takeChanges(vector<Change>& out);
+
 	bool hasTreaty(Kingdom* k1, Kingdom* k2) const;
 	bool proposeTreaty(Kingdom* proposer, Kingdom* receiver);
+	bool proposeTreaty(Kingdom* proposer, Kingdom* receiver, TreatyType type, int duration);
 	bool breakTreaty(Kingdom* kingdom);
 	bool breakTreaty(Kingdom* k1, Kingdom* k2);
 
 	void viewTreaties(Kingdom* kingdom) const;
-	void checkRelations(Kingdom* kingdom) const;
+	void checkRelations(Kingdom* const kingdoms[], int kingdomCount, int kingdom) const;
 
-	void declareWar(Kingdom* declarer, Kingdom* target);
+	// The target's whole alliance bloc joins the war; returns how many allies were drawn in
+	int declareWar(Kingdom* const kingdoms[], int declarer, int target);
 	RelationshipStatus getRelationship(Kingdom* k1, Kingdom* k2) const;
+	const AllianceBlocs& getBlocs() const;
 
 	void updateRelations(Kingdom* k1, Kingdom* k2, int change);
 
@@ -295,12 +1360,23 @@ public:
 class MarketPlace {
 private:
 	int prices[4]; // Prices for gold, food, wood, stone
-	TradeOffer tradeOffers[MAX_TRADE_OFFERS];
-	int offerCount;
+	CapacityPolicy::List<TradeOffer, MAX_TRADE_OFFERS> tradeOffers;
+	int nextOfferId;
+	EventScheduler* events;
+	CaravanManager* caravans; // Null to hand goods over at once
+	vector<Change> changes; // Not yet collected by the change journal
+
+	int valueOf(const Resource& goods) const;
+	void ship(Kingdom* sender, Kingdom* receiver, const Resource& goods);
 
 public:
 	MarketPlace();
 
+	void attachScheduler(EventScheduler* scheduler);
+	void attachCaravans(CaravanManager* manager);
+	bool expireOffer(int id);
+	void takeChanges(vector<Change>& out);
+
 	void displayPrices() const;
 	void updatePrices();
 
@@ -308,10 +1384,14 @@ public:
 	void sellResources(Kingdom* kingdom);
 
 	bool proposeTrade(Kingdom* offerer, Kingdom* receiver);
+	bool proposeTrade(Kingdom* offerer, Kingdom* receiver, const Resource& offering, const Resource& requesting);
 	void viewTradeOffers(Kingdom* kingdom) const;
-	bool respondToOffer(Kingdom* kingdom, int offerIndex, bool accept);
+	bool respondToOffer(Kingdom* const kingdoms[], int kingdomCount, Kingdom* kingdom);
+	bool respondToOffer(Kingdom* const kingdoms[], int kingdomCount, Kingdom* kingdom, int offerIndex, bool accept);
+	void answerOffers(Kingdom* const kingdoms[], int kingdomCount, int kingdom); // For the AI
 
-	void initiateSmuggling(Kingdom* kingdom);
+	void initiateSmuggling(Kingdom* smuggler, Kingdom* buyer);
+	bool initiateSmuggling(Kingdom* smuggler, Kingdom* buyer, ResourceType type, int amount);
 
 	void saveToFile(ofstream& outFile);
 	void loadFromFile(ifstream& inFile);
@@ -319,12 +1399,18 @@ public:
 
 class CommunicationSystem {
 private:
-	Message messages[MAX_MESSAGES];
-	int messageCount;
+	CapacityPolicy::List<Message, MAX_MESSAGES> messages;
+	int nextMessageId;
+	EventScheduler* events;
+	vector<Change> changes; // Not yet collected by the change journal
 
 public:
 	CommunicationSystem();
 
+	void attachScheduler(EventScheduler* scheduler);
+	bool expireMessage(int id);
+	void takeChanges(vector<Change>& out);
+
 	void sendMessage(const char* sender, const char* receiver, const char* content);
 	void showMessages(const char* kingdomName);
 	void sendNewMessage(Kingdom* sender);
@@ -333,4 +1419,399 @@ public:
 	void loadFromFile(ifstream& inFile);
 };
 
+// Every kingdom's metrics for each turn, kept by column. The newest turns stay raw in the open
+// chunk; a full chunk is sealed into one delta + zigzag varint stream per metric and kingdom, so a
+// range query decodes only the column it reads. The turns kept are always consecutive: once the
+// sealed chunks pass HISTORY_MAX_BYTES the oldest is dropped, and a turn that does not follow the
+// last one starts the history over.
+class MetricsHistory {
+private:
+	struct Chunk {
+		int firstTurn;
+		int kingdomCount;
+		vector<int> offsets; // Start of column metric * kingdomCount + kingdom in data, then the end
+		vector<unsigned char> data;
+	};
+
+	deque<Chunk> sealed; // Each holds HISTORY_CHUNK_TURNS turns
+	size_t sealedBytes;
+	int openFirstTurn;
+	int openTurns;
+	int openKingdoms;
+	int open[METRIC_COUNT][MAX_KINGDOMS][HISTORY_CHUNK_TURNS];
+
+	void seal();
+	static void decodeColumn(const Chunk& chunk, int column, int* values);
+
+public:
+	MetricsHistory();
+
+	void clear();
+	void record(int turn, Kingdom* const kingdoms[], int kingdomCount, const Map& map);
+
+	int getFirstTurn() const; // -1 while empty
+	int getLastTurn() const;
+	size_t getBytesUsed() const;
+	// Values for consecutive turns within [fromTurn, toTurn]; returns the turn of the first, or -1
+	int query(int kingdom, Metric metric, int fromTurn, int toTurn, vector<int>& values) const;
+
+	static const char* metricName(Metric metric);
+	static bool findMetric(const char* name, Metric& metric);
+
+	void displayChart(const Kingdom* kingdom, int index, Metric metric, int turns) const;
+	// One row per turn and kingdom, decoding a chunk at a time
+	void exportCSV(ostream& out, Kingdom* const kingdoms[], int kingdomCount) const;
+
+	void saveToFile(ofstream& outFile);
+	void loadFromFile(ifstream& inFile);
+};
+
+// Kingdoms ordered by a score, highest first and ties to the lower index, in a treap whose nodes
+// count their subtree. Nodes are indexed by kingdom, so moving a kingdom allocates nothing, and
+// placing, removing, ranking a kingdom and finding who holds a place all take O(log n).
+class OrderStatisticTree {
+private:
+	struct Node {
+		int score;
+		unsigned int priority;
+		int left, right; // -1 for none
+		int size; // Nodes in the subtree; 0 while the kingdom is not ranked
+	};
+
+	vector<Node> nodes;
+	int root;
+	unsigned int seed;
+
+	bool before(int a, int b) const; // Whether kingdom a ranks ahead of kingdom b
+	int sizeOf(int node) const;
+	void pull(int node);
+	int merge(int left, int right);
+	void split(int node, int key, int& left, int& right);
+	int erase(int node, int key);
+
+public:
+	OrderStatisticTree();
+
+	void clear();
+	void set(int kingdom, int score);
+	void remove(int kingdom);
+
+	bool contains(int kingdom) const;
+	int getScore(int kingdom) const;
+	int getCount() const;
+	int rankOf(int kingdom) const; // 1 for first place, 0 if not ranked
+	int kingdomAt(int rank) const; // -1 past the last place
+};
+
+// Military power, gold, population and territory boards. They are fed from the turn's change
+// journal, so only kingdoms whose fields changed are re-scored.
+class Leaderboards {
+private:
+	OrderStatisticTree boards[RANK_COUNT];
+
+public:
+	void clear();
+	void update(int index, const Kingdom& kingdom, unsigned int fields); // KingdomField bits
+	void updateTerritory(int index, int tiles);
+	void rebuild(Kingdom* const kingdoms[], int count, const Map& map);
+
+	const OrderStatisticTree& getBoard(Ranking ranking) const;
+	static const char* rankingName(Ranking ranking);
+	static bool findRanking(const char* name, Ranking& ranking);
+
+	void display(Kingdom* const kingdoms[], int viewer, int top) const;
+};
+
+// Owns all game state. Everything is placed in one arena, so starting a new game or loading a
+// save resets the arena instead of freeing each object; temporaries for a turn go in scratch.
+// Kingdoms, the map and the record lists flag what they change, and the end of each turn gathers
+// the flags into a journal with one entry per changed subject, so saving and reporting a turn
+// cost what the turn changed rather than the size of the world.
+class World {
+private:
+	Arena arena;
+	Arena scratch;
+	vector<GameEvent> dueEvents;
+	vector<int> changedTerritories;
+	vector<Change> journal; // Changes made during journalTurn
+	int journalTurn;
+
+	void collectChanges();
+	void rankTerritories();
+
+public:
+	Kingdom* kingdoms[MAX_KINGDOMS];
+	int kingdomCount;
+	Map* map;
+	MarketPlace* market;
+	DiplomacyManager* diplomacy;
+	CommunicationSystem* comms;
+	BattleQueue* battles;
+	UtilityAI* ai;
+	ArmyManager* armies;
+	CaravanManager* caravans;
+	EventScheduler* events;
+	FogOfWar* fog;
+	MetricsHistory* history;
+	Leaderboards* rankings;
+
+	World();
+	World(const World&) = delete;
+	World& operator=(const World&) = delete;
+
+	void reset();
+	Kingdom* addKingdom(const char* name);
+	void attachScheduler();
+	void startNewGame(const char* playerName);
+
+	Arena& getScratch();
+	void updateVisibility();
+	void beginTurn();
+	void resolveBattles();
+	void endTurn();
+	void playTurn(int aiBudgetMicros);
+
+	const vector<Change>& getChanges() const;
+	int countChanges(ChangeKind kind) const;
+	void displayChanges(int kingdom) const;
+
+	void saveToFile(ofstream& outFile);
+	void loadFromFile(ifstream& inFile);
+	void saveChanges(ofstream& outFile); // The last turn's journal, applied over a save by loadChanges
+	bool loadChanges(ifstream& inFile);
+
+	void displayAllocatorStats() const;
+};
+
+// The text command language, one command per line: "build farm", "train archers 40",
+// "attack Eastfall", "end-turn 100", "history gold 50" and so on. Lines are split in place
+// without allocating and run the same game logic as the menus, for one kingdom. Every command
+// appends one reply line: "ok", "error <reason>", or the data asked for. Names with spaces are
+// written with underscores.
+class CommandInterpreter {
+private:
+	World& world;
+	int self;
+	int aiBudgetMicros;
+	int maxTurns; // Per end-turn command
+	int turnsPlayed;
+
+	int findKingdom(const char* name) const; // -1 for none, or for the interpreter's own kingdom
+
+public:
+	CommandInterpreter(World& gameWorld, int kingdom, int aiBudget, int turnLimit);
+
+	// False for an unknown command, with nothing appended, so callers can handle their own
+	bool execute(char* line, string& reply);
+	int getTurnsPlayed() const;
+
+	// Splits at blanks; the last word keeps the rest of the line. Returns the number of words.
+	static int splitWords(char* line, char** words, int maxWords);
+};
+
+#ifndef _WIN32
+// Log2 histogram of latencies, written by one thread and read by any
+struct LatencyHistogram {
+	atomic<unsigned long long> buckets[LATENCY_BUCKETS];
+
+	LatencyHistogram();
+	void record(long long micros);
+	unsigned long long count() const;
+	long long percentile(double fraction) const; // Upper bound of the bucket, in microseconds
+};
+
+struct ShardStats {
+	LatencyHistogram latency; // From reading a command to answering it
+	atomic<int> games;
+	atomic<int> clients;
+
+	ShardStats();
+};
+
+struct PollEvent {
+	int fd;
+	bool readable; // Also set on hang-up and errors, which a read reports
+	bool writable;
+};
+
+// Readiness notification over many sockets: epoll on Linux, poll() elsewhere. Level triggered.
+class EventPoller {
+private:
+	int epollFd; // -1 when using poll()
+	vector<int> fds; // poll() fallback
+	vector<unsigned char> writeWanted;
+
+public:
+	EventPoller();
+	~EventPoller();
+	EventPoller(const EventPoller&) = delete;
+	EventPoller& operator=(const EventPoller&) = delete;
+
+	void add(int fd);
+	void setWritable(int fd, bool wanted);
+	void remove(int fd);
+	int wait(int timeoutMillis, vector<PollEvent>& events);
+};
+
+// Builds one frame of the binary protocol at the end of a send buffer, in place
+class WireWriter {
+private:
+	string& buffer;
+	size_t start;
+
+public:
+	WireWriter(string& out, unsigned char type);
+	void u8(int value);
+	void i32(int value);
+	void text(const char* value); // u8 length, then the bytes
+	void finish(); // Fills in the length
+};
+
+// Reads the payload of one frame where it lies in the receive buffer. Reading past the end
+// yields zeros and clears ok().
+class WireReader {
+private:
+	const unsigned char* data;
+	int size;
+	int position;
+	bool valid;
+
+public:
+	WireReader(const char* payload, int length);
+	int u8();
+	int i32();
+	void text(char* out, int capacity);
+	bool ok() const;
+
+	// Size of the complete frame at the front of data, 0 if more bytes are needed, -1 if invalid
+	static int frameSize(const char* data, size_t available);
+};
+
+// Opens "host:port" as TCP or anything else as a Unix socket path; -1 on failure
+int openSocket(const string& address, bool listening);
+
+// Hosts many independent games in one process. Every game lives on one shard, a thread pinned to
+// a core with its own event loop, so games never share state or locks. The acceptor deals
+// connections out round-robin and a client joining a game on another shard is handed over to it.
+// Clients speak either the text protocol (single-player games) or, after sending WIRE_MAGIC, the
+// binary protocol (multiplayer games where every kingdom is a seat and turns are played in
+// lockstep once all seated players have ended theirs).
+class GameServer {
+private:
+	struct Connection {
+		int fd;
+		int gameId; // -1 until the client creates or joins a game
+		int seat; // Kingdom played, -1 for none
+		int pending; // Commands queued in the game and not yet answered
+		bool binary;
+		bool closing; // Close once pending commands are answered and the output is flushed
+		bool writeWatched;
+		bool dirty; // On the shard's flush list
+		string input;
+		string output;
+		size_t outputSent;
+	};
+
+	struct PendingCommand {
+		int fd;
+		string command; // A text line or a binary frame
+		chrono::steady_clock::time_point received;
+	};
+
+	struct HostedGame {
+		World world;
+		deque<PendingCommand> commands;
+		bool ready; // Queued in the shard's ready list
+		bool multiplayer;
+		int seats[MAX_KINGDOMS]; // Connection playing each kingdom, -1 for the AI
+		bool turnEnded[MAX_KINGDOMS];
+	};
+
+	struct Shard {
+		thread worker;
+		int wakeFds[2]; // Self-pipe for handovers and shutdown
+		mutex mailboxLock;
+		vector<Connection> mailbox;
+		EventPoller poller;
+		map<int, Connection> connections; // By socket
+		vector<int> dirty; // Connections with output to send at the end of the pass
+		vector<unique_ptr<HostedGame>> games; // Game id / shard count
+		deque<int> ready; // Games with commands waiting, served round-robin
+		ShardStats stats;
+	};
+
+	string address;
+	int listenFd;
+	int stopFds[2];
+	atomic<bool> stopping;
+	atomic<int> nextShard;
+	vector<unique_ptr<Shard>> shards;
+
+	void shardLoop(int index);
+	void handOver(int index, Connection& connection);
+	bool readInput(Connection& connection);
+	bool takeInput(int index, Connection& connection);
+	void queueCommand(int index, Connection& connection, const char* command, size_t length);
+	int sessionCommand(int index, Connection& connection, const string& line);
+	int sessionFrame(int index, Connection& connection, const char* payload, int length, unsigned char type);
+	void gameCommand(int index, HostedGame& game, Connection& connection, const string& line);
+	void gameFrame(int index, HostedGame& game, Connection& connection, const string& frame);
+	HostedGame* createGame(int index, const char* playerName, bool multiplayer, int& gameId);
+	void endTurnIfReady(int index, HostedGame& game);
+	void releaseSeat(int index, Connection& connection);
+	void runRound(int index);
+	void markDirty(int index, Connection& connection);
+	void flush(int index, Connection& connection);
+	HostedGame* findGame(int index, int gameId);
+
+public:
+	GameServer(const char* listenAddress, int shardCount);
+	~GameServer();
+	GameServer(const GameServer&) = delete;
+	GameServer& operator=(const GameServer&) = delete;
+
+	bool run(); // Blocks until stop(); false if the socket cannot be opened
+	void stop(); // Safe to call from a signal handler
+
+	string describeShards() const;
+};
+
+// Scripted clients for load testing: groups of players share a multiplayer game and play a number
+// of turns with a few random actions each, all from one thread.
+class BotSwarm {
+private:
+	struct Bot {
+		int fd;
+		int group;
+		int seat;
+		int turnsLeft;
+		bool joined;
+		string input;
+		string output;
+		size_t outputSent;
+		chrono::steady_clock::time_point turnStarted;
+	};
+
+	string address;
+	vector<Bot> bots;
+	vector<int> groupGames; // Game id per group, -1 until its first player has created it
+	EventPoller poller;
+	LatencyHistogram turnLatency;
+	unsigned int rng;
+	unsigned long long framesSent, framesReceived, errors;
+
+	void sendJoin(int index, int gameId);
+	void playTurn(Bot& bot);
+	void handleFrame(int index, unsigned char type, const char* payload, int length);
+	void flush(Bot& bot);
+
+public:
+	BotSwarm(const char* serverAddress);
+
+	// False if no bot could connect
+	bool run(int players, int playersPerGame, int turns);
+	void displayResults(double seconds) const;
+};
+#endif
+
 #endif // STRONGHOLD_Hheaderfile
\ No newline at end of file
@@ -1,19 +1,17 @@
 #include "Stronghold.h"
 #include<cstring>
 #include <limits>
+#include <climits>
+#include <csignal>
+#include <iomanip>
 
 // Global variables
-Kingdom* kingdoms[MAX_KINGDOMS];
-int kingdomCount = 0;
-Map* gameMap;
-MarketPlace* market;
-DiplomacyManager* diplomacy;
-CommunicationSystem* comms;
+World world;
 
 // Function prototypes
 void initializeGame();
 void gameLoop();
-void saveGameState();
+void saveGameState(bool fullSnapshot);
 void loadGameState();
 void displayKingdomMenu(Kingdom* kingdom);
 void handleKingdomAction(Kingdom* kingdom);
@@ -21,14 +19,30 @@ void handleDiplomacyAction(Kingdom* kingdom);
 void handleTradeAction(Kingdom* kingdom);
 void handleWarAction(Kingdom* kingdom);
 void handleMapAction(Kingdom* kingdom);
+void handleHistoryAction(Kingdom* kingdom);
 void simulateOtherKingdoms();
 Kingdom* selectTargetKingdom(Kingdom* currentKingdom);
 void clearScreen();
+void showEvents();
 void waitForEnter();
+int runServer(int argc, char* argv[]);
+int runBots(int argc, char* argv[]);
+int runScript(int argc, char* argv[]);
+int runLogView(int argc, char* argv[]);
+int runBench(int argc, char* argv[]);
 
-int main() {
+int main(int argc, char* argv[]) {
 	srand(static_cast<unsigned int>(time(nullptr)));
 
+	// Unit types are data driven; the built-in catalog is used when units.txt is missing
+	UnitCatalog::shared().loadFromFile("units.txt");
+
+	if (argc > 1 && strcmp(argv[1], "--server") == 0) return runServer(argc, argv);
+	if (argc > 1 && strcmp(argv[1], "--bots") == 0) return runBots(argc, argv);
+	if (argc > 1 && strcmp(argv[1], "--script") == 0) return runScript(argc, argv);
+	if (argc > 1 && strcmp(argv[1], "--log-view") == 0) return runLogView(argc, argv);
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0) return runBench(argc, argv);
+
 	cout << "===============================\n";
 	cout << "      STRONGHOLD GAME          \n";
 	cout << "===============================\n";
@@ -49,86 +63,45 @@ int main() {
 
 	gameLoop();
 
-	// Clean up
-	for (int i = 0; i < kingdomCount; i++) {
-		delete kingdoms[i];
-	}
-	delete gameMap;
-	delete market;
-	delete diplomacy;
-	delete comms;
-
 	return 0;
 }
 
 void initializeGame() {
-	gameMap = new Map(MAP_SIZE, MAP_SIZE);
-	market = new MarketPlace();
-	diplomacy = new DiplomacyManager();
-	comms = new CommunicationSystem();
-
 	cout << "Enter a name for your kingdom: ";
 	char kingdomName[MAX_NAME_LENGTH];
 	cin.ignore();
 	cin.getline(kingdomName, MAX_NAME_LENGTH);
 
-	kingdoms[0] = new Kingdom(kingdomName);
-	kingdomCount++;
-
-	int x = rand() % MAP_SIZE;
-	int y = rand() % MAP_SIZE;
-	gameMap->placeKingdom(kingdoms[0], x, y);
-
-	const char* aiNames[] = { "Northland", "Westeros", "Eastfall", "Southreach" };
-	for (int i = 0; i < 4; i++) {
-		kingdoms[kingdomCount] = new Kingdom(aiNames[i]);
-		kingdoms[kingdomCount]->addGold(500 + rand() % 500);
-		kingdoms[kingdomCount]->addFood(300 + rand() % 300);
-		kingdoms[kingdomCount]->addWood(400 + rand() % 200);
-		kingdoms[kingdomCount]->addStone(200 + rand() % 200);
-		kingdoms[kingdomCount]->recruitSoldiers(50 + rand() % 50);
-
-		bool validPosition = false;
-		int kx, ky;
-		while (!validPosition) {
-			kx = rand() % MAP_SIZE;
-			ky = rand() % MAP_SIZE;
-			if (!gameMap->isOccupied(kx, ky)) {
-				validPosition = true;
-			}
-		}
-		gameMap->placeKingdom(kingdoms[kingdomCount], kx, ky);
-		kingdomCount++;
-	}
+	world.startNewGame(kingdomName);
 
-	cout << "Game initialized with " << kingdomCount << " kingdoms!\n";
+	cout << "Game initialized with " << world.kingdomCount << " kingdoms!\n";
 	waitForEnter();
 }
 
 void gameLoop() {
 	bool gameRunning = true;
-	int turn = 1;
 
 	while (gameRunning) {
+		world.beginTurn();
 		clearScreen();
-		cout << "======= TURN " << turn << " =======\n";
+		cout << "======= TURN " << world.events->getCurrentTurn() << " =======\n";
 
-		Kingdom* playerKingdom = kingdoms[0];
+		Kingdom* playerKingdom = world.kingdoms[0];
 		displayKingdomMenu(playerKingdom);
 
 		simulateOtherKingdoms();
 
-		for (int i = 0; i < kingdomCount; i++) {
-			kingdoms[i]->processTurn();
-		}
+		world.resolveBattles();
+		world.battles->displayReports(world.kingdoms);
+		if (!world.battles->getReports().empty()) waitForEnter();
 
+		world.endTurn();
 		if (playerKingdom->getPopulation() <= 0) {
 			cout << "Your kingdom has fallen! Game over!\n";
 			gameRunning = false;
 		}
 
-		turn++;
-		saveGameState();
+		saveGameState(false);
 	}
 }
 
@@ -138,6 +111,7 @@ void displayKingdomMenu(Kingdom* kingdom) {
 		clearScreen();
 		cout << "====== " << kingdom->getName() << " ======\n";
 		kingdom->displayStatus();
+		world.displayChanges(0);
 
 		cout << "\nOptions:\n";
 		cout << "1. Internal Kingdom Management\n";
@@ -148,6 +122,9 @@ void displayKingdomMenu(Kingdom* kingdom) {
 		cout << "6. Messages and Communication\n";
 		cout << "7. End Turn\n";
 		cout << "8. Save and Exit\n";
+		cout << "9. Allocator Statistics\n";
+		cout << "10. History and Charts\n";
+		cout << "11. Rankings\n";
 
 		int choice;
 		cout << "Enter your choice: ";
@@ -167,12 +144,19 @@ void displayKingdomMenu(Kingdom* kingdom) {
 		case 4: handleWarAction(kingdom); break;
 		case 5: handleMapAction(kingdom); break;
 		case 6:
-			comms->showMessages(kingdom->getName());
-			comms->sendNewMessage(kingdom);
+			world.comms->showMessages(kingdom->getName());
+			world.comms->sendNewMessage(kingdom);
 			waitForEnter();
 			break;
 		case 7: backToMain = true; break;
-		case 8: saveGameState(); exit(0);
+		case 8: saveGameState(true); exit(0);
+		case 9: world.displayAllocatorStats(); waitForEnter(); break;
+		case 10: handleHistoryAction(kingdom); break;
+		case 11:
+			world.rankings->update(0, *kingdom, ALL_FIELDS);
+			world.rankings->display(world.kingdoms, 0, LEADERBOARD_TOP);
+			waitForEnter();
+			break;
 		default: cout << "Invalid option.\n"; waitForEnter();
 		}
 	}
@@ -202,7 +186,7 @@ void handleKingdomAction(Kingdom* kingdom) {
 	switch (subchoice) {
 	case 1: kingdom->buildStructure(); break;
 	case 2: kingdom->recruitUnits(); break;
-	case 3: kingdom->collectTaxes(); break;
+	case 3: kingdom->collectTaxes(*world.map); break;
 	case 4: kingdom->researchTechnology(); break;
 	case 5: kingdom->managePopulation(); break;
 	case 6: return;
@@ -232,14 +216,14 @@ void handleDiplomacyAction(Kingdom* kingdom) {
 	}
 
 	switch (subchoice) {
-	case 1: diplomacy->viewTreaties(kingdom); break;
+	case 1: world.diplomacy->viewTreaties(kingdom); break;
 	case 2: {
 		Kingdom* target = selectTargetKingdom(kingdom);
-		if (target) diplomacy->proposeTreaty(kingdom, target);
+		if (target) world.diplomacy->proposeTreaty(kingdom, target);
 		break;
 	}
-	case 3: diplomacy->breakTreaty(kingdom); break;
-	case 4: diplomacy->checkRelations(kingdom); break;
+	case 3: world.diplomacy->breakTreaty(kingdom); break;
+	case 4: world.diplomacy->checkRelations(world.kingdoms, world.kingdomCount, kingdom->getIndex()); break;
 	case 5: return;
 	default: cout << "Invalid option.\n";
 	}
@@ -255,7 +239,8 @@ void handleTradeAction(Kingdom* kingdom) {
 	cout << "4. Propose Trade Deal\n";
 	cout << "5. View Trade Offers\n";
 	cout << "6. Smuggling Operations\n";
-	cout << "7. Back\n";
+	cout << "7. View Caravans\n";
+	cout << "8. Back\n";
 
 	int subchoice;
 	cout << "Enter your choice: ";
@@ -269,17 +254,25 @@ void handleTradeAction(Kingdom* kingdom) {
 	}
 
 	switch (subchoice) {
-	case 1: market->displayPrices(); break;
-	case 2: market->buyResources(kingdom); break;
-	case 3: market->sellResources(kingdom); break;
+	case 1: world.market->displayPrices(); break;
+	case 2: world.market->buyResources(kingdom); break;
+	case 3: world.market->sellResources(kingdom); break;
 	case 4: {
 		Kingdom* target = selectTargetKingdom(kingdom);
-		if (target) market->proposeTrade(kingdom, target);
+		if (target) world.market->proposeTrade(kingdom, target);
 		break;
 	}
-	case 5: market->viewTradeOffers(kingdom); break;
-	case 6: market->initiateSmuggling(kingdom); break;
-	case 7: return;
+	case 5:
+		world.market->viewTradeOffers(kingdom);
+		world.market->respondToOffer(world.kingdoms, world.kingdomCount, kingdom);
+		break;
+	case 6: {
+		Kingdom* target = selectTargetKingdom(kingdom);
+		if (target) world.market->initiateSmuggling(kingdom, target);
+		break;
+	}
+	case 7: world.caravans->displayCaravans(world.kingdoms, kingdom->getIndex()); break;
+	case 8: return;
 	default: cout << "Invalid option.\n";
 	}
 	waitForEnter();
@@ -292,9 +285,11 @@ void handleWarAction(Kingdom* kingdom) {
 	cout << "2. Train Troops\n";
 	cout << "3. Declare War\n";
 	cout << "4. Launch Attack\n";
-	cout << "5. Fortify Position\n";
-	cout << "6. Spy on Kingdom\n";
-	cout << "7. Back\n";
+	cout << "5. March Army\n";
+	cout << "6. View Armies\n";
+	cout << "7. Fortify Position\n";
+	cout << "8. Spy on Kingdom\n";
+	cout << "9. Back\n";
 
 	int subchoice;
 	cout << "Enter your choice: ";
@@ -312,21 +307,51 @@ void handleWarAction(Kingdom* kingdom) {
 	case 2: kingdom->trainTroops(); break;
 	case 3: {
 		Kingdom* target = selectTargetKingdom(kingdom);
-		if (target) diplomacy->declareWar(kingdom, target);
+		if (target) world.diplomacy->declareWar(world.kingdoms, kingdom->getIndex(), target->getIndex());
 		break;
 	}
 	case 4: {
 		Kingdom* target = selectTargetKingdom(kingdom);
-		if (target) gameMap->launchAttack(kingdom, target);
+		if (!target) break;
+		BattlePredictor::display(BattlePredictor::predict(kingdom, target, *world.map, PLAYER_PREDICTION_SAMPLES));
+		cout << "Launch the attack? (y/n): ";
+		char confirm;
+		cin >> confirm;
+		if (confirm == 'y' || confirm == 'Y') world.map->launchAttack(kingdom, target, *world.battles);
 		break;
 	}
-	case 5: kingdom->fortify(); break;
-	case 6: {
+	case 5: {
 		Kingdom* target = selectTargetKingdom(kingdom);
-		if (target) kingdom->spyOn(target);
+		if (!target) break;
+		cout << "Percentage of the army to send (1-100): ";
+		int percent;
+		cin >> percent;
+		if (cin.fail() || percent < 1 || percent > 100) {
+			cin.clear();
+			cin.ignore(numeric_limits<streamsize>::max(), '\n');
+			cout << "Invalid percentage.\n";
+			break;
+		}
+		int owner = world.map->getKingdomIndexAt(kingdom->getX(), kingdom->getY());
+		int targetIndex = world.map->getKingdomIndexAt(target->getX(), target->getY());
+		if (world.armies->dispatchArmy(world.kingdoms, owner, targetIndex, percent)) {
+			cout << "The army marches on " << target->getName() << ".\n";
+		}
+		else {
+			cout << "No troops to send!\n";
+		}
 		break;
 	}
-	case 7: return;
+	case 6: world.armies->displayArmies(world.kingdoms, *world.map, world.map->getKingdomIndexAt(kingdom->getX(), kingdom->getY())); break;
+	case 7: kingdom->fortify(); break;
+	case 8: {
+		Kingdom* target = selectTargetKingdom(kingdom);
+		if (!target) break;
+		world.updateVisibility();
+		kingdom->spyOn(target, world.fog->canSee(kingdom->getIndex(), target->getX(), target->getY()));
+		break;
+	}
+	case 9: return;
 	default: cout << "Invalid option.\n";
 	}
 	waitForEnter();
@@ -336,10 +361,11 @@ void handleMapAction(Kingdom* kingdom) {
 	clearScreen();
 	cout << "===== Map View =====\n";
 	cout << "1. View World Map\n";
-	cout << "2. View Territory Details\n";
-	cout << "3. Move Kingdom\n";
-	cout << "4. Expand Territory\n";
-	cout << "5. Back\n";
+	cout << "2. Scroll Map View\n";
+	cout << "3. View Territory Details\n";
+	cout << "4. Move Kingdom\n";
+	cout << "5. Expand Territory\n";
+	cout << "6. Back\n";
 
 	int subchoice;
 	cout << "Enter your choice: ";
@@ -353,44 +379,108 @@ void handleMapAction(Kingdom* kingdom) {
 	}
 
 	switch (subchoice) {
-	case 1: gameMap->displayMap(); break;
-	case 2: gameMap->displayTerritory(kingdom); break;
-	case 3: gameMap->moveKingdom(kingdom); break;
-	case 4: gameMap->expandTerritory(kingdom); break;
-	case 5: return;
+	case 1:
+		world.map->centerViewport(kingdom->getX(), kingdom->getY());
+		world.updateVisibility();
+		world.map->displayMap(kingdom->getIndex());
+		break;
+	case 2: {
+		cout << "Direction (w/a/s/d) and distance: ";
+		char direction;
+		int distance;
+		cin >> direction >> distance;
+		if (cin.fail()) {
+			cin.clear();
+			cin.ignore(numeric_limits<streamsize>::max(), '\n');
+			cout << "Invalid input.\n";
+			break;
+		}
+		switch (direction) {
+		case 'w': case 'W': world.map->scrollViewport(0, -distance); break;
+		case 's': case 'S': world.map->scrollViewport(0, distance); break;
+		case 'a': case 'A': world.map->scrollViewport(-distance, 0); break;
+		case 'd': case 'D': world.map->scrollViewport(distance, 0); break;
+		default: cout << "Invalid direction.\n"; break;
+		}
+		world.updateVisibility();
+		world.map->displayMap(kingdom->getIndex());
+		break;
+	}
+	case 3: world.map->displayTerritory(kingdom); break;
+	case 4: world.map->moveKingdom(kingdom); break;
+	case 5: world.map->expandTerritory(kingdom); break;
+	case 6: return;
 	default: cout << "Invalid option.\n";
 	}
 	waitForEnter();
 }
 
-void simulateOtherKingdoms() {
-	for (int i = 1; i < kingdomCount; i++) {
-		Kingdom* aiKingdom = kingdoms[i];
-		int action = rand() % 5;
-		switch (action) {
-		case 0: aiKingdom->collectTaxes(); break;
-		case 1: aiKingdom->buildStructure(); break;
-		case 2: aiKingdom->recruitUnits(); break;
-		case 3: aiKingdom->trainTroops(); break;
-		case 4: aiKingdom->managePopulation(); break;
+void handleHistoryAction(Kingdom* kingdom) {
+	clearScreen();
+	cout << "===== History and Charts =====\n";
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		cout << m + 1 << ". Chart " << MetricsHistory::metricName((Metric)m) << "\n";
+	}
+	cout << METRIC_COUNT + 1 << ". Export History to history.csv\n";
+	cout << METRIC_COUNT + 2 << ". Back\n";
+
+	int subchoice;
+	cout << "Enter your choice: ";
+	cin >> subchoice;
+	if (cin.fail()) {
+		cin.clear();
+		cin.ignore(numeric_limits<streamsize>::max(), '\n');
+		cout << "Invalid input.\n";
+		waitForEnter();
+		return;
+	}
+
+	if (subchoice >= 1 && subchoice <= METRIC_COUNT) {
+		int turns;
+		cout << "Number of turns to chart: ";
+		cin >> turns;
+		if (cin.fail() || turns <= 0) {
+			cin.clear();
+			cin.ignore(numeric_limits<streamsize>::max(), '\n');
+			cout << "Invalid input.\n";
 		}
-		if (rand() % 10 < 3) {
-			int targetIndex = rand() % kingdomCount;
-			if (targetIndex != i) {
-				diplomacy->proposeTreaty(aiKingdom, kingdoms[targetIndex]);
-			}
+		else {
+			world.history->displayChart(kingdom, 0, (Metric)(subchoice - 1), turns);
 		}
 	}
-	cout << "\nAI kingdoms have taken their turns.\n";
+	else if (subchoice == METRIC_COUNT + 1) {
+		ofstream csvFile("history.csv");
+		if (csvFile) {
+			world.history->exportCSV(csvFile, world.kingdoms, world.kingdomCount);
+			cout << "History exported to history.csv.\n";
+		}
+		else {
+			cout << "Error writing history.csv.\n";
+		}
+	}
+	else if (subchoice == METRIC_COUNT + 2) {
+		return;
+	}
+	else {
+		cout << "Invalid option.\n";
+	}
+	waitForEnter();
+}
+
+void simulateOtherKingdoms() {
+	world.ai->takeTurns(world, 1, AI_TURN_BUDGET_MICROS);
+	showEvents();
+	cout << "\n";
+	world.ai->displaySummary();
 }
 
 Kingdom* selectTargetKingdom(Kingdom* currentKingdom) {
 	clearScreen();
 	cout << "Select target kingdom:\n";
 	int validCount = 0;
-	for (int i = 0; i < kingdomCount; i++) {
-		if (kingdoms[i] != currentKingdom) {
-			cout << validCount + 1 << ". " << kingdoms[i]->getName() << endl;
+	for (int i = 0; i < world.kingdomCount; i++) {
+		if (world.kingdoms[i] != currentKingdom) {
+			cout << validCount + 1 << ". " << world.kingdoms[i]->getName() << endl;
 			validCount++;
 		}
 	}
@@ -405,8 +495,8 @@ Kingdom* selectTargetKingdom(Kingdom* currentKingdom) {
 	}
 	if (choice == validCount + 1) return nullptr;
 	int index = 0, counter = 0;
-	for (int i = 0; i < kingdomCount; i++) {
-		if (kingdoms[i] != currentKingdom) {
+	for (int i = 0; i < world.kingdomCount; i++) {
+		if (world.kingdoms[i] != currentKingdom) {
 			counter++;
 			if (counter == choice) {
 				index = i;
@@ -414,24 +504,33 @@ Kingdom* selectTargetKingdom(Kingdom* currentKingdom) {
 			}
 		}
 	}
-	return kingdoms[index];
+	return world.kingdoms[index];
 }
 
-void saveGameState() {
+// The save is a snapshot followed by the change journal of every later turn, so saving at the end
+// of a turn appends only what the turn changed. The snapshot is rewritten every
+// SAVE_SNAPSHOT_INTERVAL turns, on the first save of a session, and when saving mid-turn.
+static int turnsSinceSnapshot = -1;
+
+void saveGameState(bool fullSnapshot) {
+	if (!fullSnapshot && turnsSinceSnapshot >= 0 && turnsSinceSnapshot < SAVE_SNAPSHOT_INTERVAL) {
+		ofstream journalFile("savegame.journal", ios::binary | ios::app);
+		if (journalFile) {
+			world.saveChanges(journalFile);
+			turnsSinceSnapshot++;
+			cout << "Game saved successfully!\n";
+			return;
+		}
+	}
 	ofstream outFile("savegame.dat", ios::binary);
 	if (!outFile) {
 		cout << "Error saving game.\n";
 		return;
 	}
-	outFile.write((char*)&kingdomCount, sizeof(kingdomCount));
-	for (int i = 0; i < kingdomCount; i++) {
-		kingdoms[i]->saveToFile(outFile);
-	}
-	gameMap->saveToFile(outFile);
-	diplomacy->saveToFile(outFile);
-	market->saveToFile(outFile);
-	comms->saveToFile(outFile);
+	world.saveToFile(outFile);
 	outFile.close();
+	ofstream journalFile("savegame.journal", ios::binary | ios::trunc);
+	turnsSinceSnapshot = 0;
 	cout << "Game saved successfully!\n";
 }
 
@@ -442,30 +541,19 @@ void loadGameState() {
 		initializeGame();
 		return;
 	}
-	for (int i = 0; i < kingdomCount; i++) {
-		delete kingdoms[i];
-		kingdoms[i] = nullptr;
-	}
-	delete gameMap;
-	delete market;
-	delete diplomacy;
-	delete comms;
-
-	inFile.read((char*)&kingdomCount, sizeof(kingdomCount));
-	for (int i = 0; i < kingdomCount; i++) {
-		kingdoms[i] = new Kingdom();
-		kingdoms[i]->loadFromFile(inFile);
-	}
-	gameMap = new Map();
-	gameMap->loadFromFile(inFile);
-	diplomacy = new DiplomacyManager();
-	diplomacy->loadFromFile(inFile);
-	market = new MarketPlace();
-	market->loadFromFile(inFile);
-	comms = new CommunicationSystem();
-	comms->loadFromFile(inFile);
+	world.loadFromFile(inFile);
+	if (!inFile) {
+		cout << "The saved game is damaged.\n";
+		initializeGame();
+		return;
+	}
 	inFile.close();
-	cout << "Game loaded successfully!\n";
+	ifstream journalFile("savegame.journal", ios::binary);
+	int turns = 0;
+	while (journalFile && world.loadChanges(journalFile)) turns++;
+	cout << "Game loaded successfully";
+	if (turns > 0) cout << " (" << turns << " turns replayed from the journal)";
+	cout << "!\n";
 }
 
 void clearScreen() {
@@ -476,8 +564,308 @@ void clearScreen() {
 #endif
 }
 
+// Game logic only records events; this is where the player gets to read them
+void showEvents() {
+	vector<LogRecord> events;
+	EventLog::shared().drain(events);
+	for (size_t i = 0; i < events.size(); i++) {
+		cout << EventLog::describe(events[i], world.kingdoms, world.kingdomCount) << "\n";
+	}
+}
+
 void waitForEnter() {
+	showEvents();
 	cout << "\nPress Enter to continue...";
 	cin.ignore(numeric_limits<streamsize>::max(), '\n');
 	cin.get();
-}
\ No newline at end of file
+}
+
+#ifndef _WIN32
+static GameServer* activeServer = nullptr;
+
+static void stopServer(int) {
+	if (activeServer) activeServer->stop();
+}
+#endif
+
+static void reportEventLog() {
+	EventLog& log = EventLog::shared();
+	log.close();
+	cout << log.getWritten() << " events logged, " << log.getDropped() << " dropped.\n";
+}
+
+// Usage: --server [address] [shards] [event log], where the address is host:port or a Unix socket path
+int runServer(int argc, char* argv[]) {
+#ifdef _WIN32
+	cout << "Server mode needs POSIX sockets and is not available on this platform.\n";
+	return 1;
+#else
+	const char* address = argc > 2 ? argv[2] : "stronghold.sock";
+	int shardCount = argc > 3 ? atoi(argv[3]) : (int)thread::hardware_concurrency();
+	if (shardCount < 1) shardCount = 1;
+	if (argc > 4) {
+		if (!EventLog::shared().openFile(argv[4])) {
+			cout << "Cannot write " << argv[4] << ".\n";
+			return 1;
+		}
+		EventLog::shared().startWriter();
+	}
+	GameServer server(address, shardCount);
+	activeServer = &server;
+	signal(SIGINT, stopServer);
+	signal(SIGTERM, stopServer);
+	cout << "Hosting games on " << address << " with " << shardCount << " shards. Press Ctrl+C to stop.\n";
+	bool served = server.run();
+	activeServer = nullptr;
+	cout << server.describeShards() << endl;
+	if (argc > 4) reportEventLog();
+	return served ? 0 : 1;
+#endif
+}
+
+// Usage: --bots <address> [players] [turns] [players per game]
+int runBots(int argc, char* argv[]) {
+#ifdef _WIN32
+	cout << "Bot mode needs POSIX sockets and is not available on this platform.\n";
+	return 1;
+#else
+	if (argc < 3) {
+		cout << "Usage: --bots <address> [players] [turns] [players per game]\n";
+		return 1;
+	}
+	int players = argc > 3 ? max(1, atoi(argv[3])) : 100;
+	int turns = argc > 4 ? max(1, atoi(argv[4])) : 20;
+	int playersPerGame = argc > 5 ? max(1, atoi(argv[5])) : 5;
+	BotSwarm swarm(argv[2]);
+	cout << "Connecting " << players << " players to " << argv[2] << " for " << turns << " turns...\n";
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+	if (!swarm.run(players, playersPerGame, turns)) {
+		cout << "No player could connect to " << argv[2] << ".\n";
+		return 1;
+	}
+	swarm.displayResults(chrono::duration<double>(chrono::steady_clock::now() - started).count());
+	return 0;
+#endif
+}
+
+// The player owns the first kingdom; the AI plays the rest with the server's budgets, counted in
+// work rather than time so that a seeded script plays the same game every run
+static void claimScriptKingdom() {
+	world.ai->setHumanControlled(0, true);
+	world.ai->setPlanningBudget(SERVER_AI_PLANNING_MICROS);
+	world.ai->setFixedWork(SCRIPT_PLAN_ITERATIONS);
+}
+
+// Usage: --script <file|-> [--verbose] [--log <file>]. Each line is a game command for the first
+// kingdom, answered on one line; the AI plays the others. Scripts can also use new, seed (a new game
+// from that seed), save, load, export (the metrics history as CSV) and quit. The game's events are
+// only shown with --verbose. The AI's budgets are counted in work rather than time here, so the same
+// seed and commands play the same game on any machine.
+int runScript(int argc, char* argv[]) {
+	bool verbose = false;
+	const char* logPath = nullptr;
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "--verbose") == 0) verbose = true;
+		else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) logPath = argv[++i];
+	}
+	if (argc < 3) {
+		cout << "Usage: --script <file|-> [--verbose] [--log <file>]\n";
+		return 1;
+	}
+	if (logPath && !EventLog::shared().openFile(logPath)) {
+		cout << "Cannot write " << logPath << ".\n";
+		return 1;
+	}
+	ifstream scriptFile;
+	if (strcmp(argv[2], "-") != 0) {
+		scriptFile.open(argv[2]);
+		if (!scriptFile) {
+			cout << "Cannot open " << argv[2] << ".\n";
+			return 1;
+		}
+	}
+	istream& script = strcmp(argv[2], "-") == 0 ? cin : scriptFile;
+	// Verbose runs drain the log themselves after each command
+	if (logPath && !verbose) EventLog::shared().startWriter();
+	ostream out(cout.rdbuf());
+	streambuf* gameOutput = cout.rdbuf();
+	if (!verbose) cout.rdbuf(nullptr);
+
+	world.startNewGame("Player");
+	claimScriptKingdom();
+	CommandInterpreter interpreter(world, 0, SERVER_AI_TURN_MICROS, INT_MAX);
+	char line[1024];
+	char* words[2];
+	string reply;
+	vector<LogRecord> events;
+	int lineNumber = 0, commands = 0, errors = 0;
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+	while (script.getline(line, sizeof(line)) || script.gcount() > 0) {
+		lineNumber++;
+		reply.clear();
+		if (script.fail()) {
+			// The line did not fit; skip the rest of it
+			script.clear();
+			script.ignore(numeric_limits<streamsize>::max(), '\n');
+			reply = "error line too long\n";
+		}
+		else {
+			char* start = line;
+			while (*start == ' ' || *start == '\t') start++;
+			if (*start == '\0' || *start == '#' || *start == '\r') continue;
+			char command[1024];
+			strcpy_s(command, start);
+			int count = CommandInterpreter::splitWords(command, words, 2);
+			const char* argument = count > 1 ? words[1] : nullptr;
+			if (strcmp(words[0], "quit") == 0) break;
+			else if (strcmp(words[0], "new") == 0) {
+				world.startNewGame(argument ? argument : "Player");
+				claimScriptKingdom();
+				reply = "ok\n";
+			}
+			else if (strcmp(words[0], "seed") == 0) {
+				// The game the script opened with came from an unseeded generator, so start again
+				if (argument) {
+					char name[MAX_NAME_LENGTH];
+					strcpy_s(name, world.kingdoms[0]->getName());
+					srand((unsigned int)strtoul(argument, nullptr, 10));
+					world.startNewGame(name);
+					claimScriptKingdom();
+				}
+				reply = argument ? "ok\n" : "error usage: seed <number>\n";
+			}
+			else if (strcmp(words[0], "save") == 0) {
+				ofstream outFile(argument ? argument : "script.dat", ios::binary);
+				if (outFile) world.saveToFile(outFile);
+				reply = outFile ? "ok\n" : "error cannot save\n";
+			}
+			else if (strcmp(words[0], "export") == 0) {
+				ofstream csvFile(argument ? argument : "history.csv");
+				if (csvFile) world.history->exportCSV(csvFile, world.kingdoms, world.kingdomCount);
+				reply = csvFile ? "ok\n" : "error cannot write\n";
+			}
+			else if (strcmp(words[0], "load") == 0) {
+				ifstream inFile(argument ? argument : "script.dat", ios::binary);
+				if (!inFile) reply = "error no saved game\n";
+				else {
+					world.loadFromFile(inFile);
+					reply = "ok\n";
+					// Whatever a damaged save left behind is not worth playing on
+					if (!inFile) {
+						world.startNewGame("Player");
+						reply = "error damaged save\n";
+					}
+					claimScriptKingdom();
+				}
+			}
+			else if (!interpreter.execute(start, reply)) {
+				reply = "error unknown command\n";
+			}
+		}
+		commands++;
+		if (verbose) {
+			events.clear();
+			EventLog::shared().drain(events);
+			for (size_t i = 0; i < events.size(); i++) {
+				out << EventLog::describe(events[i], world.kingdoms, world.kingdomCount) << "\n";
+			}
+		}
+		if (reply.compare(0, 5, "error") == 0) {
+			errors++;
+			out << "line " << lineNumber << ": ";
+		}
+		out << reply;
+	}
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+	cout.rdbuf(gameOutput);
+	int turns = interpreter.getTurnsPlayed();
+	out << commands << " commands, " << errors << " errors, " << turns << " turns in " << fixed << setprecision(3) << elapsed << " s";
+	if (elapsed > 0) out << " (" << (int)(turns / elapsed) << " turns/s, " << (int)(commands / elapsed) << " commands/s)";
+	out << endl;
+	if (logPath) reportEventLog();
+	return 0;
+}
+
+// Usage: --log-view <event log> [saved game]. Prints a log as text, naming kingdoms from the save.
+int runLogView(int argc, char* argv[]) {
+	if (argc < 3) {
+		cout << "Usage: --log-view <event log> [saved game]\n";
+		return 1;
+	}
+	vector<LogRecord> events;
+	if (!EventLog::readFile(argv[2], events)) {
+		cout << "Cannot read event log " << argv[2] << ".\n";
+		return 1;
+	}
+	if (argc > 3) {
+		ifstream inFile(argv[3], ios::binary);
+		if (!inFile) {
+			cout << "Cannot open " << argv[3] << ".\n";
+			return 1;
+		}
+		world.loadFromFile(inFile);
+		if (!inFile) {
+			cout << "The saved game " << argv[3] << " is damaged.\n";
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < events.size(); i++) {
+		const LogRecord& event = events[i];
+		cout << "game " << event.game << " turn " << event.turn << ": "
+			<< EventLog::describe(event, world.kingdoms, world.kingdomCount) << "\n";
+	}
+	cout << events.size() << " events.\n";
+	return 0;
+}
+
+// Usage: --bench [turns]. Times the same seeded workload on whichever capacity policy the build
+// uses: a hundred times as many turns of message, offer and treaty churn through the record lists
+// and the scheduler, then full turns with the AI playing every kingdom. Build once as is and once
+// with -DSTRONGHOLD_LARGE_WORLD to compare the two.
+int runBench(int argc, char* argv[]) {
+	int turns = argc > 2 ? max(1, atoi(argv[2])) : 2000;
+	ostream out(cout.rdbuf());
+	streambuf* gameOutput = cout.rdbuf();
+	cout.rdbuf(nullptr);
+
+	srand(1);
+	world.startNewGame("Player");
+	Kingdom** kingdoms = world.kingdoms;
+	int count = world.kingdomCount;
+	vector<GameEvent> due;
+	chrono::steady_clock::time_point started = chrono::steady_clock::now();
+	for (int turn = 0; turn < turns * 100; turn++) {
+		Kingdom* sender = kingdoms[turn % count];
+		Kingdom* receiver = kingdoms[(turn + 1) % count];
+		world.comms->sendMessage(sender->getName(), receiver->getName(), "Greetings");
+		world.market->proposeTrade(sender, receiver, Resource(1, 0, 0, 0), Resource(0, 1, 0, 0));
+		world.diplomacy->proposeTreaty(sender, receiver, PEACE, 3);
+		// Only the expiries; the rest of a turn would drown out the lists
+		world.events->advance(due);
+		for (size_t i = 0; i < due.size(); i++) {
+			if (due[i].type == EVENT_TREATY_EXPIRY) world.diplomacy->expireTreaty(due[i].subject);
+			else if (due[i].type == EVENT_OFFER_EXPIRY) world.market->expireOffer(due[i].subject);
+			else if (due[i].type == EVENT_MESSAGE_EXPIRY) world.comms->expireMessage(due[i].subject);
+		}
+	}
+	double churnSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+	srand(1);
+	world.startNewGame("Player");
+	world.ai->setPlanningBudget(SERVER_AI_PLANNING_MICROS);
+	world.ai->setFixedWork(SCRIPT_PLAN_ITERATIONS);
+	started = chrono::steady_clock::now();
+	for (int turn = 0; turn < turns; turn++) world.playTurn(SERVER_AI_TURN_MICROS);
+	double playSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+	cout.rdbuf(gameOutput);
+
+	out << CapacityPolicy::name << ": " << MAX_KINGDOMS << " kingdoms, " << MAP_SIZE << "x" << MAP_SIZE << " map, "
+		<< MAX_MESSAGES << " messages, " << MAX_TREATIES << " treaties, " << MAX_TRADE_OFFERS << " trade offers\n";
+	out << "sizeof Kingdom " << sizeof(Kingdom) << ", CommunicationSystem " << sizeof(CommunicationSystem)
+		<< ", DiplomacyManager " << sizeof(DiplomacyManager) << ", MarketPlace " << sizeof(MarketPlace) << ", Map " << sizeof(Map) << "\n";
+	out << fixed << setprecision(3);
+	out << "Record list churn: " << turns * 100 << " turns in " << churnSeconds << " s (" << (int)(turns * 100 / churnSeconds) << " turns/s)\n";
+	out << "AI turns: " << turns << " turns in " << playSeconds << " s (" << (int)(turns / playSeconds) << " turns/s)\n";
+	world.displayAllocatorStats();
+	return 0;
+}